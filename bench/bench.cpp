@@ -0,0 +1,232 @@
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <new>
+#include <string_view>
+#include "arena.hpp"
+#include "convert.hpp"
+#include "corpus.hpp"
+#include "formats.hpp"
+#include "io.hpp"
+
+/* ============================ *
+ *      Allocation counting     *
+ * ============================ */
+
+static std::atomic<u64> allocations{0};
+
+void* operator new(size_t size) {
+	allocations.fetch_add(1, std::memory_order_relaxed);
+	if (void* ptr = malloc(size ? size : 1))
+		return ptr;
+	throw std::bad_alloc();
+}
+
+void* operator new[](size_t size) {
+	return operator new(size);
+}
+
+void operator delete(void* ptr) noexcept              { free(ptr); }
+void operator delete[](void* ptr) noexcept            { free(ptr); }
+void operator delete(void* ptr, size_t) noexcept      { free(ptr); }
+void operator delete[](void* ptr, size_t) noexcept    { free(ptr); }
+
+/* =============== *
+ *      Stages     *
+ * =============== */
+
+struct Result {
+	double nsPerFile;
+	double mbPerSec;    // Of input, so stages can be compared
+	double outPerFile;  // Bytes, or negative for stages that don't output any
+	double allocsPerFile;
+};
+
+// Returned by stages that don't output bytes, like loading, so they don't get compared with ones that do
+constexpr static size_t NO_OUTPUT = SIZE_MAX;
+
+/**
+ * Runs `stage` over every file `reps` times and keeps the fastest run, as
+ * anything slower than that is just noise from elsewhere. `stage` returns how
+ * many bytes it output, or NO_OUTPUT.
+ */
+static Result run(size_t files, size_t inputBytes, int reps, const std::function<size_t(size_t)>& stage) {
+	Result result{};
+	double best = 1e300;
+
+	for (int rep = 0; rep < reps; rep++) {
+		u64 allocsBefore = allocations.load(std::memory_order_relaxed);
+		size_t outBytes = 0;
+		bool hasOutput = true;
+
+		auto start = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < files; i++) {
+			size_t out = stage(i);
+			if (out == NO_OUTPUT) {
+				hasOutput = false;
+			} else {
+				outBytes += out;
+			}
+		}
+		auto end = std::chrono::steady_clock::now();
+
+		double ns = std::chrono::duration<double, std::nano>(end - start).count();
+		if (ns < best) {
+			best = ns;
+			result.allocsPerFile = double(allocations.load(std::memory_order_relaxed) - allocsBefore) / files;
+			result.outPerFile = hasOutput ? double(outBytes) / files : -1;
+		}
+	}
+
+	result.nsPerFile = best / files;
+	result.mbPerSec = inputBytes / (best / 1e9) / (1024 * 1024);
+	return result;
+}
+
+static void printResult(const char* name, const Result& result) {
+	char out[32] = "-";
+	if (result.outPerFile >= 0)
+		snprintf(out, sizeof(out), "%.0f", result.outPerFile);
+
+	printf("%-10s %12.0f %10.1f %14s %12.1f\n", name, result.nsPerFile, result.mbPerSec, out, result.allocsPerFile);
+}
+
+static void printUsage(const char* argv0) {
+	fprintf(stderr, "Usage: %s [options]\n", argv0);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "  --files <n>     Number of files in the generated corpus (default: 1200)\n");
+	fprintf(stderr, "  --reps <n>      Times each stage is run, the fastest counts (default: 5)\n");
+	fprintf(stderr, "  --seed <n>      Seed for the corpus (default: 1)\n");
+	fprintf(stderr, "  --dump <dir>    Write the corpus out as .mio files and exit\n");
+}
+
+int main(int argc, char** argv) {
+	size_t numFiles = 1200;
+	int reps = 5;
+	u64 seed = 1;
+	fs::path dumpDir;
+
+	for (int i = 1; i < argc; i++) {
+		std::string_view arg = argv[i];
+
+		if (i + 1 >= argc) {
+			printUsage(argv[0]);
+			return 1;
+		}
+
+		const char* value = argv[++i];
+
+		if (arg == "--files") {
+			numFiles = strtoull(value, nullptr, 10);
+		} else if (arg == "--reps") {
+			reps = atoi(value);
+		} else if (arg == "--seed") {
+			seed = strtoull(value, nullptr, 10);
+		} else if (arg == "--dump") {
+			dumpDir = value;
+		} else {
+			printUsage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (!numFiles || reps < 1) {
+		printUsage(argv[0]);
+		return 1;
+	}
+
+	std::vector<std::vector<u8>> files = corpus::generateCorpus(numFiles, seed);
+	size_t inputBytes = numFiles * corpus::MIO_FILE_SIZE;
+
+	if (!dumpDir.empty()) {
+		fs::create_directories(dumpDir);
+		for (size_t i = 0; i < files.size(); i++) {
+			char name[32];
+			snprintf(name, sizeof(name), "%05zu.mio", i);
+			io::FileIO file(dumpDir / name, "wb");
+			file.writeVec(files[i]);
+		}
+		return 0;
+	}
+
+	// Half are cut off part way through the record, half aren't records at all
+	std::vector<std::vector<u8>> badFiles = files;
+	for (size_t i = 0; i < numFiles; i++) {
+		if (i % 2)
+			badFiles[i].resize(corpus::MIO_FILE_SIZE / 2);
+		else
+			badFiles[i][corpus::TITLE_TYPE_OFFSET] = 2;
+	}
+
+	// Inputs for each stage are prepared up front, so only the stage itself is timed
+	std::vector<MIO> mios(numFiles);
+	std::vector<Song> songs(numFiles);
+	std::vector<IT> modules(numFiles);
+	mio2it::Converter converter;
+
+	for (size_t i = 0; i < numFiles; i++) {
+		mios[i].load(files[i]);
+		songs[i].load(mios[i].recordData);
+		modules[i] = converter.convert(mios[i], songs[i]);
+	}
+
+	std::vector<u8> out;
+	using SaveFunc = void (*)(const IT& module, io::DataIO& file);
+	auto saveWith = [&](SaveFunc save) {
+		return [&, save](size_t i) {
+			io::VectorIO file(std::move(out));
+			file.vec().clear();
+			save(modules[i], file);
+			out = std::move(file.vec());
+			return out.size();
+		};
+	};
+
+	printf("%zu files, %zu bytes each, best of %d\n\n", numFiles, corpus::MIO_FILE_SIZE, reps);
+	printf("%-10s %12s %10s %14s %12s\n", "stage", "ns/file", "MB/s", "out bytes", "allocs/file");
+
+	MIO mio;
+	printResult("load", run(numFiles, inputBytes, reps, [&](size_t i) {
+		mio.load(files[i]);
+		return NO_OUTPUT;
+	}));
+
+	// Every one of them should be rejected, or this isn't timing what it says it is
+	size_t accepted = 0;
+	printResult("reject", run(numFiles, inputBytes, reps, [&](size_t i) {
+		accepted += bool(mio.tryLoad(badFiles[i]));
+		return NO_OUTPUT;
+	}));
+
+	if (accepted)
+		fprintf(stderr, "%zu bad files were loaded without an error\n", accepted);
+
+	Song song;
+	printResult("song", run(numFiles, inputBytes, reps, [&](size_t i) {
+		song.load(mios[i].recordData);
+		return NO_OUTPUT;
+	}));
+
+	Arena arena;
+	printResult("convert", run(numFiles, inputBytes, reps, [&](size_t i) {
+		arena.reset();
+		converter.convert(mios[i], songs[i], arena.resource());
+		return NO_OUTPUT;
+	}));
+
+	printResult("save-it", run(numFiles, inputBytes, reps, saveWith([](const IT& it, io::DataIO& file) { it.save(file); })));
+	printResult("save-xm", run(numFiles, inputBytes, reps, saveWith(formats::saveXM)));
+	printResult("save-mod", run(numFiles, inputBytes, reps, saveWith(formats::saveMOD)));
+	printResult("save-mid", run(numFiles, inputBytes, reps, saveWith(formats::saveMIDI)));
+
+	printResult("total", run(numFiles, inputBytes, reps, [&](size_t i) {
+		converter.convert(files[i], out);
+		return out.size();
+	}));
+
+	return 0;
+}
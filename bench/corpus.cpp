@@ -0,0 +1,115 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include "corpus.hpp"
+#include "endian.hpp"
+#include "mio.hpp"
+
+namespace corpus {
+
+// splitmix64, so output doesn't depend on the standard library's implementation
+class Random {
+public:
+	Random(u64 seed) : state_(seed) {}
+
+	u64 next() {
+		u64 z = (state_ += 0x9E3779B97F4A7C15);
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EB;
+		return z ^ (z >> 31);
+	}
+
+	u32 below(u32 n) {
+		return next() % n;
+	}
+
+	bool chance(float p) {
+		return (next() >> 40) < u64(p * (1 << 24));
+	}
+
+private:
+	u64 state_;
+};
+
+static void writeString(std::vector<u8>& out, size_t offset, const char* str, size_t size) {
+	memcpy(&out[offset], str, std::min(strlen(str), size - 1));
+}
+
+// Same layout MIO::load reads
+std::vector<u8> generate(const Params& params, u64 seed) {
+	std::vector<u8> out(MIO_FILE_SIZE);
+	Random rng(seed);
+	char text[32];
+
+	memcpy(&out[0], MIO::HEADER, sizeof(MIO::HEADER));
+
+	snprintf(text, sizeof(text), "Bench %llu", static_cast<unsigned long long>(seed));
+	writeString(out, 0x1C, text, 25);
+	writeString(out, 0x35, "mio2it", 19);
+	writeString(out, 0x48, "mio2it_bench", 19);
+	writeString(out, 0x5B, "Generated for benchmarking", 73);
+
+	out[TITLE_TYPE_OFFSET] = 1; // Record
+	writeString(out, 0xCF, "BNCH", 5);
+	u32 serial = LE(u32(seed));
+	memcpy(&out[0xD4], &serial, sizeof(serial));
+
+	size_t pos = 0x100;
+	out[pos++] = rng.below(2); // Swing
+	out[pos++] = params.tempo;
+	out[pos++] = params.endPhrase;
+	pos += 4;
+
+	u8 pan[MIO::Record::TRACK_COUNT + 1] = { 2, 2, 2, 2, 2 };
+
+	for (int p = 0; p < MIO::Record::MAX_PHRASES; p++) {
+		for (int t = 0; t < MIO::Record::TRACK_COUNT; t++) {
+			for (int n = 0; n < MIO::Record::TRACK_LENGTH; n++)
+				out[pos++] = rng.chance(params.density) ? rng.below(25) : MIO::Record::NO_NOTE;
+		}
+
+		for (int c = 0; c < MIO::Record::RHYTHM_SIMULTANEOUS_NOTES; c++) {
+			for (int n = 0; n < MIO::Record::TRACK_LENGTH; n++)
+				out[pos++] = rng.chance(params.density) ? rng.below(12) : MIO::Record::NO_NOTE;
+		}
+
+		for (int t = 0; t <= MIO::Record::TRACK_COUNT; t++)
+			out[pos++] = rng.below(5); // Volume
+
+		if (params.panChanges) {
+			for (u8& value : pan)
+				value = rng.below(5);
+		}
+
+		for (int t = 0; t <= MIO::Record::TRACK_COUNT; t++)
+			out[pos++] = pan[t];
+
+		for (int t = 0; t <= MIO::Record::TRACK_COUNT; t++)
+			out[pos++] = rng.below(10); // Instrument set
+
+		pos += 5;
+	}
+
+	return out;
+}
+
+std::vector<std::vector<u8>> generateCorpus(size_t count, u64 seed) {
+	constexpr float DENSITIES[] = { 0.0f, 0.05f, 0.25f, 0.5f, 0.75f, 1.0f };
+
+	std::vector<std::vector<u8>> files;
+	files.reserve(count);
+
+	for (size_t i = 0; i < count; i++) {
+		Params params;
+		params.density = DENSITIES[i % std::size(DENSITIES)];
+		params.endPhrase = 1 + (i / std::size(DENSITIES)) % MIO::Record::MAX_PHRASES;
+		params.tempo = (i / 7) % 12;
+		params.panChanges = (i / 3) % 2;
+
+		files.push_back(generate(params, seed + i));
+	}
+
+	return files;
+}
+
+} // namespace corpus
@@ -0,0 +1,28 @@
+#pragma once
+#include <vector>
+#include "types.hpp"
+
+/**
+ * Generates valid MIO records for benchmarking. The same seed always gives
+ * the same files on every platform, so results can be compared across
+ * machines and changes.
+ */
+namespace corpus {
+	constexpr size_t MIO_FILE_SIZE = 0x2000;
+	constexpr size_t TITLE_TYPE_OFFSET = 0xA4; // 1 for records
+
+	struct Params {
+		float density = 0.25f;  // Chance of each cell having a note, 0 is empty and 1 is every cell filled
+		u8 endPhrase = 24;      // 1..24
+		u8 tempo = 6;           // 0..11
+		bool panChanges = true; // Pan changes between phrases, otherwise it stays centred
+	};
+
+	std::vector<u8> generate(const Params& params, u64 seed);
+
+	/**
+	 * `count` files spread across every combination of density, length, tempo
+	 * and pan changes. Density goes from empty to full in steps.
+	 */
+	std::vector<std::vector<u8>> generateCorpus(size_t count, u64 seed = 1);
+} // namespace corpus
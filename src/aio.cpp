@@ -0,0 +1,539 @@
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include "aio.hpp"
+#include "io.hpp"
+#include "stats.hpp"
+
+#ifdef __linux__
+#include <atomic>
+#include <cerrno>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace aio {
+
+static void countIO(const Completion& done) {
+	if (done.error)
+		return;
+
+	if (done.op == Op::Read) {
+		MIO2IT_STAT_COUNT(reads, 1);
+		MIO2IT_STAT_COUNT(readBytes, done.data.size());
+	} else {
+		MIO2IT_STAT_COUNT(writes, 1);
+		MIO2IT_STAT_COUNT(writeBytes, done.data.size());
+	}
+}
+
+/* ==================== *
+ *      io_uring        *
+ * ==================== */
+
+#ifdef __linux__
+
+// Files are read in pieces this big to begin with, doubling for files that turn out bigger
+constexpr static size_t READ_CHUNK = 64 * 1024;
+
+/**
+ * Talks to the kernel directly rather than through liburing, there's only a
+ * handful of opcodes needed. Each request steps through opening, reading or
+ * writing until done, then closing, with only one step in flight at a time,
+ * so the number of requests in flight never goes past the ring's size.
+ */
+class IOUring : public Queue {
+public:
+	static std::unique_ptr<IOUring> create(unsigned depth) {
+		std::unique_ptr<IOUring> ring(new IOUring());
+		return ring->setup(depth) ? std::move(ring) : nullptr;
+	}
+
+	~IOUring() override {
+		// The kernel could still be writing into buffers, so everything has to come back first
+		backlog_.clear();
+		while (active_)
+			reap(true);
+
+		if (sqes_ != MAP_FAILED)
+			munmap(sqes_, sqesSize_);
+		if (cqRing_ != MAP_FAILED && cqRing_ != sqRing_)
+			munmap(cqRing_, cqRingSize_);
+		if (sqRing_ != MAP_FAILED)
+			munmap(sqRing_, sqRingSize_);
+		if (fd_ >= 0)
+			close(fd_);
+	}
+
+	void read(u64 tag, const fs::path& path) override {
+		start(std::make_unique<Request>(Op::Read, tag, path.string()));
+	}
+
+	void write(u64 tag, const fs::path& path, std::vector<u8> data) override {
+		start(std::make_unique<Request>(Op::Write, tag, path.string(), std::move(data)));
+	}
+
+	std::optional<Completion> wait() override {
+		MIO2IT_STAT_SCOPE("aio-wait");
+
+		if (!pending_)
+			return std::nullopt;
+
+		while (ready_.empty())
+			reap(true);
+
+		Completion done = std::move(ready_.front());
+		ready_.pop_front();
+		pending_--;
+
+		countIO(done);
+		return done;
+	}
+
+	size_t pending() const override { return pending_; }
+
+	const char* name() const override { return "io_uring"; }
+
+private:
+	enum class Stage : u8 {
+		Open,
+		Transfer,
+		Close
+	};
+
+	struct Request {
+		Op op;
+		u64 tag;
+		std::string path; // Has to stay put until it's been opened
+		std::vector<u8> data;
+		size_t done = 0;
+		int fd = -1;
+		Stage stage = Stage::Open;
+		std::error_code error;
+
+		Request(Op op, u64 tag, std::string path, std::vector<u8> data = {}) :
+			op(op), tag(tag), path(std::move(path)), data(std::move(data)) {}
+	};
+
+	int fd_ = -1;
+	unsigned entries_ = 0;
+
+	void* sqRing_ = MAP_FAILED;
+	void* cqRing_ = MAP_FAILED;
+	size_t sqRingSize_ = 0;
+	size_t cqRingSize_ = 0;
+	io_uring_sqe* sqes_ = static_cast<io_uring_sqe*>(MAP_FAILED);
+	size_t sqesSize_ = 0;
+
+	unsigned* sqTail_;
+	unsigned* sqMask_;
+	unsigned* sqArray_;
+	unsigned* cqHead_;
+	unsigned* cqTail_;
+	unsigned* cqMask_;
+	io_uring_cqe* cqes_;
+
+	unsigned queued_ = 0; // Filled in but not yet handed to the kernel
+	unsigned active_ = 0;
+	size_t pending_ = 0;
+	std::deque<std::unique_ptr<Request>> backlog_;
+	std::deque<Completion> ready_;
+
+	IOUring() = default;
+
+	static int enter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+		return syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0);
+	}
+
+	bool setup(unsigned depth) {
+		io_uring_params params{};
+		params.flags = IORING_SETUP_CLAMP;
+
+		fd_ = syscall(__NR_io_uring_setup, std::max(depth, 1u), &params);
+		if (fd_ < 0)
+			return false;
+
+		if (!supportsOps())
+			return false;
+
+		entries_ = params.sq_entries;
+
+		sqRingSize_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+		cqRingSize_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+		// Newer kernels let both rings share one mapping
+		bool singleMap = params.features & IORING_FEAT_SINGLE_MMAP;
+		if (singleMap)
+			sqRingSize_ = cqRingSize_ = std::max(sqRingSize_, cqRingSize_);
+
+		sqRing_ = mmap(nullptr, sqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+		if (sqRing_ == MAP_FAILED)
+			return false;
+
+		cqRing_ = singleMap ? sqRing_ : mmap(nullptr, cqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+		if (cqRing_ == MAP_FAILED)
+			return false;
+
+		sqesSize_ = params.sq_entries * sizeof(io_uring_sqe);
+		sqes_ = static_cast<io_uring_sqe*>(mmap(nullptr, sqesSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES));
+		if (sqes_ == MAP_FAILED)
+			return false;
+
+		u8* sq = static_cast<u8*>(sqRing_);
+		u8* cq = static_cast<u8*>(cqRing_);
+
+		sqTail_  = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+		sqMask_  = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+		sqArray_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+		cqHead_  = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+		cqTail_  = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+		cqMask_  = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+		cqes_    = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+		return true;
+	}
+
+	// Opening and closing through the ring only came along in 5.6, older kernels get threads instead
+	bool supportsOps() {
+		constexpr unsigned MAX_OPS = 256;
+
+		std::vector<u8> buf(sizeof(io_uring_probe) + MAX_OPS * sizeof(io_uring_probe_op));
+		io_uring_probe* probe = reinterpret_cast<io_uring_probe*>(buf.data());
+
+		if (syscall(__NR_io_uring_register, fd_, IORING_REGISTER_PROBE, probe, MAX_OPS) < 0)
+			return false;
+
+		for (u8 op : { IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_CLOSE }) {
+			if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+				return false;
+		}
+
+		return true;
+	}
+
+	void start(std::unique_ptr<Request> request) {
+		pending_++;
+
+		if (active_ >= entries_) {
+			backlog_.push_back(std::move(request));
+			return;
+		}
+
+		active_++;
+		prepare(request.release());
+	}
+
+	// Fills in the next step for `request`. It's owned by the ring until it comes back out in reap()
+	void prepare(Request* request) {
+		unsigned tail = *sqTail_;
+		unsigned index = tail & *sqMask_;
+
+		io_uring_sqe* sqe = &sqes_[index];
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->user_data = reinterpret_cast<u64>(request);
+
+		switch (request->stage) {
+			case Stage::Open: {
+				sqe->opcode = IORING_OP_OPENAT;
+				sqe->fd = AT_FDCWD;
+				sqe->addr = reinterpret_cast<u64>(request->path.c_str());
+				sqe->len = 0644;
+				sqe->open_flags = O_CLOEXEC | (request->op == Op::Read ? O_RDONLY : O_WRONLY | O_CREAT | O_TRUNC);
+				break;
+			}
+
+			case Stage::Transfer: {
+				sqe->opcode = request->op == Op::Read ? IORING_OP_READ : IORING_OP_WRITE;
+				sqe->fd = request->fd;
+				sqe->addr = reinterpret_cast<u64>(request->data.data() + request->done);
+				sqe->len = std::min<size_t>(request->data.size() - request->done, 1u << 30);
+				sqe->off = request->done;
+				break;
+			}
+
+			case Stage::Close: {
+				sqe->opcode = IORING_OP_CLOSE;
+				sqe->fd = request->fd;
+				break;
+			}
+		}
+
+		sqArray_[index] = index;
+		std::atomic_ref(*sqTail_).store(tail + 1, std::memory_order_release);
+		queued_++;
+	}
+
+	// Hands over everything queued up, then goes through whatever's finished
+	void reap(bool wait) {
+		int submitted;
+		do {
+			submitted = enter(fd_, queued_, wait ? 1 : 0, IORING_ENTER_GETEVENTS);
+		} while (submitted < 0 && errno == EINTR);
+
+		if (submitted < 0)
+			throw std::system_error(errno, std::generic_category(), "io_uring_enter");
+
+		queued_ -= submitted;
+
+		unsigned head = *cqHead_;
+		unsigned tail = std::atomic_ref(*cqTail_).load(std::memory_order_acquire);
+
+		for (; head != tail; head++) {
+			const io_uring_cqe& cqe = cqes_[head & *cqMask_];
+			advance(reinterpret_cast<Request*>(cqe.user_data), cqe.res);
+		}
+
+		std::atomic_ref(*cqHead_).store(head, std::memory_order_release);
+	}
+
+	// Moves `request` on to its next step after one finished with `res`
+	void advance(Request* request, int res) {
+		if (res == -EINTR || res == -EAGAIN) {
+			prepare(request);
+			return;
+		}
+
+		switch (request->stage) {
+			case Stage::Open: {
+				if (res < 0) {
+					request->error = std::error_code(-res, std::generic_category());
+					finish(request);
+					return;
+				}
+
+				request->fd = res;
+				request->stage = Stage::Transfer;
+
+				if (request->op == Op::Read)
+					request->data.resize(READ_CHUNK);
+				else if (request->data.empty())
+					request->stage = Stage::Close;
+				break;
+			}
+
+			case Stage::Transfer: {
+				if (res < 0) {
+					request->error = std::error_code(-res, std::generic_category());
+					request->stage = Stage::Close;
+					break;
+				}
+
+				if (request->op == Op::Read) {
+					if (res == 0) {
+						request->data.resize(request->done);
+						request->stage = Stage::Close;
+						break;
+					}
+
+					request->done += res;
+					if (request->done == request->data.size())
+						request->data.resize(request->data.size() * 2);
+				} else {
+					if (res == 0) {
+						request->error = std::make_error_code(std::errc::io_error);
+						request->stage = Stage::Close;
+						break;
+					}
+
+					request->done += res;
+					if (request->done == request->data.size())
+						request->stage = Stage::Close;
+				}
+				break;
+			}
+
+			case Stage::Close: {
+				if (res < 0 && !request->error)
+					request->error = std::error_code(-res, std::generic_category());
+				finish(request);
+				return;
+			}
+		}
+
+		prepare(request);
+	}
+
+	void finish(Request* finished) {
+		std::unique_ptr<Request> request(finished);
+
+		if (request->error && request->op == Op::Read)
+			request->data.clear();
+
+		ready_.push_back({ request->op, request->tag, std::move(request->data), request->error });
+		active_--;
+
+		if (!backlog_.empty()) {
+			active_++;
+			prepare(backlog_.front().release());
+			backlog_.pop_front();
+		}
+	}
+};
+
+#endif
+
+/* ===================== *
+ *      Thread pool      *
+ * ===================== */
+
+static Completion readFile(u64 tag, const fs::path& path) {
+	Completion done{ Op::Read, tag, {}, {} };
+
+	io::FileIO file(path, "rb", false, false);
+	if (!file.isOpen()) {
+		done.error = file.error();
+		return done;
+	}
+
+	u8 buf[64 * 1024];
+	while (size_t read = file.read(buf, 1, sizeof(buf)))
+		done.data.insert(done.data.end(), buf, buf + read);
+
+	if (file.error()) {
+		done.error = file.error();
+		done.data.clear();
+	}
+
+	return done;
+}
+
+static Completion writeFile(u64 tag, const fs::path& path, std::vector<u8> data) {
+	Completion done{ Op::Write, tag, std::move(data), {} };
+
+	io::FileIO file(path, "wb", false);
+	if (file.isOpen()) {
+		file.writeVec(done.data);
+		file.close();
+	}
+
+	done.error = file.error();
+	return done;
+}
+
+// Plain blocking IO, just spread across enough threads to keep `depth` requests going
+class ThreadPool : public Queue {
+public:
+	explicit ThreadPool(unsigned depth) {
+		for (unsigned i = 0; i < std::max(depth, 1u); i++)
+			threads_.emplace_back(&ThreadPool::work, this);
+	}
+
+	~ThreadPool() override {
+		{
+			std::lock_guard lock(mutex_);
+			stopping_ = true;
+			jobs_.clear();
+		}
+
+		jobReady_.notify_all();
+		for (std::thread& t : threads_)
+			t.join();
+	}
+
+	void read(u64 tag, const fs::path& path) override {
+		push({ Op::Read, tag, path, {} });
+	}
+
+	void write(u64 tag, const fs::path& path, std::vector<u8> data) override {
+		push({ Op::Write, tag, path, std::move(data) });
+	}
+
+	std::optional<Completion> wait() override {
+		MIO2IT_STAT_SCOPE("aio-wait");
+
+		if (!pending_)
+			return std::nullopt;
+
+		std::unique_lock lock(mutex_);
+		jobDone_.wait(lock, [this] { return !completed_.empty(); });
+
+		Completion done = std::move(completed_.front());
+		completed_.pop_front();
+		pending_--;
+
+		countIO(done);
+		return done;
+	}
+
+	size_t pending() const override { return pending_; }
+
+	const char* name() const override { return "threads"; }
+
+private:
+	struct Job {
+		Op op;
+		u64 tag;
+		fs::path path;
+		std::vector<u8> data;
+	};
+
+	std::vector<std::thread> threads_;
+	std::mutex mutex_;
+	std::condition_variable jobReady_;
+	std::condition_variable jobDone_;
+	std::deque<Job> jobs_;
+	std::deque<Completion> completed_;
+	size_t pending_ = 0; // Only touched by the queue's own thread
+	bool stopping_ = false;
+
+	void push(Job job) {
+		pending_++;
+
+		{
+			std::lock_guard lock(mutex_);
+			jobs_.push_back(std::move(job));
+		}
+
+		jobReady_.notify_one();
+	}
+
+	void work() {
+		for (;;) {
+			Job job;
+
+			{
+				std::unique_lock lock(mutex_);
+				jobReady_.wait(lock, [this] { return stopping_ || !jobs_.empty(); });
+
+				if (stopping_)
+					return;
+
+				job = std::move(jobs_.front());
+				jobs_.pop_front();
+			}
+
+			Completion done = job.op == Op::Read
+				? readFile(job.tag, job.path)
+				: writeFile(job.tag, job.path, std::move(job.data));
+
+			{
+				std::lock_guard lock(mutex_);
+				completed_.push_back(std::move(done));
+			}
+
+			jobDone_.notify_one();
+		}
+	}
+};
+
+std::unique_ptr<Queue> open(unsigned depth, Backend backend) {
+#ifdef __linux__
+	if (backend != Backend::Threads) {
+		if (std::unique_ptr<IOUring> ring = IOUring::create(depth))
+			return ring;
+	}
+#endif
+
+	if (backend == Backend::IOUring)
+		return nullptr;
+
+	return std::make_unique<ThreadPool>(depth);
+}
+
+} // namespace aio
@@ -0,0 +1,59 @@
+#pragma once
+#include <memory>
+#include <optional>
+#include <system_error>
+#include <vector>
+#include "filesystem.hpp"
+#include "types.hpp"
+
+/**
+ * Reads and writes whole files in the background, for batch mode. Lots of
+ * them can be in flight at once, so on slow or network storage the waiting
+ * overlaps with converting whatever's already been read, rather than each
+ * file being a round trip of its own. Uses io_uring where it's available, or
+ * a pool of threads doing plain blocking IO otherwise.
+ * Queues are only meant to be used from one thread.
+ */
+namespace aio {
+	enum class Backend {
+		Auto,
+		IOUring,
+		Threads
+	};
+
+	enum class Op : u8 {
+		Read,
+		Write
+	};
+
+	struct Completion {
+		Op op;
+		u64 tag;
+		std::vector<u8> data; // The whole file for reads, and handed back for writes
+		std::error_code error;
+	};
+
+	class Queue {
+	public:
+		virtual ~Queue() = default;
+
+		// `tag` is just handed back in the completion, to tell requests apart
+		virtual void read(u64 tag, const fs::path& path) = 0;
+		virtual void write(u64 tag, const fs::path& path, std::vector<u8> data) = 0;
+
+		// Blocks until a request is done. Completions come in whatever order they finish in
+		virtual std::optional<Completion> wait() = 0;
+
+		// Requests that haven't been handed back by wait() yet
+		virtual size_t pending() const = 0;
+
+		virtual const char* name() const = 0;
+	};
+
+	/**
+	 * Queues up to `depth` requests with the OS at a time, anything past that
+	 * waits its turn. Auto falls back to threads if io_uring is missing or
+	 * blocked, while asking for IOUring specifically returns null then.
+	 */
+	std::unique_ptr<Queue> open(unsigned depth, Backend backend = Backend::Auto);
+} // namespace aio
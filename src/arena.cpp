@@ -0,0 +1,36 @@
+#include <algorithm>
+#include "arena.hpp"
+
+Arena::Arena(size_t size) : buffer_(new std::byte[size]), size_(size) {
+	monotonic_.emplace(buffer_.get(), size_, &overflow_);
+}
+
+void Arena::reset() {
+	if (!overflow_.allocated) {
+		monotonic_->release();
+		return;
+	}
+
+	// Whatever didn't fit went to the heap, so make room for all of it next time
+	size_t size = std::max(size_ * 2, size_ + overflow_.allocated);
+
+	monotonic_.reset();
+	overflow_.allocated = 0;
+
+	buffer_.reset(new std::byte[size]);
+	size_ = size;
+	monotonic_.emplace(buffer_.get(), size_, &overflow_);
+}
+
+void* Arena::Overflow::do_allocate(size_t bytes, size_t alignment) {
+	allocated += bytes;
+	return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+}
+
+void Arena::Overflow::do_deallocate(void* ptr, size_t bytes, size_t alignment) {
+	std::pmr::new_delete_resource()->deallocate(ptr, bytes, alignment);
+}
+
+bool Arena::Overflow::do_is_equal(const std::pmr::memory_resource& other) const noexcept {
+	return this == &other;
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include <memory>
+#include <memory_resource>
+#include <optional>
+#include "types.hpp"
+
+/**
+ * Memory for one file's worth of conversion, thrown away all at once when
+ * moving on to the next. Starts off with a buffer of its own, and if a file
+ * needs more than that, the buffer grows on reset to fit it next time. So
+ * once a batch has seen its biggest file, converting doesn't touch the heap
+ * at all, and threads with their own arena never contend over the allocator.
+ * Not thread safe, use one per thread.
+ */
+class Arena {
+public:
+	constexpr static size_t DEFAULT_SIZE = 64 * 1024;
+
+	explicit Arena(size_t size = DEFAULT_SIZE);
+
+	Arena(const Arena&) = delete;
+	Arena& operator=(const Arena&) = delete;
+
+	std::pmr::memory_resource* resource() { return &*monotonic_; }
+
+	// Everything allocated from resource() is gone after this, so nothing using it can be kept around
+	void reset();
+
+	size_t size() const { return size_; }
+
+private:
+	// Passes through to the heap, remembering how much it had to give out
+	class Overflow : public std::pmr::memory_resource {
+	public:
+		size_t allocated = 0;
+
+	private:
+		void* do_allocate(size_t bytes, size_t alignment) override;
+		void do_deallocate(void* ptr, size_t bytes, size_t alignment) override;
+		bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override;
+	};
+
+	std::unique_ptr<std::byte[]> buffer_;
+	size_t size_;
+	Overflow overflow_;
+	std::optional<std::pmr::monotonic_buffer_resource> monotonic_;
+};
@@ -0,0 +1,36 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include "convert.hpp"
+#include "mio2it.h"
+
+int mio2it_convert(const uint8_t* mio, size_t mioSize, uint8_t** out, size_t* outSize, char* err, size_t errSize) {
+	try {
+		mio2it::Converter converter;
+		std::vector<u8> it;
+
+		if (auto converted = converter.tryConvert({ mio, mioSize }, it); !converted) {
+			if (err && errSize)
+				snprintf(err, errSize, "%s", converted.error().message().c_str());
+			return 1;
+		}
+
+		// Copied into malloc'd memory so it can be handed over the C boundary
+		*out = static_cast<uint8_t*>(malloc(it.size()));
+		if (!*out)
+			throw std::bad_alloc();
+
+		memcpy(*out, it.data(), it.size());
+		*outSize = it.size();
+		return 0;
+	} catch (std::exception& e) {
+		if (err && errSize)
+			snprintf(err, errSize, "%s", e.what());
+		return 1;
+	}
+}
+
+void mio2it_free(uint8_t* data) {
+	free(data);
+}
@@ -0,0 +1,493 @@
+#include <algorithm>
+#include <bit>
+#include <cstdio>
+#include <cstring>
+#include <unordered_map>
+#include "convert.hpp"
+#include "io.hpp"
+#include "psg.hpp"
+#include "stats.hpp"
+
+namespace mio2it {
+
+constexpr static u8 letterInAlphabet(char c) {
+	return c - ('A' - 1);
+}
+
+/**
+ * The game's SDAT instruments aren't shipped with us, so every instrument set
+ * is stood in for by a PSG tone. Melodic sets get a square wave with a duty
+ * cycle picked by the set number, and the rhythm track always gets noise.
+ */
+constexpr static u8 NOISE_WAVE = psg::DUTY_CYCLES;
+
+constexpr static u8 placeholderWave(u8 instrumentSet) {
+	return instrumentSet % psg::DUTY_CYCLES;
+}
+
+static IT::Sample makePSGSample(u8 wave) {
+	IT::Sample smpl;
+
+	smpl.flags = IT::SampleFlags(IT::ITSF_SAMPLE_HEADER | IT::ITSF_LOOP);
+	smpl.convertFlags = IT::ITSCF_SIGNED;
+
+	if (wave == NOISE_WAVE) {
+		strcpy(smpl.name, "PSG noise");
+		smpl.data.assign(psg::noise.begin(), psg::noise.end());
+		smpl.c5Speed = 32768;
+	} else {
+		snprintf(smpl.name, std::size(smpl.name), "PSG square %.1f%%", (wave + 1) * 12.5);
+		smpl.data.assign(psg::squares[wave].begin(), psg::squares[wave].end());
+		smpl.c5Speed = 16744; // One cycle is C-5 (523.25Hz)
+	}
+
+	smpl.length = smpl.data.size();
+	smpl.loopEnd = smpl.length;
+
+	return smpl;
+}
+
+/**
+ * Instruments and samples only depend on which instrument sets a record uses,
+ * so they are serialised once per combination and spliced into every module
+ * using it, rather than being rebuilt for every file in a batch.
+ */
+std::shared_ptr<const IT::PrelinkedSection> Converter::prelinkWaves(std::span<const u8> waves) {
+	// There's only 8 waves, so the order they're used in fits in 4 bits each
+	u32 key = 0;
+	for (u8 wave : waves)
+		key = (key << 4) | (wave + 1);
+
+	auto found = sections_.find(key);
+	if (found != sections_.end()) {
+		return found->second;
+	}
+
+	IT bank;
+	for (u8 wave : waves)
+		bank.samples.push_back(makePSGSample(wave));
+
+	auto section = std::make_shared<const IT::PrelinkedSection>(bank.prelink());
+	sections_.emplace(key, section);
+	return section;
+}
+
+static u8 instrumentWave(const Song::Instrument& instr) {
+	return instr.rhythm ? NOISE_WAVE : placeholderWave(instr.set);
+}
+
+// Waves for the melodic instrument sets, in the order they're first used, and then noise
+static std::pmr::vector<u8> usedWaves(std::span<const Song> songs, std::pmr::memory_resource* resource = std::pmr::get_default_resource()) {
+	std::pmr::vector<u8> waves(resource);
+	waves.reserve(NOISE_WAVE + 1);
+
+	auto add = [&](u8 wave) {
+		if (std::find(waves.begin(), waves.end(), wave) == waves.end())
+			waves.push_back(wave);
+	};
+
+	for (const Song& song : songs) {
+		for (const Song::Instrument& instr : song.instruments) {
+			if (!instr.rhythm)
+				add(instrumentWave(instr));
+		}
+	}
+
+	add(NOISE_WAVE);
+
+	return waves;
+}
+
+// Sample numbers are 1-based, 0 means no sample
+static std::pmr::vector<u8> mapSamples(const Song& song, std::span<const u8> waves, std::pmr::memory_resource* resource = std::pmr::get_default_resource()) {
+	std::pmr::vector<u8> sampleForInstrument(song.instruments.size(), resource);
+
+	for (size_t i = 0; i < song.instruments.size(); i++) {
+		auto found = std::find(waves.begin(), waves.end(), instrumentWave(song.instruments[i]));
+		sampleForInstrument[i] = found - waves.begin() + 1;
+	}
+
+	return sampleForInstrument;
+}
+
+// Where album songs set their tempo, past the song's own channels so it never has to fight them for an effect
+constexpr static u8 CONTROL_CHANNEL = Song::CHANNELS;
+
+constexpr static u8 CENTRE_PAN = 32;
+
+/**
+ * Merges the phrase's channels together into cells, only visiting rows that
+ * have something on them. Instrument and volume only go on a channel's first
+ * note, as they stay the same for the whole phrase and every format keeps
+ * them for notes that leave them out. With `useDefaults`, volume and pan the
+ * song's defaults already cover are left to the module header.
+ *
+ * At the start of an album song, every channel's pan and the tempo are set no
+ * matter what, and anything still ringing from the song before gets cut.
+ */
+static void convertPhrase(const Song& song, int index, std::span<const u8> sampleForInstrument, IT::Pattern& pattern, bool useDefaults, bool songStart = false) {
+	const Song::Phrase& phrase = song.phrases[index];
+	u32 activeRows = phrase.activeRows() | songStart;
+
+	pattern.rows = Song::ROWS;
+	pattern.cells.clear();
+	pattern.cells.reserve(std::popcount(activeRows) * Song::CHANNELS + songStart);
+
+	u32 started = 0; // Channels that have had their first note, bit per channel
+
+	for (u32 rows = activeRows; rows; rows &= rows - 1) {
+		u8 r = std::countr_zero(rows);
+
+		for (u8 c = 0; c < Song::CHANNELS; c++) {
+			const Song::Channel& ch = phrase.channels[c];
+			bool hasNote = ch.occupied & (1u << r);
+			bool hasPan = r == 0 && ((ch.pan != Song::NO_PAN && !(useDefaults && song.defaults.pan[c] != Song::NO_PAN)) || songStart);
+
+			if (!hasNote && !hasPan)
+				continue;
+
+			IT::Note note;
+
+			if (hasPan) {
+				// Pan is only set when it changes, and at the start of a song nothing has moved it from the centre yet
+				u8 pan = ch.pan != Song::NO_PAN ? ch.pan : CENTRE_PAN;
+				note.effect = letterInAlphabet('X');
+				note.param = std::min(255, pan * 4);
+			}
+
+			if (hasNote) {
+				note.note = ch.notes[r];
+
+				if (!(started & (1u << c))) {
+					note.instrument = sampleForInstrument[ch.instrument];
+					if (!useDefaults || song.defaults.volume[c] == Song::NO_VOLUME)
+						note.volume = ch.volume;
+					started |= 1u << c;
+				}
+			} else if (songStart) {
+				note.note = IT::ITNV_NOTE_CUT;
+			}
+
+			pattern.cells.push_back({ r, c, note });
+		}
+
+		if (r == 0 && songStart) {
+			IT::Note tempo;
+			tempo.effect = letterInAlphabet('T');
+			tempo.param = song.bpm;
+			pattern.cells.push_back({ r, CONTROL_CHANNEL, tempo });
+		}
+	}
+}
+
+// Volume and pan that never change go in the channel table rather than in every pattern
+static void applyDefaults(const Song& song, IT& it) {
+	for (int c = 0; c < Song::CHANNELS; c++) {
+		if (song.defaults.volume[c] != Song::NO_VOLUME)
+			it.channels[c].volume = song.defaults.volume[c];
+		if (song.defaults.pan[c] != Song::NO_PAN)
+			it.channels[c].pan = song.defaults.pan[c];
+	}
+}
+
+IT Converter::convert(const MIO& mio, std::pmr::memory_resource* resource) {
+	song_.load(mio.recordData);
+	return convert(mio, song_, resource);
+}
+
+IT Converter::convert(const MIO& mio, const Song& song, std::pmr::memory_resource* resource) {
+	MIO2IT_STAT_SCOPE("convert");
+
+	IT it(resource);
+
+	strncpy(it.name, mio.name, std::size(it.name) - 1);
+	it.initialTempo = song.bpm;
+	it.message = mio.description;
+	it.orders.assign(song.order.begin(), song.order.end());
+
+	std::pmr::vector<u8> waves = usedWaves({ &song, 1 }, resource);
+	std::pmr::vector<u8> sampleForInstrument = mapSamples(song, waves, resource);
+
+	applyDefaults(song, it);
+
+	it.patterns.resize(Song::PHRASES);
+	for (int i = 0; i < Song::PHRASES; i++)
+		convertPhrase(song, i, sampleForInstrument, it.patterns[i], true);
+
+	it.prelinked = prelinkWaves(waves);
+	return it;
+}
+
+// FNV-1a over everything that ends up in the file
+static u64 hashPattern(const IT::Pattern& pattern) {
+	u64 hash = 0xCBF29CE484222325;
+
+	auto add = [&](u8 byte) {
+		hash = (hash ^ byte) * 0x100000001B3;
+	};
+
+	add(pattern.rows);
+	add(pattern.rows >> 8);
+
+	for (const IT::Pattern::Cell& cell : pattern.cells) {
+		add(cell.row);
+		add(cell.channel);
+		add(cell.note.note.has_value());
+		add(cell.note.note.value_or(0));
+		add(cell.note.instrument);
+		add(cell.note.volume);
+		add(cell.note.effect);
+		add(cell.note.param);
+	}
+
+	return hash;
+}
+
+IT Converter::convertAlbum(std::span<const MIO> mios, std::string_view name, std::pmr::memory_resource* resource) {
+	MIO2IT_STAT_SCOPE("convert");
+
+	IT it(resource);
+
+	strncpy(it.name, std::string(name).c_str(), std::size(it.name) - 1);
+
+	std::vector<Song> songs(mios.size());
+	for (size_t i = 0; i < mios.size(); i++)
+		songs[i].load(mios[i].recordData);
+
+	// One set of instruments for everything, so each song only needs its own mapping onto it
+	std::pmr::vector<u8> waves = usedWaves(songs, resource);
+
+	// Patterns are pooled by what they'd encode to, so a phrase that comes out the same in several songs is only stored once
+	std::pmr::unordered_multimap<u64, u8> pool(resource);
+	IT::Pattern pattern;
+
+	auto addPattern = [&]() -> u8 {
+		u64 hash = hashPattern(pattern);
+
+		auto [begin, end] = pool.equal_range(hash);
+		for (auto found = begin; found != end; ++found) {
+			if (it.patterns[found->second] == pattern)
+				return found->second;
+		}
+
+		if (it.patterns.size() >= IT::MAX_PATTERNS) {
+			throw std::runtime_error("Album needs more than 200 patterns");
+		}
+
+		u8 index = it.patterns.size();
+		it.patterns.push_back(pattern);
+		pool.emplace(hash, index);
+		return index;
+	};
+
+	for (size_t s = 0; s < songs.size(); s++) {
+		const Song& song = songs[s];
+		if (song.order.empty())
+			continue;
+
+		// Players skip these, so the album plays straight through, but they show where each song starts
+		if (it.orders.empty()) {
+			it.initialTempo = song.bpm;
+		} else {
+			it.orders.push_back(IT::ITMOM_SKIP_TO_NEXT);
+		}
+
+		std::pmr::vector<u8> sampleForInstrument = mapSamples(song, waves, resource);
+
+		for (size_t o = 0; o < song.order.size(); o++) {
+			convertPhrase(song, song.order[o], sampleForInstrument, pattern, false, o == 0);
+			it.orders.push_back(addPattern());
+		}
+
+		if (!it.message.empty())
+			it.message += '\r';
+		it.message += std::to_string(s + 1) + ". " + mios[s].name;
+		if (mios[s].description[0])
+			it.message += std::string(": ") + mios[s].description;
+	}
+
+	it.orders.push_back(IT::ITMOM_END_OF_SONG);
+
+	if (it.orders.size() > IT::MAX_ORDERS) {
+		throw std::runtime_error("Album needs more than 256 orders");
+	}
+
+	// Better to lose the end of the track listing than the whole album
+	if (it.message.size() >= IT::MAX_MESSAGE_LENGTH)
+		it.message.resize(IT::MAX_MESSAGE_LENGTH - 1);
+
+	it.prelinked = prelinkWaves(waves);
+	return it;
+}
+
+std::vector<u8> Converter::convert(std::span<const u8> mioData) {
+	std::vector<u8> out;
+	convert(mioData, out);
+	return out;
+}
+
+void Converter::convert(std::span<const u8> mioData, std::vector<u8>& out) {
+	if (auto converted = tryConvert(mioData, out); !converted)
+		throw std::system_error(converted.error());
+}
+
+std::expected<void, std::error_code> Converter::tryConvert(std::span<const u8> mioData, std::vector<u8>& out) {
+	MIO mio;
+	if (auto loaded = mio.tryLoad(mioData); !loaded)
+		return loaded;
+
+	song_.load(mio.recordData);
+
+	// Nothing from the last file is still around by now
+	arena_.reset();
+
+	out.clear();
+	io::VectorIO file(std::move(out), false);
+	auto saved = convert(mio, song_, arena_.resource()).trySave(file);
+	out = std::move(file.vec());
+	return saved;
+}
+
+/**
+ * Anything outside of the phrases ends up in the module header or the
+ * instruments, and those come before the patterns, so there's no point
+ * trying to patch things up when they change.
+ */
+static bool sameOutsidePhrases(const MIO& a, const MIO& b) {
+	return !strcmp(a.name, b.name) &&
+	       !strcmp(a.description, b.description) &&
+	       a.recordData.tempo == b.recordData.tempo &&
+	       a.recordData.endPhrase == b.recordData.endPhrase;
+}
+
+static bool samePhrase(const MIO::Record::Phrase& a, const MIO::Record::Phrase& b) {
+	// Nothing but bytes in here, so no padding to worry about
+	return !memcmp(&a, &b, sizeof(MIO::Record::Phrase));
+}
+
+void IncrementalConverter::update(const MIO& mio, std::vector<Range>& changed) {
+	changed.clear();
+
+	song_.load(mio.recordData);
+	std::pmr::vector<u8> waves = usedWaves({ &song_, 1 });
+
+	// Defaults end up in the header too, so them changing means starting over
+	if (!last_ || !sameOutsidePhrases(*last_, mio) || waves != waves_ || song_.defaults != defaults_) {
+		IT it = converter_.convert(mio, song_);
+
+		io::VectorIO file(std::move(output_));
+		file.vec().clear();
+		it.save(file);
+		output_ = std::move(file.vec());
+
+		patternTable_ = it.patternTableOffset();
+		patternOffsets_.resize(it.patterns.size() + 1);
+		for (size_t i = 0; i < it.patterns.size(); i++)
+			memcpy(&patternOffsets_[i], &output_[patternTable_ + i * sizeof(u32)], sizeof(u32));
+		for (size_t i = 0; i < it.patterns.size(); i++)
+			patternOffsets_[i] = LE(patternOffsets_[i]);
+		patternOffsets_.back() = output_.size();
+
+		last_ = mio;
+		waves_ = std::move(waves);
+		defaults_ = song_.defaults;
+		changed.push_back({ 0, output_.size() });
+		return;
+	}
+
+	const MIO::Record& record = mio.recordData;
+	const MIO::Record& lastRecord = last_->recordData;
+
+	std::pmr::vector<u8> sampleForInstrument = mapSamples(song_, waves);
+
+	// Re-encode the patterns of changed phrases, and the ones after them in case pan changed
+	std::vector<std::vector<u8>> encoded(Song::PHRASES);
+	size_t firstChanged = Song::PHRASES;
+
+	for (int i = 0; i < Song::PHRASES; i++) {
+		bool dirty = !samePhrase(record.phrases[i], lastRecord.phrases[i]) ||
+		             (i > 0 && !samePhrase(record.phrases[i - 1], lastRecord.phrases[i - 1]));
+		if (!dirty)
+			continue;
+
+		convertPhrase(song_, i, sampleForInstrument, pattern_, true);
+
+		io::VectorIO file(std::move(encoded[i]));
+		IT::writePattern(file, pattern_);
+		encoded[i] = std::move(file.vec());
+
+		std::span<const u8> old(&output_[patternOffsets_[i]], patternOffsets_[i + 1] - patternOffsets_[i]);
+		if (std::equal(old.begin(), old.end(), encoded[i].begin(), encoded[i].end())) {
+			encoded[i].clear();
+			continue;
+		}
+
+		firstChanged = std::min<size_t>(firstChanged, i);
+	}
+
+	last_ = mio;
+
+	if (firstChanged == Song::PHRASES)
+		return;
+
+	// Everything from the first changed pattern on gets laid out again, as sizes may have changed
+	std::vector<u8> tail;
+	tail.reserve(output_.size() - patternOffsets_[firstChanged]);
+
+	std::vector<u32> offsets = patternOffsets_;
+
+	for (size_t i = firstChanged; i < Song::PHRASES; i++) {
+		offsets[i] = patternOffsets_[firstChanged] + tail.size();
+		if (!encoded[i].empty()) {
+			tail.insert(tail.end(), encoded[i].begin(), encoded[i].end());
+		} else {
+			tail.insert(tail.end(), &output_[patternOffsets_[i]], &output_[0] + patternOffsets_[i + 1]);
+		}
+	}
+
+	output_.resize(patternOffsets_[firstChanged]);
+	output_.insert(output_.end(), tail.begin(), tail.end());
+	offsets.back() = output_.size();
+
+	// Only offsets that actually moved need writing
+	size_t firstMoved = firstChanged;
+	while (firstMoved < Song::PHRASES && offsets[firstMoved] == patternOffsets_[firstMoved])
+		firstMoved++;
+
+	for (size_t i = firstMoved; i < Song::PHRASES; i++) {
+		u32 offset = LE(offsets[i]);
+		memcpy(&output_[patternTable_ + i * sizeof(u32)], &offset, sizeof(u32));
+	}
+
+	if (firstMoved < Song::PHRASES)
+		changed.push_back({ patternTable_ + firstMoved * sizeof(u32), (Song::PHRASES - firstMoved) * sizeof(u32) });
+	changed.push_back({ patternOffsets_[firstChanged], output_.size() - patternOffsets_[firstChanged] });
+
+	patternOffsets_ = std::move(offsets);
+}
+
+std::vector<u8> convert(std::span<const u8> mio) {
+	Converter converter;
+	return converter.convert(mio);
+}
+
+std::string describe(const MIO& mio) {
+	std::string info;
+
+	auto line = [&](const char* field, const char* value) {
+		info += field;
+		info += ": ";
+		info += value;
+		info += '\n';
+	};
+
+	line("Name", mio.name);
+	line("Brand", mio.brand);
+	line("Creator", mio.creator);
+	line("Description", mio.description);
+	line("Serial", mio.formatSerial().c_str());
+
+	return info;
+}
+
+} // namespace mio2it
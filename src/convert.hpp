@@ -0,0 +1,99 @@
+#pragma once
+#include <expected>
+#include <map>
+#include <memory>
+#include <memory_resource>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "arena.hpp"
+#include "it.hpp"
+#include "mio.hpp"
+#include "song.hpp"
+#include "types.hpp"
+
+namespace mio2it {
+	/**
+	 * Turns records into IT modules. Instrument banks get prelinked the first
+	 * time they're needed and kept for later conversions, so keep one around
+	 * when converting lots of files. Not thread safe, use one per thread.
+	 */
+	class Converter {
+	public:
+		// The module and everything in it is allocated from `resource`
+		IT convert(const MIO& mio, std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+
+		// For when the song has already been built from `mio`'s record
+		IT convert(const MIO& mio, const Song& song, std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+
+		/**
+		 * Puts every record into one module, one song after another, sharing
+		 * instruments and any patterns that come out the same. Each song
+		 * starts by setting its own tempo and every channel's pan, so it
+		 * doesn't matter what played before it. Throws if it won't all fit.
+		 */
+		IT convertAlbum(std::span<const MIO> mios, std::string_view name, std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+
+		// Whole MIO file in, whole IT file out. Throws on invalid input
+		std::vector<u8> convert(std::span<const u8> mio);
+
+		/**
+		 * Same as above, but reuses `out`'s memory. Everything in between is
+		 * kept in the converter too, so once warmed up this doesn't allocate.
+		 */
+		void convert(std::span<const u8> mio, std::vector<u8>& out);
+
+		// Same as above, but errors are returned rather than thrown
+		std::expected<void, std::error_code> tryConvert(std::span<const u8> mio, std::vector<u8>& out);
+
+	private:
+		std::shared_ptr<const IT::PrelinkedSection> prelinkWaves(std::span<const u8> waves);
+
+		std::map<u32, std::shared_ptr<const IT::PrelinkedSection>> sections_;
+		Song song_;
+		Arena arena_;
+	};
+
+	/**
+	 * Converts the same record over and over as it gets edited. The last
+	 * output is kept, so when only some phrases change, just their patterns
+	 * get converted and encoded again and spliced in. Anything else changing
+	 * means starting over.
+	 */
+	class IncrementalConverter {
+	public:
+		// Part of the output that changed since the last update
+		struct Range {
+			size_t offset;
+			size_t size;
+		};
+
+		/**
+		 * Brings the output up to date with `mio`, filling `changed` with what
+		 * needs rewriting. Anything past the end of the output should be
+		 * truncated, as it can shrink.
+		 */
+		void update(const MIO& mio, std::vector<Range>& changed);
+
+		const std::vector<u8>& output() const { return output_; }
+
+	private:
+		Converter converter_;
+		std::optional<MIO> last_;
+		std::pmr::vector<u8> waves_;
+		Song song_;
+		Song::Defaults defaults_;
+		std::vector<u8> output_;
+		u32 patternTable_ = 0;
+		std::vector<u32> patternOffsets_; // One past the last is the end of the file
+		IT::Pattern pattern_;
+	};
+
+	// Same as Converter::convert, without keeping anything around afterwards
+	std::vector<u8> convert(std::span<const u8> mio);
+
+	// Human readable summary of a record's info, one field per line
+	std::string describe(const MIO& mio);
+} // namespace mio2it
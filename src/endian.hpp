@@ -1,6 +1,9 @@
 #pragma once
 #include <bit>
 #include <concepts>
+#include <cstdint>
+#include <span>
+#include <type_traits>
 
 #define UNKNOWN_ENDIAN() \
 	static_assert(endian::native == endian::little || \
@@ -20,4 +23,40 @@ constexpr T LE(T in) {
 	}
 }
 
+template <std::integral T>
+constexpr T BE(T in) {
+	using std::endian;
+
+	if constexpr (endian::native == endian::big) {
+		return in;
+	} else if constexpr (endian::native == endian::little) {
+		return std::byteswap(in);
+	} else {
+		UNKNOWN_ENDIAN();
+	}
+}
+
+template <size_t Size>
+using UIntOfSize = std::conditional_t<Size == 2, std::uint16_t,
+                   std::conditional_t<Size == 4, std::uint32_t, std::uint64_t>>;
+
+/**
+ * Converts a whole array between native and little endian in place, for
+ * things like sample data where going an element at a time adds up. Works on
+ * floats too. Nothing to do on little endian hosts, and elsewhere it's a plain
+ * loop with nothing in the way of compilers turning it into vector shuffles.
+ */
+template <typename T, size_t Extent>
+	requires std::is_trivially_copyable_v<T> && (sizeof(T) == 2 || sizeof(T) == 4 || sizeof(T) == 8)
+constexpr void swapLE(std::span<T, Extent> data) {
+	using std::endian;
+
+	if constexpr (endian::native == endian::big) {
+		for (T& value : data)
+			value = std::bit_cast<T>(std::byteswap(std::bit_cast<UIntOfSize<sizeof(T)>>(value)));
+	} else if constexpr (endian::native != endian::little) {
+		UNKNOWN_ENDIAN();
+	}
+}
+
 #undef UNKNOWN_ENDIAN
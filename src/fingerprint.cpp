@@ -0,0 +1,361 @@
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+#include "endian.hpp"
+#include "fingerprint.hpp"
+#include "io.hpp"
+#include "stats.hpp"
+#include "utils.hpp"
+
+#ifdef MIO2IT_AVX2_DISPATCH
+	#include <immintrin.h>
+#endif
+
+namespace fingerprint {
+
+constexpr static char MAGIC[8] = { 'M', 'I', 'O', '2', 'I', 'T', 'F', 'P' };
+constexpr static u32 VERSION = 1;
+constexpr static size_t HEADER_SIZE = sizeof(MAGIC) + 6 * sizeof(u32);
+
+// Intervals per shingle, short enough that a changed note only spoils a few
+constexpr static size_t SHINGLE_LENGTH = 3;
+
+// Kept apart so an interval run can't collide with a whole phrase that happens to hash the same
+enum FeatureKind : u32 {
+	INTERVALS = 1,
+	PHRASE,
+	RHYTHM
+};
+
+// murmur3's finaliser, which is a bijection, so every seed gives a different permutation of u32s
+constexpr static u32 mix(u32 h) {
+	h ^= h >> 16;
+	h *= 0x85EBCA6B;
+	h ^= h >> 13;
+	h *= 0xC2B2AE35;
+	h ^= h >> 16;
+	return h;
+}
+
+constexpr static u32 combine(u32 h, u32 value) {
+	return mix(h ^ (value + 0x9E3779B9 + (h << 6) + (h >> 2)));
+}
+
+constexpr static auto SEEDS = [] {
+	std::array<u32, SIGNATURE_SIZE> seeds {};
+	for (size_t i = 0; i < seeds.size(); i++)
+		seeds[i] = mix(u32(i) * 0x9E3779B9 + 0x7F4A7C15);
+	return seeds;
+}();
+
+/* ======================== *
+ *      MinHash kernels     *
+ * ======================== */
+
+// Every slot hashes every feature with its own seed and keeps the smallest
+[[maybe_unused]] static void minHashScalar(std::span<const u32> features, u32* signature) {
+	for (u32 feature : features) {
+		for (size_t i = 0; i < SIGNATURE_SIZE; i++)
+			signature[i] = std::min(signature[i], mix(feature ^ SEEDS[i]));
+	}
+}
+
+#ifdef MIO2IT_AVX2_DISPATCH
+// SSE2 has no 32-bit multiply or unsigned min, so it's AVX2 or nothing
+MIO2IT_TARGET_AVX2 static void minHashAVX2(std::span<const u32> features, u32* signature) {
+	constexpr size_t LANES = SIGNATURE_SIZE / 8;
+
+	__m256i mins[LANES], seeds[LANES];
+	for (size_t i = 0; i < LANES; i++) {
+		mins[i] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(signature + i * 8));
+		seeds[i] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(SEEDS.data() + i * 8));
+	}
+
+	const __m256i m1 = _mm256_set1_epi32(s32(0x85EBCA6B));
+	const __m256i m2 = _mm256_set1_epi32(s32(0xC2B2AE35));
+
+	for (u32 feature : features) {
+		__m256i f = _mm256_set1_epi32(s32(feature));
+
+		for (size_t i = 0; i < LANES; i++) {
+			__m256i h = _mm256_xor_si256(f, seeds[i]);
+			h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 16));
+			h = _mm256_mullo_epi32(h, m1);
+			h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 13));
+			h = _mm256_mullo_epi32(h, m2);
+			h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 16));
+			mins[i] = _mm256_min_epu32(mins[i], h);
+		}
+	}
+
+	for (size_t i = 0; i < LANES; i++)
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(signature + i * 8), mins[i]);
+}
+#endif
+
+using MinHashFunc = void (*)(std::span<const u32> features, u32* signature);
+
+static MinHashFunc pickMinHash() {
+#ifdef MIO2IT_AVX2_DISPATCH
+	if (hasAVX2())
+		return minHashAVX2;
+#endif
+	return minHashScalar;
+}
+
+static const MinHashFunc minHash = pickMinHash();
+
+/* ===================== *
+ *      Fingerprint      *
+ * ===================== */
+
+static void trackFeatures(const u8 (&notes)[MIO::Record::TRACK_LENGTH], std::vector<u32>& features) {
+	u8 pitches[MIO::Record::TRACK_LENGTH];
+	u8 steps[MIO::Record::TRACK_LENGTH];
+	size_t count = 0;
+
+	for (int n = 0; n < MIO::Record::TRACK_LENGTH; n++) {
+		if (notes[n] != MIO::Record::NO_NOTE) {
+			pitches[count] = notes[n];
+			steps[count] = n;
+			count++;
+		}
+	}
+
+	if (!count)
+		return;
+
+	// Whole phrase, intervals along with how far apart the notes are
+	u32 phrase = combine(PHRASE, steps[0]);
+	for (size_t i = 1; i < count; i++)
+		phrase = combine(combine(phrase, u8(pitches[i] - pitches[i - 1])), steps[i] - steps[i - 1]);
+	features.push_back(phrase);
+
+	// Runs of intervals alone, so moving a note along doesn't matter. Short tracks get one shorter run
+	size_t intervals = count - 1;
+	size_t runs = intervals >= SHINGLE_LENGTH ? intervals - SHINGLE_LENGTH + 1 : 1;
+	size_t length = std::min(intervals, SHINGLE_LENGTH);
+
+	for (size_t r = 0; r < runs; r++) {
+		u32 run = combine(INTERVALS, length);
+		for (size_t i = r + 1; i <= r + length; i++)
+			run = combine(run, u8(pitches[i] - pitches[i - 1]));
+		features.push_back(run);
+	}
+}
+
+Signature compute(const MIO::Record& record) {
+	MIO2IT_STAT_SCOPE("fingerprint");
+
+	std::vector<u32> features;
+	features.reserve(MIO::Record::MAX_PHRASES * MIO::Record::TRACK_COUNT * MIO::Record::TRACK_LENGTH);
+
+	// Phrases past the end never play, and are often left over from older versions of the song
+	int phrases = std::min<int>(record.endPhrase, MIO::Record::MAX_PHRASES);
+
+	for (int p = 0; p < phrases; p++) {
+		const MIO::Record::Phrase& phrase = record.phrases[p];
+
+		for (const MIO::Record::Track& track : phrase.tracks)
+			trackFeatures(track.notes, features);
+
+		const u8* rhythm = &phrase.rhythmTrack.notes[0][0];
+		const u8* rhythmEnd = rhythm + sizeof(phrase.rhythmTrack.notes);
+		if (std::any_of(rhythm, rhythmEnd, [](u8 n) { return n != MIO::Record::NO_NOTE; })) {
+			u32 hash = RHYTHM;
+			for (const u8* n = rhythm; n < rhythmEnd; n++)
+				hash = combine(hash, *n);
+			features.push_back(hash);
+		}
+	}
+
+	// Repeated phrases are common, and would only be hashed again for nothing
+	std::sort(features.begin(), features.end());
+	features.erase(std::unique(features.begin(), features.end()), features.end());
+
+	Signature signature;
+	signature.fill(UINT32_MAX);
+	minHash(features, signature.data());
+	return signature;
+}
+
+float similarity(std::span<const u32, SIGNATURE_SIZE> a, std::span<const u32, SIGNATURE_SIZE> b) {
+	size_t same = 0;
+	for (size_t i = 0; i < SIGNATURE_SIZE; i++)
+		same += a[i] == b[i];
+	return float(same) / SIGNATURE_SIZE;
+}
+
+static u32 bandKey(const u32* signature, size_t band) {
+	u32 key = 0;
+	for (size_t r = 0; r < ROWS; r++)
+		key = combine(key, signature[band * ROWS + r]);
+	return key;
+}
+
+/* =============== *
+ *      Index      *
+ * =============== */
+
+void writeIndex(io::DataIO& out, std::span<const Entry> entries) {
+	MIO2IT_STAT_SCOPE("index-write");
+
+	if (entries.size() >= UINT32_MAX) {
+		throw std::runtime_error("Too many records for one index");
+	}
+
+	u32 count = entries.size();
+
+	std::vector<u32> signatures;
+	signatures.reserve(count * SIGNATURE_SIZE);
+	for (const Entry& entry : entries)
+		signatures.insert(signatures.end(), entry.signature.begin(), entry.signature.end());
+
+	std::vector<u32> bands;
+	bands.reserve(BANDS * count * 2);
+	std::vector<std::pair<u32, u32>> table(count);
+
+	for (size_t b = 0; b < BANDS; b++) {
+		for (u32 i = 0; i < count; i++)
+			table[i] = { bandKey(entries[i].signature.data(), b), i };
+
+		std::sort(table.begin(), table.end());
+		for (auto [key, entry] : table) {
+			bands.push_back(key);
+			bands.push_back(entry);
+		}
+	}
+
+	std::vector<u32> nameOffsets;
+	nameOffsets.reserve(count + 1);
+	u64 namesSize = 0;
+	for (const Entry& entry : entries) {
+		nameOffsets.push_back(namesSize);
+		namesSize += entry.name.size();
+	}
+	nameOffsets.push_back(namesSize);
+
+	if (namesSize > UINT32_MAX) {
+		throw std::runtime_error("Record names are too long for one index");
+	}
+
+	out.write(MAGIC, 1, sizeof(MAGIC));
+	out.writeU32LE(VERSION);
+	out.writeU32LE(count);
+	out.writeU32LE(BANDS);
+	out.writeU32LE(ROWS);
+	out.writeU32LE(namesSize);
+	out.writeU32LE(0);
+	out.writeArrLE(std::span(signatures));
+	out.writeArrLE(std::span(bands));
+	out.writeArrLE(std::span(nameOffsets));
+	for (const Entry& entry : entries)
+		out.writeStr(entry.name);
+}
+
+Index Index::open(const fs::path& path) {
+	MIO2IT_STAT_SCOPE("index-open");
+
+	auto file = pack::MappedFile::open(path);
+	if (!file) {
+		throw std::system_error(file.error(), path.string());
+	}
+
+	Index index(std::move(*file));
+	std::span<const u8> data = index.file_.data();
+
+	auto invalid = [] {
+		return std::runtime_error("Not a fingerprint index, or from a different version");
+	};
+
+	if (data.size() < HEADER_SIZE || memcmp(data.data(), MAGIC, sizeof(MAGIC))) {
+		throw invalid();
+	}
+
+	u32 header[6];
+	io::SpanIO in(data.subspan(sizeof(MAGIC), sizeof(header)));
+	in.readArrLE(std::span(header));
+
+	auto [version, count, bands, rows, namesSize, reserved] = header;
+	if (version != VERSION || bands != BANDS || rows != ROWS) {
+		throw invalid();
+	}
+
+	// Worked out in u64 so a bad count can't wrap round to something that looks fine
+	u64 words = u64(count) * SIGNATURE_SIZE + u64(count) * BANDS * 2 + u64(count) + 1;
+	if ((data.size() - HEADER_SIZE) / sizeof(u32) < words || data.size() - HEADER_SIZE - words * sizeof(u32) != namesSize) {
+		throw invalid();
+	}
+
+	const u32* base = reinterpret_cast<const u32*>(data.data() + HEADER_SIZE);
+	if constexpr (std::endian::native != std::endian::little) {
+		index.native_.assign(base, base + words);
+		swapLE(std::span<u32>(index.native_));
+		base = index.native_.data();
+	}
+
+	index.count_ = count;
+	index.signatures_ = base;
+	index.bands_ = index.signatures_ + u64(count) * SIGNATURE_SIZE;
+	index.nameOffsets_ = index.bands_ + u64(count) * BANDS * 2;
+	index.names_ = reinterpret_cast<const char*>(data.data() + HEADER_SIZE + words * sizeof(u32));
+
+	for (u32 i = 0; i < count; i++) {
+		if (index.nameOffsets_[i] > index.nameOffsets_[i + 1] || index.nameOffsets_[i + 1] > namesSize) {
+			throw invalid();
+		}
+	}
+
+	return index;
+}
+
+std::string_view Index::name(u32 entry) const {
+	return { names_ + nameOffsets_[entry], nameOffsets_[entry + 1] - nameOffsets_[entry] };
+}
+
+std::span<const u32, SIGNATURE_SIZE> Index::signature(u32 entry) const {
+	return std::span<const u32, SIGNATURE_SIZE>(signatures_ + u64(entry) * SIGNATURE_SIZE, SIGNATURE_SIZE);
+}
+
+std::vector<Match> Index::query(const Signature& signature, float minSimilarity) const {
+	MIO2IT_STAT_SCOPE("query");
+
+	struct Slot {
+		u32 key;
+		u32 entry;
+	};
+
+	// Anything sharing a whole band is a candidate, everything else is never looked at
+	std::vector<u32> candidates;
+	for (size_t b = 0; b < BANDS; b++) {
+		const Slot* table = reinterpret_cast<const Slot*>(bands_ + b * count_ * 2);
+		u32 key = bandKey(signature.data(), b);
+
+		const Slot* first = std::partition_point(table, table + count_, [&](const Slot& s) { return s.key < key; });
+		for (const Slot* s = first; s < table + count_ && s->key == key; s++)
+			candidates.push_back(s->entry);
+	}
+
+	std::sort(candidates.begin(), candidates.end());
+	candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+
+	std::vector<Match> matches;
+	for (u32 entry : candidates) {
+		if (entry >= count_)
+			continue;
+
+		float score = similarity(signature, this->signature(entry));
+		if (score >= minSimilarity)
+			matches.push_back({ entry, score });
+	}
+
+	std::stable_sort(matches.begin(), matches.end(), [](const Match& a, const Match& b) {
+		return a.similarity > b.similarity;
+	});
+
+	return matches;
+}
+
+} // namespace fingerprint
@@ -0,0 +1,92 @@
+#pragma once
+#include <array>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "filesystem.hpp"
+#include "mio.hpp"
+#include "pack.hpp"
+#include "types.hpp"
+
+namespace io {
+	class DataIO;
+}
+
+/**
+ * Fingerprints of records for finding near copies, like remixes that move a
+ * song up a few notes, shuffle its phrases around or touch up a handful of
+ * notes, without comparing every record against every other.
+ *
+ * A record's features are hashes of runs of intervals between notes in each
+ * track, whole phrases with their timing, and rhythm patterns. Intervals
+ * don't change with transposition, and a set of features doesn't care about
+ * the order phrases come in. The set is boiled down to a MinHash signature,
+ * where the fraction of slots two signatures share estimates how much of
+ * their features overlap.
+ *
+ * Indexes split signatures into bands for locality sensitive hashing, so
+ * only records sharing a whole band with the query get compared, and are
+ * laid out to be mapped and searched in place without being parsed.
+ */
+namespace fingerprint {
+	constexpr size_t SIGNATURE_SIZE = 64;
+	constexpr size_t BANDS = 16;
+	constexpr size_t ROWS = SIGNATURE_SIZE / BANDS;
+
+	// Around where a pair becomes likely to share a band, (1 / BANDS) ^ (1 / ROWS)
+	constexpr float DEFAULT_SIMILARITY = 0.5f;
+
+	using Signature = std::array<u32, SIGNATURE_SIZE>;
+
+	Signature compute(const MIO::Record& record);
+
+	// Estimated Jaccard similarity of the two records' features, 0 to 1
+	float similarity(std::span<const u32, SIGNATURE_SIZE> a, std::span<const u32, SIGNATURE_SIZE> b);
+
+	struct Entry {
+		std::string name;
+		Signature signature;
+	};
+
+	/**
+	 * Writes an index of `entries`, all little endian:
+	 *
+	 *   header       "MIO2ITFP", then u32 version, count, bands, rows, names size and 0
+	 *   signatures   count * SIGNATURE_SIZE u32s
+	 *   bands        BANDS tables of count (key, entry) u32 pairs, sorted
+	 *   name offsets count + 1 u32s into the names
+	 *   names        UTF-8, not terminated
+	 */
+	void writeIndex(io::DataIO& out, std::span<const Entry> entries);
+
+	struct Match {
+		u32 entry;
+		float similarity;
+	};
+
+	class Index {
+	public:
+		// Throws if the file can't be read or isn't an index
+		static Index open(const fs::path& path);
+
+		size_t size() const { return count_; }
+		std::string_view name(u32 entry) const;
+		std::span<const u32, SIGNATURE_SIZE> signature(u32 entry) const;
+
+		// Everything at least `minSimilarity` alike, most alike first
+		std::vector<Match> query(const Signature& signature, float minSimilarity) const;
+
+	private:
+		explicit Index(pack::MappedFile file) : file_(std::move(file)) {}
+
+		pack::MappedFile file_;
+		std::vector<u32> native_; // Byte swapped copy of everything but the names on big endian hosts
+
+		u32 count_ = 0;
+		const u32* signatures_ = nullptr;
+		const u32* bands_ = nullptr;
+		const u32* nameOffsets_ = nullptr;
+		const char* names_ = nullptr;
+	};
+} // namespace fingerprint
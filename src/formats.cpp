@@ -0,0 +1,125 @@
+#include <algorithm>
+#include "formats.hpp"
+#include "io.hpp"
+
+namespace formats {
+
+constexpr static u8 letterInAlphabet(char c) {
+	return c - ('A' - 1);
+}
+
+void saveXM(const IT& module, const fs::path& path) {
+	io::FileIO file(path, "wb");
+	saveXM(module, file);
+}
+
+void saveMOD(const IT& module, const fs::path& path) {
+	io::FileIO file(path, "wb");
+	saveMOD(module, file);
+}
+
+void saveMIDI(const IT& module, const fs::path& path) {
+	io::FileIO file(path, "wb");
+	saveMIDI(module, file);
+}
+
+u8 usedChannels(const IT& module) {
+	u8 count = 0;
+
+	for (const IT::Pattern& pat : module.patterns) {
+		for (const IT::Pattern::Cell& cell : pat.cells) {
+			if (cell.channel < IT::MAX_CHANNELS)
+				count = std::max<u8>(count, cell.channel + 1);
+		}
+	}
+
+	return count;
+}
+
+std::vector<u8> playedOrders(const IT& module) {
+	std::vector<u8> orders;
+
+	for (u8 order : module.orders) {
+		if (order == IT::ITMOM_END_OF_SONG)
+			break;
+		if (order == IT::ITMOM_SKIP_TO_NEXT || order >= module.patterns.size())
+			continue;
+		orders.push_back(order);
+	}
+
+	return orders;
+}
+
+constexpr static u8 CENTRE_PAN = 32;
+
+static bool movesPan(const IT::Channel& channel) {
+	return channel.pan != CENTRE_PAN && channel.pan <= IT::ITPV_RIGHT;
+}
+
+std::span<const IT::Pattern> applyChannelTable(const IT& module, std::vector<IT::Pattern>& storage) {
+	bool any = std::any_of(std::begin(module.channels), std::end(module.channels), [](const IT::Channel& channel) {
+		return channel.volume < 64 || movesPan(channel);
+	});
+
+	if (!any)
+		return module.patterns;
+
+	std::span<const IT::Sample> samples = module.effectiveSamples();
+	std::vector<u8> orders = playedOrders(module);
+
+	storage.assign(module.patterns.begin(), module.patterns.end());
+
+	for (IT::Pattern& pat : storage) {
+		for (IT::Pattern::Cell& cell : pat.cells) {
+			if (cell.channel >= IT::MAX_CHANNELS || module.channels[cell.channel].volume >= 64)
+				continue;
+
+			IT::Note& note = cell.note;
+			u8 volume = IT::ITVPR_NULL;
+
+			if (note.volume <= IT::ITVPR_VOL_END) {
+				volume = note.volume;
+			} else if (note.volume == IT::ITVPR_NULL && note.instrument && note.instrument <= samples.size()) {
+				volume = std::min<u8>(samples[note.instrument - 1].defaultVol, 64);
+			}
+
+			if (volume != IT::ITVPR_NULL)
+				note.volume = (volume * module.channels[cell.channel].volume + 32) / 64;
+		}
+	}
+
+	if (orders.empty())
+		return storage;
+
+	IT::Pattern& first = storage[orders[0]];
+	if (!first.rows)
+		return storage;
+
+	// Channels past the last used one get left off entirely, so there's no point
+	u8 channels = usedChannels(module);
+
+	for (u8 c = 0; c < channels; c++) {
+		if (!movesPan(module.channels[c]))
+			continue;
+
+		IT::Note pan;
+		pan.effect = letterInAlphabet('X');
+		pan.param = std::min(255, module.channels[c].pan * 4);
+
+		// Cells are kept in order, so it either goes in the one already there or right where it would be
+		auto cell = std::find_if(first.cells.begin(), first.cells.end(), [&](const IT::Pattern::Cell& cell) {
+			return cell.row > 0 || cell.channel >= c;
+		});
+
+		if (cell == first.cells.end() || cell->row > 0 || cell->channel > c) {
+			first.cells.insert(cell, { 0, c, pan });
+		} else if (!cell->note.effect && !cell->note.param) {
+			cell->note.effect = pan.effect;
+			cell->note.param = pan.param;
+		}
+	}
+
+	return storage;
+}
+
+} // namespace formats
@@ -0,0 +1,51 @@
+#pragma once
+#include <span>
+#include <vector>
+#include "filesystem.hpp"
+#include "it.hpp"
+#include "types.hpp"
+
+namespace io {
+	class DataIO;
+}
+
+/**
+ * Other formats a converted module can be written as. They all work from the
+ * finished IT module, so a record only has to be converted once however many
+ * formats it ends up in. Only what conversion produces is carried over:
+ * notes, samples, the volume column, set speed/tempo/pan effects and the
+ * channel volumes and pans.
+ * Like IT::save, these rely on `file` throwing on errors.
+ */
+namespace formats {
+	// FastTracker 2 module, samples become single sample instruments
+	void saveXM(const IT& module, io::DataIO& file);
+	void saveXM(const IT& module, const fs::path& path);
+
+	// ProTracker style module with as many channels as needed, e.g. 8CHN
+	void saveMOD(const IT& module, io::DataIO& file);
+	void saveMOD(const IT& module, const fs::path& path);
+
+	// Type 1 Standard MIDI File, one track per channel
+	void saveMIDI(const IT& module, io::DataIO& file);
+	void saveMIDI(const IT& module, const fs::path& path);
+
+	/* =========================== *
+	 *      Shared by writers      *
+	 * =========================== */
+
+	// Number of channels up to and including the last one with anything in it
+	u8 usedChannels(const IT& module);
+
+	// Orders that actually get played, skipping markers and stopping at the end of the song
+	std::vector<u8> playedOrders(const IT& module);
+
+	/**
+	 * The module's patterns with its channel volumes and pans moved into
+	 * them, for formats with nowhere in the header to put them. Volume gets
+	 * folded into every note that starts a sample or sets one, and pan is set
+	 * at the start of the first pattern played wherever the effect is free.
+	 * Only copied into `storage` if there's anything to move.
+	 */
+	std::span<const IT::Pattern> applyChannelTable(const IT& module, std::vector<IT::Pattern>& storage);
+} // namespace formats
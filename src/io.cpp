@@ -1,8 +1,16 @@
 #include <cstdio>
 #include <cassert>
 #include <cstring>
+#include <algorithm>
+
+#ifndef _WIN32
+#include <cerrno>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
 
 #include "io.hpp"
+#include "stats.hpp"
 #include "utils.hpp"
 
 #define POSIX_ERROR_CODE(err) std::error_code(err, std::generic_category())
@@ -56,12 +64,28 @@ MIO2IT_NOINLINE void DataIO::setError(std::error_code err) {
 	}
 }
 
+size_t DataIO::writeGather(std::span<const std::span<const u8>> pieces) {
+	size_t written = 0;
+
+	for (std::span<const u8> piece : pieces) {
+		size_t n = write(piece.data(), 1, piece.size());
+		written += n;
+
+		if (n != piece.size())
+			break;
+	}
+
+	return written;
+}
+
 /* ======================== *
  *          FileIO          *
  * ======================== */
 
 bool FileIO::open(const char* path, const char* mode) {
+	MIO2IT_STAT_SCOPE("open");
 	handle_ = fopen(path, mode);
+	owned_ = true;
 
 	if (!handle_) {
 		setError(POSIX_ERROR_CODE(errno));
@@ -78,6 +102,7 @@ bool FileIO::open(const wchar_t* path, const char* mode) {
 	modeW[len] = '\0';
 
 	handle_ = _wfopen(path, modeW);
+	owned_ = true;
 
 	if (!handle_) {
 		setError(POSIX_ERROR_CODE(errno));
@@ -100,6 +125,8 @@ size_t FileIO::read(void* buf, size_t size, size_t count) {
 	}
 
 	size_t read = fread(buf, size, count, handle_);
+	MIO2IT_STAT_COUNT(reads, 1);
+	MIO2IT_STAT_COUNT(readBytes, read * size);
 
 	if (read != count) {
 		if (feof(handle_)) {
@@ -119,7 +146,13 @@ size_t FileIO::write(const void* buf, size_t size, size_t count) {
 		return 0;
 	}
 
+	// Empty vectors hand over null, which fwrite doesn't allow even for nothing
+	if (!count)
+		return 0;
+
 	size_t written = fwrite(buf, size, count, handle_);
+	MIO2IT_STAT_COUNT(writes, 1);
+	MIO2IT_STAT_COUNT(writeBytes, written * size);
 
 	if (written != count) {
 		setError(Error::WriteError);
@@ -128,6 +161,78 @@ size_t FileIO::write(const void* buf, size_t size, size_t count) {
 	return written;
 }
 
+/**
+ * Goes around stdio with writev, so pieces go straight from wherever they are
+ * to the kernel without passing through the FILE's buffer. Windows just gets
+ * a write for each piece.
+ */
+size_t FileIO::writeGather(std::span<const std::span<const u8>> pieces) {
+#ifdef _WIN32
+	return DataIO::writeGather(pieces);
+#else
+	if (!handle_) {
+		setError(Error::FileNotOpen);
+		return 0;
+	}
+
+	// Anything already buffered has to go first
+	if (fflush(handle_) == EOF) {
+		setError(Error::FlushError);
+		return 0;
+	}
+
+	constexpr int MAX_IOVECS = 64;
+
+	int fd = fileno(handle_);
+	size_t written = 0;
+	size_t piece = 0;
+	size_t pieceOffset = 0; // Into pieces[piece], in case a write stopped partway through one
+
+	while (piece < pieces.size()) {
+		iovec iov[MAX_IOVECS];
+		int count = 0;
+
+		for (size_t i = piece; i < pieces.size() && count < MAX_IOVECS; i++) {
+			size_t skip = i == piece ? pieceOffset : 0;
+			if (pieces[i].size() > skip)
+				iov[count++] = { const_cast<u8*>(pieces[i].data() + skip), pieces[i].size() - skip };
+		}
+
+		if (!count)
+			break;
+
+		ssize_t n = ::writev(fd, iov, count);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+
+			setError(POSIX_ERROR_CODE(errno));
+			break;
+		}
+
+		MIO2IT_STAT_COUNT(writes, 1);
+		MIO2IT_STAT_COUNT(writeBytes, n);
+		written += n;
+
+		for (size_t left = n; piece < pieces.size(); piece++, pieceOffset = 0) {
+			if (left < pieces[piece].size() - pieceOffset) {
+				pieceOffset += left;
+				break;
+			}
+			left -= pieces[piece].size() - pieceOffset;
+		}
+	}
+
+	// stdio has to be told where the file's got to now
+	off_t pos = lseek(fd, 0, SEEK_CUR);
+	if (pos < 0 || fseeko(handle_, pos, SEEK_SET)) {
+		setError(POSIX_ERROR_CODE(errno));
+	}
+
+	return written;
+#endif
+}
+
 bool FileIO::seek(long offset, Seek origin) {
 	if (!handle_) {
 		setError(Error::FileNotOpen);
@@ -143,6 +248,7 @@ bool FileIO::seek(long offset, Seek origin) {
 	}
 
 	eof_ = false;
+	MIO2IT_STAT_COUNT(seeks, 1);
 
 	if (fseek(handle_, offset, forigin)) {
 		/**
@@ -177,6 +283,8 @@ bool FileIO::flush() {
 		return false;
 	}
 
+	MIO2IT_STAT_COUNT(flushes, 1);
+
 	if (fflush(handle_) == EOF) {
 		setError(Error::FlushError);
 		return false;
@@ -189,6 +297,13 @@ bool FileIO::close() {
 	if (!handle_)
 		return false;
 
+	MIO2IT_STAT_SCOPE("close");
+
+	if (!owned_) {
+		handle_ = nullptr;
+		return true;
+	}
+
 	if (fclose(handle_) == EOF) {
 		handle_ = nullptr;
 		setError(Error::CloseError);
@@ -199,4 +314,135 @@ bool FileIO::close() {
 	return true;
 }
 
+/* ======================== *
+ *          SpanIO          *
+ * ======================== */
+
+size_t SpanIO::read(void* buf, size_t size, size_t count) {
+	size_t avail = cursor_ < span_.size() ? span_.size() - cursor_ : 0;
+	size_t read = size ? std::min(count, avail / size) : 0;
+
+	if (read) {
+		memcpy(buf, span_.data() + cursor_, read * size);
+		cursor_ += read * size;
+	}
+
+	if (read != count) {
+		eof_ = true;
+		setError(Error::EndOfFile);
+	}
+
+	return read;
+}
+
+size_t SpanIO::write(const void*, size_t, size_t) {
+	setError(Error::InvalidOperation);
+	return 0;
+}
+
+bool SpanIO::seek(long offset, Seek origin) {
+	long base = 0;
+	switch (origin) {
+		case Seek::Set: { base = 0; break; }
+		case Seek::Cur: { base = cursor_; break; }
+		case Seek::End: { base = span_.size(); break; }
+		default: assert(!"Invalid seek origin"); // Shouldn't get here
+	}
+
+	if (base + offset < 0) {
+		setError(Error::InvalidOperation);
+		return false;
+	}
+
+	eof_ = false;
+	cursor_ = base + offset;
+	return true;
+}
+
+long SpanIO::tell() {
+	return cursor_;
+}
+
+/* ======================== *
+ *         VectorIO         *
+ * ======================== */
+
+size_t VectorIO::read(void* buf, size_t size, size_t count) {
+	size_t avail = cursor_ < vec_.size() ? vec_.size() - cursor_ : 0;
+	size_t read = size ? std::min(count, avail / size) : 0;
+
+	if (read) {
+		memcpy(buf, vec_.data() + cursor_, read * size);
+		cursor_ += read * size;
+	}
+
+	if (read != count) {
+		eof_ = true;
+		setError(Error::EndOfFile);
+	}
+
+	return read;
+}
+
+size_t VectorIO::write(const void* buf, size_t size, size_t count) {
+	size_t bytes = size * count;
+
+	if (cursor_ + bytes > vec_.size()) {
+		vec_.resize(cursor_ + bytes);
+	}
+
+	if (bytes) {
+		memcpy(vec_.data() + cursor_, buf, bytes);
+		cursor_ += bytes;
+	}
+
+	return count;
+}
+
+// Makes room for everything at once, rather than growing for each piece
+size_t VectorIO::writeGather(std::span<const std::span<const u8>> pieces) {
+	size_t bytes = 0;
+	for (std::span<const u8> piece : pieces)
+		bytes += piece.size();
+
+	if (cursor_ + bytes > vec_.size()) {
+		vec_.resize(cursor_ + bytes);
+	}
+
+	for (std::span<const u8> piece : pieces) {
+		if (piece.empty())
+			continue;
+
+		memcpy(vec_.data() + cursor_, piece.data(), piece.size());
+		cursor_ += piece.size();
+	}
+
+	return bytes;
+}
+
+bool VectorIO::seek(long offset, Seek origin) {
+	long base = 0;
+	switch (origin) {
+		case Seek::Set: { base = 0; break; }
+		case Seek::Cur: { base = cursor_; break; }
+		case Seek::End: { base = vec_.size(); break; }
+		default: assert(!"Invalid seek origin"); // Shouldn't get here
+	}
+
+	if (base + offset < 0) {
+		setError(Error::InvalidOperation);
+		return false;
+	}
+
+	eof_ = false;
+	cursor_ = base + offset;
+
+	// Seeking past the end and writing leaves a zero-filled gap, same as a file would
+	return true;
+}
+
+long VectorIO::tell() {
+	return cursor_;
+}
+
 } // namespace io
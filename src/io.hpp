@@ -1,4 +1,7 @@
 #pragma once
+#include <algorithm>
+#include <cstdio>
+#include <expected>
 #include <span>
 #include <string_view>
 #include <system_error>
@@ -10,6 +13,10 @@
 
 // IO code largely copied from manatools, with some irrelevant methods removed.
 namespace io {
+	// For the non-throwing APIs, which hand errors back rather than unwinding
+	template <typename T = void>
+	using Result = std::expected<T, std::error_code>;
+
 	class DataIO {
 	public:
 		DataIO(const DataIO&) = delete;
@@ -25,6 +32,13 @@ namespace io {
 		virtual bool seek(long offset, Seek origin) = 0;
 		virtual long tell() = 0;
 
+		/**
+		 * Writes every piece one after another, as one write where that's
+		 * possible, so big buffers owned elsewhere can go out without first
+		 * being copied together. Returns how many bytes were written.
+		 */
+		virtual size_t writeGather(std::span<const std::span<const u8>> pieces);
+
 		bool jump(long offset)                           { return seek(offset, Seek::Set); }
 		bool forward(long offset)                        { return seek(offset, Seek::Cur); }
 		bool backward(long offset)                       { return seek(-offset, Seek::Cur); }
@@ -34,13 +48,23 @@ namespace io {
 		bool readS8(s8* out)                             { return read(out, sizeof(*out), 1) == 1; }
 		bool readU16LE(u16* out);
 		bool readU32LE(u32* out);
+		bool readU16BE(u16* out);
+		bool readU32BE(u32* out);
 		bool readBool(bool* out);
 		bool readString(char* out, size_t size);
 
+		Result<u8> readU8();
+		Result<u16> readU16LE();
+		Result<u32> readU32LE();
+		Result<u16> readU16BE();
+		Result<u32> readU32BE();
+
 		bool writeU8(u8 in)                              { return write(&in, sizeof(in), 1) == 1; }
 		bool writeS8(s8 in)                              { return write(&in, sizeof(in), 1) == 1; }
 		bool writeU16LE(u16 in);
 		bool writeU32LE(u32 in);
+		bool writeU16BE(u16 in);
+		bool writeU32BE(u32 in);
 		bool writeBool(bool in);
 		bool writeStr(const std::string_view in)         { return write(in.data(), sizeof(char), in.size()) == in.size(); }
 
@@ -53,8 +77,8 @@ namespace io {
 		template <size_t N>
 		bool readStrT(char (&buf)[N])                    { return readString(buf, N); }
 
-		template <typename T>
-		bool readVec(std::vector<T>& in)                 { return read(in.data(), sizeof(T), in.size()) == in.size(); }
+		template <typename T, typename Alloc>
+		bool readVec(std::vector<T, Alloc>& in)          { return read(in.data(), sizeof(T), in.size()) == in.size(); }
 
 		template <typename T, size_t Extent>
 		bool readSpan(std::span<T, Extent> in)           { return read(in.data(), sizeof(T), in.size()) == in.size(); }
@@ -65,12 +89,43 @@ namespace io {
 		template <typename T, size_t N>
 		bool writeArrT(const T (&buf)[N])                { return write(buf, sizeof(T), N) == N; }
 
-		template <typename T>
-		bool writeVec(const std::vector<T>& in)          { return write(in.data(), sizeof(T), in.size()) == in.size(); }
+		template <typename T, typename Alloc>
+		bool writeVec(const std::vector<T, Alloc>& in)   { return write(in.data(), sizeof(T), in.size()) == in.size(); }
 
 		template <typename T, size_t Extent>
 		bool writeSpan(const std::span<T, Extent> in)    { return write(in.data(), sizeof(T), in.size()) == in.size(); }
 
+		// Arrays of little endian values in one go, rather than a call for every element
+		template <typename T, size_t Extent>
+		bool readArrLE(std::span<T, Extent> out) {
+			if (!readSpan(out))
+				return false;
+
+			swapLE(out);
+			return true;
+		}
+
+		template <typename T, size_t Extent>
+		bool writeArrLE(std::span<T, Extent> in) {
+			if constexpr (std::endian::native == std::endian::little) {
+				return writeSpan(in);
+			} else {
+				// Swapped through a buffer a piece at a time, so `in` is left alone and nothing's allocated
+				std::remove_const_t<T> buf[1024];
+
+				for (size_t i = 0; i < in.size(); i += std::size(buf)) {
+					std::span chunk(buf, std::min(std::size(buf), in.size() - i));
+					std::copy_n(in.begin() + i, chunk.size(), chunk.begin());
+					swapLE(chunk);
+
+					if (!writeSpan(chunk))
+						return false;
+				}
+
+				return true;
+			}
+		}
+
 		template <typename T>
 		bool writeN(T in, size_t count) {
 			while (count--) {
@@ -91,6 +146,16 @@ namespace io {
 
 		explicit operator bool() const   { return !error(); }
 
+		/**
+		 * Errors stick around until cleared, so with exceptions off a whole
+		 * block of reads or writes can be done and then checked just once.
+		 */
+		Result<> status() const {
+			if (error_)
+				return std::unexpected(error_);
+			return {};
+		}
+
 		virtual void clear() {
 			eof_ = false;
 			error_.clear();
@@ -148,6 +213,11 @@ namespace io {
 			setError(make_error_code(err));
 		}
 
+		// A failed read without EOF errors on still needs something to report
+		std::error_code readError() {
+			return error_ ? error_ : make_error_code(Error::EndOfFile);
+		}
+
 		// ugh... not so satisfied with how EOF is handled
 		bool eof_ = false;
 		std::error_code error_;
@@ -162,6 +232,13 @@ namespace io {
 			if (ret) \
 				*out = endian(*out); \
 			return ret; \
+		} \
+		\
+		inline Result<type> DataIO::read##name() { \
+			type out; \
+			if (!read##name(&out)) \
+				return std::unexpected(readError()); \
+			return out; \
 		}
 
 	#define DEFINE_WRITE_FUNC(type, endian, name) \
@@ -172,6 +249,15 @@ namespace io {
 
 	DEFINE_READ_FUNC(u16, LE, U16LE)
 	DEFINE_READ_FUNC(u32, LE, U32LE)
+	DEFINE_READ_FUNC(u16, BE, U16BE)
+	DEFINE_READ_FUNC(u32, BE, U32BE)
+
+	inline Result<u8> DataIO::readU8() {
+		u8 out;
+		if (!readU8(&out))
+			return std::unexpected(readError());
+		return out;
+	}
 
 	inline bool DataIO::readBool(bool* out) {
 		u8 b;
@@ -190,6 +276,8 @@ namespace io {
 
 	DEFINE_WRITE_FUNC(u16, LE, U16LE)
 	DEFINE_WRITE_FUNC(u32, LE, U32LE)
+	DEFINE_WRITE_FUNC(u16, BE, U16BE)
+	DEFINE_WRITE_FUNC(u32, BE, U32BE)
 
 	inline bool DataIO::writeBool(bool in) {
 		u8 b = in;
@@ -216,6 +304,12 @@ namespace io {
 			open(path, mode);
 		}
 
+		// Wraps a stream opened elsewhere, like stdin, which is left open when this is closed
+		explicit FileIO(FILE* handle, bool exceptions = true, bool eofErrors = true) :
+			DataIO(exceptions, eofErrors),
+			handle_(handle),
+			owned_(false) {}
+
 		// all this wide char and string stuff. i hate windows
 		#ifdef _WIN32
 		FileIO(const wchar_t* path, const char* mode, bool exceptions = true, bool eofErrors = true) : DataIO(exceptions, eofErrors) {
@@ -253,12 +347,56 @@ namespace io {
 		size_t write(const void* buf, size_t size, size_t count) override;
 		bool seek(long offset, Seek origin) override;
 		long tell() override;
+		size_t writeGather(std::span<const std::span<const u8>> pieces) override;
 
 		bool flush();
 		bool close();
 
 	private:
 		FILE* handle_ = nullptr;
+		bool owned_ = true;
+	};
+
+	// Read-only view of memory owned by someone else
+	class SpanIO : public DataIO {
+	public:
+		SpanIO(std::span<const u8> span, bool exceptions = true, bool eofErrors = true) :
+			DataIO(exceptions, eofErrors),
+			span_(span) {}
+
+		size_t read(void* buf, size_t size, size_t count) override;
+		size_t write(const void* buf, size_t size, size_t count) override;
+		bool seek(long offset, Seek origin) override;
+		long tell() override;
+
+		std::span<const u8> span() const { return span_; }
+
+	private:
+		std::span<const u8> span_;
+		size_t cursor_ = 0;
+	};
+
+	// Growable in-memory buffer, for building up data that gets spliced in elsewhere
+	class VectorIO : public DataIO {
+	public:
+		VectorIO(bool exceptions = true, bool eofErrors = true) : DataIO(exceptions, eofErrors) {}
+
+		VectorIO(std::vector<u8> vec, bool exceptions = true, bool eofErrors = true) :
+			DataIO(exceptions, eofErrors),
+			vec_(std::move(vec)) {}
+
+		size_t read(void* buf, size_t size, size_t count) override;
+		size_t write(const void* buf, size_t size, size_t count) override;
+		bool seek(long offset, Seek origin) override;
+		long tell() override;
+		size_t writeGather(std::span<const std::span<const u8>> pieces) override;
+
+		std::vector<u8>& vec()             { return vec_; }
+		const std::vector<u8>& vec() const { return vec_; }
+
+	private:
+		std::vector<u8> vec_;
+		size_t cursor_ = 0;
 	};
 
 	class ErrorHandler {
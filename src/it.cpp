@@ -1,5 +1,9 @@
+#include <algorithm>
+#include <array>
+#include <cstring>
 #include "io.hpp"
 #include "it.hpp"
+#include "stats.hpp"
 
 enum PatternMaskBits : u8 {
 	ITPMB_NOTE            = 1 << 0,
@@ -12,37 +16,266 @@ enum PatternMaskBits : u8 {
 	ITPMB_LAST_COMMAND    = 1 << 7
 };
 
-static void writeEnvelope(io::FileIO& file, const IT::Envelope& env) {
+namespace {
+	class ErrorCategory final : public std::error_category {
+		const char* name() const noexcept override {
+			return "IT";
+		}
+
+		std::string message(int e) const override {
+			switch (static_cast<IT::Error>(e)) {
+				case IT::Error::TooManyInstruments: return "IT has more than 99 instruments";
+				case IT::Error::TooManySamples:     return "IT has more than 99 samples";
+				case IT::Error::TooManyPatterns:    return "IT has more than 200 patterns";
+				case IT::Error::TooManyOrders:      return "IT has more than 256 orders";
+				case IT::Error::MessageTooLong:     return "IT message is longer than 8000 bytes";
+				case IT::Error::TooManyRows:        return "IT pattern has more than 200 rows";
+				case IT::Error::ChannelOutOfRange:  return "IT pattern has a note past channel 64";
+				default:                            return "Unknown IT error";
+			}
+		}
+	};
+}
+
+static ErrorCategory ITErrorCategory;
+
+std::error_code IT::make_error_code(Error e) {
+	return { static_cast<int>(e), ITErrorCategory };
+}
+
+static void writeEnvelope(io::DataIO& file, const IT::Envelope& env) {
 	file.writeU8(env.flags);
 	file.writeU8(env.numPoints);
 	file.writeU8(env.loopBegin);
 	file.writeU8(env.loopEnd);
 	file.writeU8(env.sustainLoopBegin);
 	file.writeU8(env.sustainLoopEnd);
-	file.writeArrT(env.points); // Hope the members are in the right order
+
+	// Points are packed to 3 bytes on disk, so they can't be written as-is
+	for (const IT::Envelope::Point& point : env.points) {
+		file.writeS8(point.y);
+		file.writeU16LE(point.tick);
+	}
+
+	file.writeU8(IT::RESERVED);
+}
+
+static void writeInstrument(io::DataIO& file, const IT::Instrument& instr) {
+	file.writeArrT(IT::Instrument::MAGIC);
+	file.writeArrT(instr.dosFilename);
+
+	file.writeU8(static_cast<u8>(instr.nna));
+	file.writeU8(static_cast<u8>(instr.dct));
+	file.writeU8(static_cast<u8>(instr.dca));
+
+	file.writeU16LE(instr.fadeOut);
+
+	file.writeS8(instr.pitchPanSep);
+	file.writeU8(instr.pitchPanCenter);
+
+	file.writeU8(instr.globalVolume);
+	file.writeU8(instr.defaultPan);
+
+	file.writeU8(instr.randVolVar);
+	file.writeU8(instr.randPanVar);
+
+	// TrkVers and NoS. Not relevant for us
+	file.writeU16LE(IT::UNUSED);
+	file.writeU8(IT::UNUSED);
+	file.writeU8(IT::RESERVED);
+
+	file.writeArrT(instr.name);
+
+	file.writeU8(instr.initialFilterCutoff);
+	file.writeU8(instr.initialFilterResonance);
+
+	file.writeU8(instr.midiChannel);
+	file.writeS8(instr.midiProgram);
+	file.writeS8(instr.midiBankLSB);
+	file.writeS8(instr.midiBankMSB);
+
+	// Sure hope each struct member is in the right order when writing this way
+	file.writeArrT(instr.keyboard);
+
+	writeEnvelope(file, instr.volEnv);
+	writeEnvelope(file, instr.panEnv);
+	writeEnvelope(file, instr.pitchEnv);
+
+	// Pads the header out to 554 bytes, like Impulse Tracker does
+	file.writeU32LE(IT::UNUSED);
+}
+
+// Sample pointer is left as 0, and its position returned so it can be relocated later
+static u32 writeSampleHeader(io::DataIO& file, const IT::Sample& smpl) {
+	u32 samplePointer;
+
+	file.writeArrT(IT::Sample::MAGIC);
+	file.writeArrT(smpl.dosFilename); // Null terminator doubles as the reserved byte
+
+	file.writeU8(smpl.globalVol);
+	file.writeU8(smpl.flags);
+	file.writeU8(smpl.defaultVol);
+
+	file.writeArrT(smpl.name);
+
+	file.writeU8(smpl.convertFlags);
+
+	file.writeU8(smpl.defaultPan);
+
+	file.writeU32LE(smpl.length);
+	file.writeU32LE(smpl.loopBegin);
+	file.writeU32LE(smpl.loopEnd);
+
+	file.writeU32LE(smpl.c5Speed);
+
+	file.writeU32LE(smpl.sustainLoopBegin);
+	file.writeU32LE(smpl.sustainLoopEnd);
+
+	samplePointer = file.tell();
+	file.writeU32LE(0);
+
+	file.writeU8(smpl.vibratoSpeed);
+	file.writeU8(smpl.vibratoDepth);
+	file.writeU8(smpl.vibratoRate);
+	file.writeU8(static_cast<u8>(smpl.vibratoType));
+
+	return samplePointer;
+}
+
+std::span<const IT::Pattern::Cell> IT::Pattern::row(u16 row) const {
+	auto begin = std::lower_bound(cells.begin(), cells.end(), row, [](const Cell& cell, u16 row) { return cell.row < row; });
+	auto end = std::find_if(begin, cells.end(), [row](const Cell& cell) { return cell.row != row; });
+	return { begin, end };
+}
+
+// Everything but the sample data itself, which gets written straight from the samples
+static IT::PrelinkedSection prelinkHeaders(std::span<const IT::Instrument> instruments, std::span<const IT::Sample> samples) {
+	IT::PrelinkedSection section;
+	io::VectorIO buf;
+
+	std::vector<u32> samplePointers;
+	samplePointers.reserve(samples.size());
+
+	section.instrumentOffsets.reserve(instruments.size());
+	section.sampleOffsets.reserve(samples.size());
+
+	for (const IT::Instrument& instr : instruments) {
+		section.instrumentOffsets.push_back(buf.tell());
+		writeInstrument(buf, instr);
+	}
+
+	for (const IT::Sample& smpl : samples) {
+		section.sampleOffsets.push_back(buf.tell());
+		samplePointers.push_back(writeSampleHeader(buf, smpl));
+	}
+
+	/**
+	 * I *could* just write the sample data after each header, but might as
+	 * well be compliant to what other things do and write it all sequentially.
+	 */
+	u32 dataOffset = buf.tell();
+
+	for (size_t i = 0; i < samples.size(); i++) {
+		if (samples[i].data.empty())
+			continue;
+
+		buf.jump(samplePointers[i]);
+		buf.writeU32LE(dataOffset);
+		dataOffset += samples[i].data.size();
+
+		section.relocations.push_back(samplePointers[i]);
+	}
+
+	section.data = std::move(buf.vec());
+	return section;
 }
 
+IT::PrelinkedSection IT::prelink() const {
+	PrelinkedSection section = prelinkHeaders(instruments, samples);
+	section.samples.assign(samples.begin(), samples.end());
+	return section;
+}
+
+static std::error_code checkPattern(const IT::Pattern& pat) {
+	if (pat.rows > IT::MAX_ROWS) {
+		return IT::make_error_code(IT::Error::TooManyRows);
+	}
+
+	for (const IT::Pattern::Cell& cell : pat.cells) {
+		if (cell.channel >= IT::MAX_CHANNELS) {
+			return IT::make_error_code(IT::Error::ChannelOutOfRange);
+		}
+	}
+
+	return {};
+}
+
+static void encodePattern(io::DataIO& file, const IT::Pattern& pat);
+
 void IT::save(const fs::path& path) const {
 	io::FileIO file(path, "wb");
+	save(file);
+}
+
+// IO errors are thrown by `file` itself, as long as it's left to throw, which is the default
+void IT::save(io::DataIO& file) const {
+	if (auto saved = trySave(file); !saved)
+		throw std::system_error(saved.error());
+}
+
+std::expected<void, std::error_code> IT::trySave(const fs::path& path) const {
+	io::FileIO file(path, "wb", false);
+	if (!file.isOpen())
+		return std::unexpected(file.error());
+
+	if (auto saved = trySave(file); !saved)
+		return saved;
+
+	file.close();
+	return file.status();
+}
+
+/**
+ * Offsets are taken from tell(), so `file` should be at the start. Errors are
+ * only checked for once at the end, as they stick around once set.
+ */
+std::expected<void, std::error_code> IT::trySave(io::DataIO& file) const {
+	MIO2IT_STAT_SCOPE("save-it");
+
+	// Samples are only referenced when writing, so there's no need to copy them for a one-off section
+	PrelinkedSection localSection;
+	const PrelinkedSection& section = prelinked ? *prelinked : (localSection = prelinkHeaders(instruments, samples));
 
 	u32 lastPos;
-	u32 lastPos2;
 
 	/* ================================ *
 	 *      Initial validity tests      *
 	 * ================================ */
 
-	if (instruments.size() > MAX_INSTRUMENTS) {
-		throw std::runtime_error("IT has more than 99 instruments");
+	if (section.instrumentOffsets.size() > MAX_INSTRUMENTS) {
+		return std::unexpected(make_error_code(Error::TooManyInstruments));
+	}
+
+	if (section.sampleOffsets.size() > MAX_SAMPLES) {
+		return std::unexpected(make_error_code(Error::TooManySamples));
 	}
 
-	if (samples.size() > MAX_SAMPLES) {
-		throw std::runtime_error("IT has more than 99 samples");
+	if (patterns.size() > MAX_PATTERNS) {
+		return std::unexpected(make_error_code(Error::TooManyPatterns));
+	}
+
+	if (orders.size() > MAX_ORDERS) {
+		return std::unexpected(make_error_code(Error::TooManyOrders));
 	}
 
 	// Do the equal to because of the null terminator
 	if (message.size() >= MAX_MESSAGE_LENGTH) {
-		throw std::runtime_error("IT message is longer than 8000 bytes");
+		return std::unexpected(make_error_code(Error::MessageTooLong));
+	}
+
+	for (const Pattern& pat : patterns) {
+		if (std::error_code err = checkPattern(pat))
+			return std::unexpected(err);
 	}
 
 	/* ======================= *
@@ -51,7 +284,6 @@ void IT::save(const fs::path& path) const {
 
 	u32 messageOffset;
 	u32 instrumentOffsets;
-	u32 sampleOffsets;
 	u32 patternOffsets;
 
 	file.writeArrT(MAGIC);
@@ -61,8 +293,8 @@ void IT::save(const fs::path& path) const {
 	file.writeU8(highlightRowsPerMeasure);
 
 	file.writeU16LE(orders.size());
-	file.writeU16LE(instruments.size());
-	file.writeU16LE(samples.size());
+	file.writeU16LE(section.instrumentOffsets.size());
+	file.writeU16LE(section.sampleOffsets.size());
 	file.writeU16LE(patterns.size());
 
 	file.writeU16LE(TRACKER_VERSION);
@@ -96,10 +328,7 @@ void IT::save(const fs::path& path) const {
 	file.writeVec(orders);
 
 	instrumentOffsets = file.tell();
-	file.writeN(u32(0), instruments.size());
-
-	sampleOffsets = file.tell();
-	file.writeN(u32(0), samples.size());
+	file.writeN(u32(0), section.instrumentOffsets.size() + section.sampleOffsets.size());
 
 	patternOffsets = file.tell();
 	file.writeN(u32(0), patterns.size());
@@ -112,155 +341,135 @@ void IT::save(const fs::path& path) const {
 	file.writeStr(message);
 	file.writeU8('\0');
 
-	/* ===================== *
-	 *      Instruments      *
-	 * ===================== */
-
-	for (size_t i = 0; i < instruments.size(); i++) {
-		const Instrument& instr = instruments[i];
-
-		lastPos = file.tell();
-		file.jump(instrumentOffsets + (i * sizeof(u32)));
-		file.writeU32LE(lastPos);
-		file.jump(lastPos);
-
-		file.writeArrT(Instrument::MAGIC);
-		file.writeArrT(instr.dosFilename);
-
-		file.writeU8(static_cast<u8>(instr.nna));
-		file.writeU8(static_cast<u8>(instr.dct));
-		file.writeU8(static_cast<u8>(instr.dca));
-
-		file.writeU16LE(instr.fadeOut);
-
-		file.writeS8(instr.pitchPanSep);
-		file.writeU8(instr.pitchPanCenter);
-
-		file.writeU8(instr.globalVolume);
-		file.writeU8(instr.defaultPan);
-
-		file.writeU8(instr.randVolVar);
-		file.writeU8(instr.randPanVar);
+	/* ================================== *
+	 *      Instruments and samples       *
+	 * ================================== */
+
+	// Everything in the section is relative to where it ends up, so only the pointers need fixing
+	u32 sectionBase = file.tell();
+
+	// Both tables are right next to each other, and were checked to fit up above
+	std::array<u32, MAX_INSTRUMENTS + MAX_SAMPLES> offsets;
+	size_t numOffsets = 0;
+
+	for (u32 offset : section.instrumentOffsets)
+		offsets[numOffsets++] = sectionBase + offset;
+	for (u32 offset : section.sampleOffsets)
+		offsets[numOffsets++] = sectionBase + offset;
+
+	file.jump(instrumentOffsets);
+	file.writeArrLE(std::span(offsets.data(), numOffsets));
+	file.jump(sectionBase);
+
+	/**
+	 * Headers are written around the relocations rather than patching a copy,
+	 * then the sample data goes straight out of the samples it belongs to, all
+	 * in one gathered write. Nothing in the section gets copied on the way.
+	 */
+	std::span<const u8> sectionData = section.data;
+	size_t sectionPos = 0;
+
+	std::array<u32, MAX_SAMPLES> pointers;
+	std::array<std::span<const u8>, MAX_SAMPLES * 3 + 1> pieces;
+	size_t numPieces = 0;
+
+	for (size_t i = 0; i < section.relocations.size(); i++) {
+		u32 reloc = section.relocations[i];
+		u32 ptr;
+		memcpy(&ptr, &sectionData[reloc], sizeof(ptr));
+		pointers[i] = LE(LE(ptr) + sectionBase);
+
+		pieces[numPieces++] = sectionData.subspan(sectionPos, reloc - sectionPos);
+		pieces[numPieces++] = { reinterpret_cast<const u8*>(&pointers[i]), sizeof(u32) };
+		sectionPos = reloc + sizeof(ptr);
+	}
 
-		// TrkVers and NoS. Not relevant for us
-		file.writeU16LE(UNUSED);
-		file.writeU8(UNUSED);
-		file.writeU8(RESERVED);
+	pieces[numPieces++] = sectionData.subspan(sectionPos);
 
-		file.writeArrT(instr.name);
+	for (const Sample& smpl : effectiveSamples()) {
+		if (!smpl.data.empty())
+			pieces[numPieces++] = smpl.data;
+	}
 
-		file.writeU8(instr.initialFilterCutoff);
-		file.writeU8(instr.initialFilterResonance);
+	file.writeGather(std::span(pieces.data(), numPieces));
 
-		file.writeU8(instr.midiChannel);
-		file.writeS8(instr.midiProgram);
-		file.writeS8(instr.midiBankLSB);
-		file.writeS8(instr.midiBankMSB);
+	/* ================== *
+	 *      Patterns      *
+	 * ================== */
 
-		// Sure hope each struct member is in the right order when writing this way
-		file.writeArrT(instr.keyboard);
+	// Offsets are only filled in once every pattern's written, saves seeking back for each one
+	std::array<u32, MAX_PATTERNS> patternPositions;
 
-		writeEnvelope(file, instr.volEnv);
-		writeEnvelope(file, instr.panEnv);
-		writeEnvelope(file, instr.pitchEnv);
+	for (size_t i = 0; i < patterns.size(); i++) {
+		patternPositions[i] = file.tell();
+		encodePattern(file, patterns[i]);
 	}
 
-	/* ================= *
-	 *      Samples      *
-	 * ================= */
-
-	for (size_t i = 0; i < samples.size(); i++) {
-		const Sample& smpl = samples[i];
-
-		lastPos = file.tell();
-		file.jump(sampleOffsets + (i * sizeof(u32)));
-		file.writeU32LE(lastPos);
-		file.jump(lastPos);
+	lastPos = file.tell();
+	file.jump(patternOffsets);
+	file.writeArrLE(std::span(patternPositions.data(), patterns.size()));
+	file.jump(lastPos);
 
-		file.writeArrT(Sample::MAGIC);
-		file.writeArrT(smpl.dosFilename);
+	return file.status();
+}
 
-		file.writeU8(RESERVED);
-		file.writeU8(smpl.globalVol);
-		file.writeU8(smpl.flags);
-		file.writeU8(smpl.defaultVol);
+u32 IT::patternTableOffset() const {
+	size_t numInstruments = prelinked ? prelinked->instrumentOffsets.size() : instruments.size();
+	size_t numSamples = prelinked ? prelinked->sampleOffsets.size() : samples.size();
 
-		file.writeArrT(smpl.name);
+	return HEADER_SIZE + orders.size() + (numInstruments + numSamples) * sizeof(u32);
+}
 
-		file.writeU8(smpl.convertFlags);
+void IT::writePattern(io::DataIO& file, const Pattern& pat) {
+	if (std::error_code err = checkPattern(pat))
+		throw std::system_error(err);
 
-		file.writeU8(smpl.defaultPan);
+	encodePattern(file, pat);
+}
 
-		file.writeU32LE(smpl.length);
-		file.writeU32LE(smpl.loopBegin);
-		file.writeU32LE(smpl.loopEnd);
+// Assumes checkPattern() has already passed
+static void encodePattern(io::DataIO& file, const IT::Pattern& pat) {
+	u32 start = file.tell();
+	u32 end;
 
-		file.writeU32LE(smpl.c5Speed);
+	file.writeU16LE(0); // Packed length, not yet known
+	file.writeU16LE(pat.rows);
+	file.writeU32LE(IT::RESERVED);
 
-		file.writeU32LE(smpl.sustainLoopBegin);
-		file.writeU32LE(smpl.sustainLoopEnd);
+	// Empty cells are left out entirely, rows only need their end marker
+	auto cell = pat.cells.begin();
 
-		/**
-		 * I *could* just write the sample data after the header, but might as
-		 * well be compliant to what other things do and write it all sequentially.
-		 */
-		file.writeU32LE(0);
+	for (u32 r = 0; r < pat.rows; r++) {
+		for (; cell != pat.cells.end() && cell->row == r; ++cell) {
+			const IT::Note& note = cell->note;
+			u8 mask = 0;
 
-		file.writeU8(smpl.vibratoSpeed);
-		file.writeU8(smpl.vibratoDepth);
-		file.writeU8(smpl.vibratoRate);
-		file.writeU8(static_cast<u8>(smpl.vibratoType));
-	}
+			if (note.note.has_value())     mask |= ITPMB_NOTE;
+			if (note.instrument)           mask |= ITPMB_INSTRUMENT;
+			if (note.volume != IT::ITVPR_NULL) mask |= ITPMB_VOL_PAN;
+			if (note.effect || note.param) mask |= ITPMB_COMMAND;
 
-	/* ================== *
-	 *      Patterns      *
-	 * ================== */
+			if (!mask)
+				continue;
 
-	for (size_t i = 0; i < patterns.size(); i++) {
-		const Pattern& pat = patterns[i];
+			// TODO: Implement pattern optimisation
 
-		if (pat.rows > MAX_ROWS) {
-			throw std::runtime_error("IT pattern has more than 200 rows");
-		}
+			file.writeU8((cell->channel + 1) | 0x80);
+			file.writeU8(mask);
 
-		lastPos = file.tell();
-		file.jump(patternOffsets + (i * sizeof(u32)));
-		file.writeU32LE(lastPos);
-		file.jump(lastPos);
-
-		file.writeU16LE(0); // Packed length, not yet known
-		file.writeU16LE(pat.rows);
-		file.writeU32LE(RESERVED);
-
-		for (u32 r = 0; r < pat.rows; r++) {
-			for (u32 c = 0; c < MAX_CHANNELS; c++) {
-				Note note = pat.data[c][r];
-				u8 mask = 0;
-
-				if (note.note.has_value())     mask |= ITPMB_NOTE;
-				if (note.instrument)           mask |= ITPMB_INSTRUMENT;
-				if (note.volume != ITVPR_NULL) mask |= ITPMB_VOL_PAN;
-				if (note.effect || note.param) mask |= ITPMB_COMMAND;
-
-				// TODO: Implement pattern optimisation
-
-				file.writeU8((c + 1) | 0x80);
-				file.writeU8(mask);
-
-				if (mask & ITPMB_NOTE)       file.writeU8(note.note.value());
-				if (mask & ITPMB_INSTRUMENT) file.writeU8(note.instrument);
-				if (mask & ITPMB_VOL_PAN)    file.writeU8(note.volume);
-				if (mask & ITPMB_COMMAND) {
-					file.writeU8(note.effect);
-					file.writeU8(note.param);
-				}
+			if (mask & ITPMB_NOTE)       file.writeU8(note.note.value());
+			if (mask & ITPMB_INSTRUMENT) file.writeU8(note.instrument);
+			if (mask & ITPMB_VOL_PAN)    file.writeU8(note.volume);
+			if (mask & ITPMB_COMMAND) {
+				file.writeU8(note.effect);
+				file.writeU8(note.param);
 			}
-			file.writeU8(0);
 		}
-
-		lastPos2 = file.tell();
-		file.jump(lastPos);
-		file.writeU16LE(lastPos2 - (lastPos + 8));
-		file.jump(lastPos2);
+		file.writeU8(0);
 	}
+
+	end = file.tell();
+	file.jump(start);
+	file.writeU16LE(end - (start + 8));
+	file.jump(end);
 }
@@ -1,10 +1,19 @@
 #pragma once
+#include <expected>
+#include <memory>
+#include <memory_resource>
 #include <optional>
+#include <span>
 #include <string>
+#include <system_error>
 #include <vector>
 #include "filesystem.hpp"
 #include "types.hpp"
 
+namespace io {
+	class DataIO;
+}
+
 struct IT {
 	constexpr static u8 MAGIC[4] = { 'I', 'M', 'P', 'M' };
 	constexpr static u16 TRACKER_VERSION = 0xBEEF;
@@ -19,12 +28,16 @@ struct IT {
 	constexpr static int MAX_INSTRUMENTS = 99;
 	constexpr static int MAX_SAMPLES = 99;
 	constexpr static int MAX_CHANNELS = 64;
+	constexpr static int MAX_PATTERNS = 200;
+	constexpr static int MAX_ORDERS = 256;
 
 	constexpr static int MIN_ROWS = 32;
 	constexpr static int MAX_ROWS = 200;
 
 	constexpr static int MAX_MESSAGE_LENGTH = 8000;
 
+	constexpr static u32 HEADER_SIZE = 0xC0;
+
 	enum Flags : u16 {
 		ITMF_STEREO                 = 1 << 0, // Mono otherwise
 		ITMF_VOL0_MIX_OPTIMIZATIONS = 1 << 1, // Redundant
@@ -129,6 +142,19 @@ struct IT {
 		Fade = 2
 	};
 
+	// Things a module can have that the format has no room for
+	enum class Error {
+		TooManyInstruments = 1,
+		TooManySamples,
+		TooManyPatterns,
+		TooManyOrders,
+		MessageTooLong,
+		TooManyRows,
+		ChannelOutOfRange
+	};
+
+	static std::error_code make_error_code(Error e);
+
 	enum class VibratoType : u8 {
 		SineWave   = 0,
 		RampDown   = 1, // Is this not just a sawtooth?
@@ -147,11 +173,40 @@ struct IT {
 		u8 volume     = ITVPR_NULL;
 		u8 effect     = 0;
 		u8 param      = 0;
+
+		bool operator==(const Note&) const = default;
 	};
 
+	// Only cells with something in them are kept
 	struct Pattern {
-		u16 rows;
-		Note data[MAX_CHANNELS][MAX_ROWS];
+		using allocator_type = std::pmr::polymorphic_allocator<>;
+
+		struct Cell {
+			u8 row;
+			u8 channel;
+			Note note;
+
+			bool operator==(const Cell&) const = default;
+		};
+
+		Pattern() = default;
+		explicit Pattern(const allocator_type& alloc) : cells(alloc) {}
+		Pattern(const Pattern& other, const allocator_type& alloc) : rows(other.rows), cells(other.cells, alloc) {}
+		Pattern(Pattern&& other, const allocator_type& alloc) : rows(other.rows), cells(std::move(other.cells), alloc) {}
+		Pattern(const Pattern&) = default;
+		Pattern(Pattern&&) = default;
+		Pattern& operator=(const Pattern&) = default;
+		Pattern& operator=(Pattern&&) = default;
+
+		u16 rows = 0;
+		std::pmr::vector<Cell> cells; // Sorted by row, then channel
+
+		// Cells on `row`, in channel order
+		std::span<const Cell> row(u16 row) const;
+
+		bool operator==(const Pattern& other) const {
+			return rows == other.rows && cells == other.cells;
+		}
 	};
 
 	struct Sample {
@@ -252,7 +307,64 @@ struct IT {
 		u8 volume = 64; // 0..64
 	};
 
+	/**
+	 * Instrument and sample headers serialised ahead of time. None of it
+	 * depends on anything else in the module, so the same section can be built
+	 * once for an instrument bank and then spliced into every module using
+	 * that bank.
+	 * Offsets are relative to the start of `data`, and `relocations` lists the
+	 * positions of the u32 sample pointers that need the final base added.
+	 * Sample data isn't copied in, it follows straight on from `data` when
+	 * saving, taken from `samples` in order, which are also kept for playback.
+	 */
+	struct PrelinkedSection {
+		std::vector<u8> data;
+		std::vector<u32> instrumentOffsets;
+		std::vector<u32> sampleOffsets;
+		std::vector<u32> relocations;
+
+		std::vector<Sample> samples;
+	};
+
+	IT() = default;
+
+	/**
+	 * Everything variable sized in the module gets allocated from `resource`,
+	 * so it can all come from an arena that's reset between files.
+	 */
+	explicit IT(std::pmr::memory_resource* resource) :
+		message(resource), orders(resource), instruments(resource), samples(resource), patterns(resource) {}
+
+	PrelinkedSection prelink() const;
+
+	// Samples that will be written, whether they come from `samples` or a prelinked section
+	std::span<const Sample> effectiveSamples() const {
+		if (prelinked)
+			return prelinked->samples;
+		return samples;
+	}
+
+	// These throw on errors
 	void save(const fs::path& path) const;
+	void save(io::DataIO& file) const;
+
+	/**
+	 * Same as above, but errors are returned rather than thrown. Everything is
+	 * checked before anything gets written. `file` should have exceptions
+	 * turned off, otherwise IO errors still get thrown.
+	 */
+	std::expected<void, std::error_code> trySave(const fs::path& path) const;
+	std::expected<void, std::error_code> trySave(io::DataIO& file) const;
+
+	/**
+	 * Writes a pattern, header and all, exactly as save() does. Lets patterns
+	 * be encoded on their own and spliced into a module saved earlier.
+	 * Throws if the pattern can't be stored.
+	 */
+	static void writePattern(io::DataIO& file, const Pattern& pattern);
+
+	// Where save() puts the table of pattern offsets, it always comes right before the message
+	u32 patternTableOffset() const;
 
 	char name[25+1]{};
 
@@ -271,12 +383,15 @@ struct IT {
 	u8 panSeparation       = 128; // 0..128
 	u8 midiPitchWheelDepth = 0;
 
-	std::string message;
+	std::pmr::string message;
 
 	Channel channels[MAX_CHANNELS];
 
-	std::vector<u8> orders;
-	std::vector<Instrument> instruments;
-	std::vector<Sample> samples;
-	std::vector<Pattern> patterns;
+	std::pmr::vector<u8> orders;
+	std::pmr::vector<Instrument> instruments;
+	std::pmr::vector<Sample> samples;
+	std::pmr::vector<Pattern> patterns;
+
+	// If set, this is written instead of `instruments` and `samples`
+	std::shared_ptr<const PrelinkedSection> prelinked;
 };
@@ -1,101 +1,1137 @@
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <condition_variable>
 #include <cstdio>
 #include <cstring>
-#include "it.hpp"
-#include "mio.hpp"
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <string_view>
+#include <thread>
+#include <unordered_set>
+#include "aio.hpp"
+#include "convert.hpp"
+#include "fingerprint.hpp"
+#include "formats.hpp"
+#include "io.hpp"
+#include "manifest.hpp"
+#include "pack.hpp"
+#include "render.hpp"
+#include "server.hpp"
+#include "stats.hpp"
+#include "tar.hpp"
+#include "watch.hpp"
+#include "zip.hpp"
 
-static u8 MIOToITPanTable[] = { 0, 64, 128, 192, 255 };
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
 
-constexpr static u8 letterInAlphabet(char c) {
-	return c - ('A' - 1);
+enum class OutputFormat {
+	IT,
+	XM,
+	MOD,
+	MIDI,
+	WAV
+};
+
+struct Output {
+	OutputFormat format;
+	fs::path path;
+};
+
+struct Options {
+	std::vector<OutputFormat> formats;
+	std::optional<PCMFormat> stream;
+	fs::path serve;
+	bool watch = false;
+	bool dump = false;
+	bool stats = false;
+	fs::path trace;
+	fs::path album;
+	fs::path zip;
+	fs::path tar;
+	fs::path index;
+	fs::path query;
+	float similarity = fingerprint::DEFAULT_SIMILARITY;
+	fs::path manifest;
+	u32 shardIndex = 0;
+	u32 shardCount = 1;
+	aio::Backend io = aio::Backend::Auto;
+	Renderer::Options render;
+	fs::path outDir;
+	std::vector<fs::path> inputs;
+};
+
+static const char* formatExtension(OutputFormat format) {
+	switch (format) {
+		case OutputFormat::IT:   return ".it";
+		case OutputFormat::XM:   return ".xm";
+		case OutputFormat::MOD:  return ".mod";
+		case OutputFormat::MIDI: return ".mid";
+		case OutputFormat::WAV:  return ".wav";
+	}
+	return "";
+}
+
+static std::optional<OutputFormat> parseFormat(std::string_view name) {
+	if (name == "it")  return OutputFormat::IT;
+	if (name == "xm")  return OutputFormat::XM;
+	if (name == "mod") return OutputFormat::MOD;
+	if (name == "mid") return OutputFormat::MIDI;
+	if (name == "wav") return OutputFormat::WAV;
+	return std::nullopt;
+}
+
+// Single output mode goes by the output's extension if no formats are given
+static OutputFormat guessFormat(const fs::path& path) {
+	for (OutputFormat format : { OutputFormat::XM, OutputFormat::MOD, OutputFormat::MIDI, OutputFormat::WAV }) {
+		if (path.extension() == formatExtension(format))
+			return format;
+	}
+	return OutputFormat::IT;
+}
+
+// With more than one format, the output path is just used as a base name
+static std::vector<Output> outputsFor(const fs::path& outPath, const std::vector<OutputFormat>& formats) {
+	std::vector<Output> outputs;
+
+	if (formats.empty()) {
+		outputs.push_back({ guessFormat(outPath), outPath });
+	} else if (formats.size() == 1) {
+		outputs.push_back({ formats[0], outPath });
+	} else {
+		for (OutputFormat format : formats)
+			outputs.push_back({ format, fs::path(outPath).replace_extension(formatExtension(format)) });
+	}
+
+	return outputs;
+}
+
+/**
+ * Info goes to `log`, as stdout may be needed for audio. Bad files are common
+ * enough in big batches that they're reported without throwing.
+ */
+static std::expected<IT, std::error_code> loadAndConvert(mio2it::Converter& converter, const fs::path& mioPath, FILE* log, std::pmr::memory_resource* resource = std::pmr::get_default_resource()) {
+	MIO mio;
+	if (auto loaded = mio.tryLoad(mioPath); !loaded)
+		return std::unexpected(loaded.error());
+
+	fputs(mio2it::describe(mio).c_str(), log);
+
+	return converter.convert(mio, resource);
 }
 
-static void convertMIO(const fs::path& mioPath, const fs::path& itPath) {
-	IT it;
+// From memory, for when the record was read some other way
+static std::expected<IT, std::error_code> loadAndConvert(mio2it::Converter& converter, std::span<const u8> data, FILE* log, std::pmr::memory_resource* resource) {
 	MIO mio;
+	if (auto loaded = mio.tryLoad(data); !loaded)
+		return std::unexpected(loaded.error());
 
-	mio.load(mioPath);
+	fputs(mio2it::describe(mio).c_str(), log);
 
-	MIO::Record& record = mio.recordData;
+	return converter.convert(mio, resource);
+}
+
+// `file` has to be seekable for WAV output, see renderWAV
+static void writeOutput(const IT& it, OutputFormat format, io::DataIO& file, const Options& options) {
+	switch (format) {
+		case OutputFormat::IT:   { it.save(file); break; }
+		case OutputFormat::XM:   { formats::saveXM(it, file); break; }
+		case OutputFormat::MOD:  { formats::saveMOD(it, file); break; }
+		case OutputFormat::MIDI: { formats::saveMIDI(it, file); break; }
+		case OutputFormat::WAV:  { renderWAV(it, file, options.render); break; }
+	}
+}
+
+static void saveOutput(const IT& it, const Output& output, const Options& options) {
+	io::FileIO file(output.path, "wb");
+	writeOutput(it, output.format, file, options);
+}
+
+static void reportError(const fs::path& mioPath, const char* message) {
+	fprintf(stderr, "An error occurred converting %s: %s\n", mioPath.string().c_str(), message);
+}
 
-	printf("Name: %s\n", mio.name);
-	printf("Brand: %s\n", mio.brand);
-	printf("Creator: %s\n", mio.creator);
-	printf("Description: %s\n", mio.description);
-	printf("Serial: %s\n", mio.formatSerial().c_str());
+// Runs `task(i)` for every output at the same time, each on its own thread. Throws if any of them did
+template <typename Task>
+static void forEachOutput(const fs::path& source, size_t count, const Task& task) {
+	std::vector<std::exception_ptr> errors(count);
+	std::vector<std::thread> threads;
 
-	strncpy(it.name, mio.name, std::size(it.name) - 1);
-	it.initialTempo = record.bpm();
-	it.message = mio.description;
+	auto run = [&](size_t i) {
+		MIO2IT_STAT_FILE(source.string());
+
+		try {
+			task(i);
+		} catch (...) {
+			errors[i] = std::current_exception();
+		}
+	};
 
-	it.orders.resize(record.endPhrase);
-	it.patterns.reserve(MIO::Record::MAX_PHRASES);
+	for (size_t i = 1; i < count; i++)
+		threads.emplace_back(run, i);
+	if (count)
+		run(0);
 
-	for (int i = 0; i < record.endPhrase; i++) {
-		it.orders[i] = i;
+	for (std::thread& t : threads)
+		t.join();
+
+	for (std::exception_ptr& err : errors) {
+		if (err)
+			std::rethrow_exception(err);
 	}
+}
 
-	// Set default value to 2 as that is center
-	u8 lastTrackPan[MIO::Record::TRACK_COUNT + 1];
-	std::fill_n(lastTrackPan, MIO::Record::TRACK_COUNT + 1, 2);
+static void saveOutputs(const IT& it, const fs::path& source, const std::vector<Output>& outputs, const Options& options) {
+	forEachOutput(source, outputs.size(), [&](size_t i) {
+		saveOutput(it, outputs[i], options);
+	});
+}
 
-	for (const MIO::Record::Phrase& phrase : record.phrases) {
-		IT::Pattern pattern;
-		pattern.rows = MIO::Record::TRACK_LENGTH;
+/**
+ * The record is only loaded and converted once, then every output is written
+ * from that. Returns false if the record couldn't be loaded, having already
+ * reported why, and throws if an output couldn't be written.
+ */
+static bool processFile(mio2it::Converter& converter, Arena& arena, const fs::path& mioPath, const std::vector<Output>& outputs, const Options& options) {
+	MIO2IT_STAT_FILE(mioPath.string());
+	MIO2IT_STAT_SCOPE("file");
+
+	arena.reset();
+	auto converted = loadAndConvert(converter, mioPath, stdout, arena.resource());
+	if (!converted) {
+		reportError(mioPath, converted.error().message().c_str());
+		return false;
+	}
 
-		// Write all four normal tracks
-		for (int t = 0; t < MIO::Record::TRACK_COUNT; t++) {
-			if (phrase.tracks[t].panning != lastTrackPan[t]) {
-				pattern.data[t][0].effect = letterInAlphabet('X');
-				pattern.data[t][0].param = MIOToITPanTable[phrase.tracks[t].panning];				
+	saveOutputs(*converted, mioPath, outputs, options);
+	return true;
+}
+
+/**
+ * Outputs are made in memory, then added to the archive once they're all
+ * done, so a file that fails partway through leaves nothing of itself in the
+ * archive. Returns false if the file was skipped, having already reported
+ * why. Only throws if writing to the archive itself failed.
+ */
+static bool zipFile(mio2it::Converter& converter, Arena& arena, const fs::path& mioPath, zip::Writer& archive, const Options& options) {
+	MIO2IT_STAT_FILE(mioPath.string());
+	MIO2IT_STAT_SCOPE("file");
+
+	arena.reset();
+	auto converted = loadAndConvert(converter, mioPath, stdout, arena.resource());
+	if (!converted) {
+		reportError(mioPath, converted.error().message().c_str());
+		return false;
+	}
+
+	std::vector<io::VectorIO> data(options.formats.size());
+
+	try {
+		forEachOutput(mioPath, data.size(), [&](size_t i) {
+			writeOutput(*converted, options.formats[i], data[i], options);
+		});
+	} catch (std::runtime_error& err) {
+		reportError(mioPath, err.what());
+		return false;
+	}
+
+	for (size_t i = 0; i < data.size(); i++) {
+		fs::path name = mioPath.filename().replace_extension(formatExtension(options.formats[i]));
+		archive.add(name.string(), data[i].vec());
+	}
+
+	return true;
+}
+
+// Like batch mode, keeps going past bad files, but stops if the archive can't be written
+static bool processZip(mio2it::Converter& converter, Arena& arena, const Options& options) {
+	int failed = 0;
+
+	try {
+		io::FileIO file(options.zip, "wb");
+		zip::Writer archive(file);
+
+		for (const fs::path& mioPath : options.inputs) {
+			if (!zipFile(converter, arena, mioPath, archive, options))
+				failed++;
+		}
+
+		archive.finish();
+		file.close();
+	} catch (std::runtime_error& err) {
+		fprintf(stderr, "An error occurred writing %s: %s\n", options.zip.string().c_str(), err.what());
+		return false;
+	}
+
+	return !failed;
+}
+
+// How many reads, and separately writes, batch mode keeps in flight
+constexpr static unsigned BATCH_DEPTH = 32;
+
+// Goes by file name rather than the whole path, so machines with the corpus mounted in different places agree
+static bool inShard(const fs::path& input, const Options& options) {
+	std::string name = input.filename().string();
+	u64 hash = manifest::hash({ reinterpret_cast<const u8*>(name.data()), name.size() });
+	return hash % options.shardCount == options.shardIndex;
+}
+
+/**
+ * Reads run ahead of conversion and writes are left to finish in the
+ * background, so waiting on the disk overlaps with converting. Files are still
+ * converted in the order they were given. Outputs are made in memory first,
+ * like for --zip, then each one is written out whole.
+ *
+ * With a manifest, inputs it has down as done, into the same outputs as this
+ * run would make, are skipped without being read. Each input is added to it
+ * once all of its outputs have been written.
+ */
+static bool processBatch(mio2it::Converter& converter, Arena& arena, const Options& options) {
+	std::unique_ptr<aio::Queue> queue = aio::open(BATCH_DEPTH, options.io);
+	if (!queue) {
+		fprintf(stderr, "io_uring isn't available\n");
+		return false;
+	}
+
+	std::optional<manifest::Manifest> checkpoint;
+	if (!options.manifest.empty()) {
+		try {
+			checkpoint.emplace(options.manifest);
+		} catch (std::runtime_error& err) {
+			fprintf(stderr, "An error occurred opening %s: %s\n", options.manifest.string().c_str(), err.what());
+			return false;
+		}
+	}
+
+	struct Input {
+		const fs::path* path = nullptr;
+		manifest::Stamp stamp;
+		std::vector<fs::path> outputs;
+		unsigned writesLeft = 0;
+		bool failed = false;
+	};
+
+	std::vector<Input> inputs;
+	size_t skipped = 0;
+
+	for (const fs::path& mioPath : options.inputs) {
+		if (!inShard(mioPath, options))
+			continue;
+
+		Input input;
+		input.path = &mioPath;
+		for (OutputFormat format : options.formats)
+			input.outputs.push_back(options.outDir / mioPath.filename().replace_extension(formatExtension(format)));
+
+		if (checkpoint) {
+			input.stamp = manifest::stamp(mioPath);
+			if (checkpoint->done(mioPath, input.stamp, input.outputs)) {
+				skipped++;
+				continue;
 			}
+		}
 
-			lastTrackPan[t] = phrase.tracks[t].panning;
+		inputs.push_back(std::move(input));
+	}
 
-			for (int n = 0; n < MIO::Record::TRACK_LENGTH; n++) {
-				u8 note = phrase.tracks[t].notes[n];
-				if (note != MIO::Record::NO_NOTE) {
-					pattern.data[t][n].note = note + (7 + (12 * 3));
-					pattern.data[t][n].volume = phrase.tracks[t].volume * 16;
-				}
+	if (skipped)
+		fprintf(stderr, "Skipping %zu files already done in %s\n", skipped, options.manifest.string().c_str());
+
+	std::vector<std::optional<aio::Completion>> reads(inputs.size());
+	size_t nextRead = 0;
+	unsigned readsInFlight = 0;
+	unsigned writesInFlight = 0;
+	bool ok = true;
+
+	auto finish = [&](Input& input) {
+		ok &= !input.failed;
+		if (checkpoint)
+			checkpoint->record(!input.failed, *input.path, input.stamp, input.outputs);
+	};
+
+	auto fail = [&](Input& input, const char* message) {
+		reportError(*input.path, message);
+		input.failed = true;
+	};
+
+	auto handle = [&](aio::Completion done) {
+		if (done.op == aio::Op::Read) {
+			readsInFlight--;
+			reads[done.tag] = std::move(done);
+			return;
+		}
+
+		writesInFlight--;
+		Input& input = inputs[done.tag];
+		if (done.error)
+			fail(input, done.error.message().c_str());
+		if (!--input.writesLeft)
+			finish(input);
+	};
+
+	for (size_t i = 0; i < inputs.size(); i++) {
+		for (; nextRead < inputs.size() && readsInFlight < BATCH_DEPTH; nextRead++, readsInFlight++)
+			queue->read(nextRead, *inputs[nextRead].path);
+
+		while (!reads[i])
+			handle(*queue->wait());
+
+		aio::Completion read = std::move(*reads[i]);
+		reads[i].reset();
+
+		Input& input = inputs[i];
+		const fs::path& mioPath = *input.path;
+
+		if (read.error) {
+			fail(input, read.error.message().c_str());
+			finish(input);
+			continue;
+		}
+
+		MIO2IT_STAT_FILE(mioPath.string());
+		MIO2IT_STAT_SCOPE("file");
+
+		arena.reset();
+		auto converted = loadAndConvert(converter, read.data, stdout, arena.resource());
+		if (!converted) {
+			fail(input, converted.error().message().c_str());
+			finish(input);
+			continue;
+		}
+
+		std::vector<io::VectorIO> data(options.formats.size());
+
+		try {
+			forEachOutput(mioPath, data.size(), [&](size_t j) {
+				writeOutput(*converted, options.formats[j], data[j], options);
+			});
+		} catch (std::runtime_error& err) {
+			fail(input, err.what());
+			finish(input);
+			continue;
+		}
+
+		input.writesLeft = data.size();
+		for (size_t j = 0; j < data.size(); j++) {
+			queue->write(i, input.outputs[j], std::move(data[j].vec()));
+			writesInFlight++;
+		}
+
+		while (writesInFlight > BATCH_DEPTH)
+			handle(*queue->wait());
+	}
+
+	while (queue->pending())
+		handle(*queue->wait());
+
+	return ok;
+}
+
+/**
+ * Records are converted straight out of the mapped dumps, spread across
+ * workers that each have their own converter and arena. Outputs are named
+ * after the dump and where the record came in it, like save-000.it.
+ */
+static bool processDumps(const Options& options) {
+	struct Record {
+		size_t dump;
+		const fs::path* dumpPath;
+		size_t offset;
+		size_t number; // Within its dump
+	};
+
+	std::vector<pack::MappedFile> dumps;
+	std::vector<Record> records;
+	bool ok = true;
+
+	for (const fs::path& dumpPath : options.inputs) {
+		auto dump = pack::MappedFile::open(dumpPath);
+		if (!dump) {
+			reportError(dumpPath, dump.error().message().c_str());
+			ok = false;
+			continue;
+		}
+
+		std::vector<size_t> offsets = pack::scan(dump->data());
+		if (offsets.empty()) {
+			reportError(dumpPath, "No records found");
+			ok = false;
+		}
+
+		for (size_t i = 0; i < offsets.size(); i++)
+			records.push_back({ dumps.size(), &dumpPath, offsets[i], i });
+		dumps.push_back(std::move(*dump));
+	}
+
+	// Each worker renders on its own, records are already spread across every core
+	Options workerOptions = options;
+	workerOptions.render.threads = 1;
+
+	unsigned threads = options.render.threads ? options.render.threads : std::max(1u, std::thread::hardware_concurrency());
+	threads = std::min<size_t>(threads, records.size());
+
+	std::atomic<size_t> next = 0;
+	std::atomic<bool> failed = false;
+
+	auto work = [&] {
+		mio2it::Converter converter;
+		Arena arena;
+
+		for (size_t i; (i = next++) < records.size();) {
+			const Record& record = records[i];
+			const fs::path& dumpPath = *record.dumpPath;
+
+			char suffix[32];
+			snprintf(suffix, sizeof(suffix), "@0x%zX", record.offset);
+			fs::path source = dumpPath.string() + suffix;
+
+			MIO2IT_STAT_FILE(source.string());
+			MIO2IT_STAT_SCOPE("file");
+
+			arena.reset();
+			auto converted = loadAndConvert(converter, dumps[record.dump].data().subspan(record.offset, pack::RECORD_SIZE), stdout, arena.resource());
+			if (!converted) {
+				reportError(source, converted.error().message().c_str());
+				failed = true;
+				continue;
+			}
+
+			snprintf(suffix, sizeof(suffix), "-%03zu", record.number);
+			fs::path outBase = options.outDir / (dumpPath.stem().string() + suffix);
+
+			try {
+				for (OutputFormat format : options.formats)
+					saveOutput(*converted, { format, fs::path(outBase).replace_extension(formatExtension(format)) }, workerOptions);
+			} catch (std::runtime_error& err) {
+				reportError(source, err.what());
+				failed = true;
 			}
 		}
+	};
+
+	std::vector<std::thread> pool;
+	for (unsigned i = 1; i < threads; i++)
+		pool.emplace_back(work);
+	work();
+
+	for (std::thread& t : pool)
+		t.join();
+
+	return ok && !failed;
+}
+
+// Anything bigger than this in a tar can't be a record, so isn't worth reading in
+constexpr static u64 MAX_TAR_MEMBER_SIZE = 1 << 20;
+
+// Where under the output directory a member goes, or nothing if it would end up outside of it
+static std::optional<fs::path> tarMemberPath(const std::string& name) {
+	fs::path path = fs::path(name).lexically_normal();
+	if (path.empty() || path.has_root_path() || !path.has_filename())
+		return std::nullopt;
+
+	for (const fs::path& part : path) {
+		if (part == "..")
+			return std::nullopt;
+	}
+
+	return path;
+}
+
+/**
+ * The archive is read front to back on this thread, and each member is handed
+ * to a pool of workers as soon as it's been read. Outputs keep the member's
+ * directories under the output directory, so the same file name in two
+ * places doesn't clash. Members are read into a few
+ * buffers that go back and forth between the two, so only so far can be read
+ * ahead of the workers however big the archive is.
+ */
+static bool processTar(const Options& options) {
+	unsigned threads = options.render.threads ? options.render.threads : std::max(1u, std::thread::hardware_concurrency());
+
+	Options workerOptions = options;
+	workerOptions.render.threads = 1;
+
+	std::mutex mutex;
+	std::condition_variable changed;
+	std::deque<tar::Member> ready;
+	std::vector<tar::Member> spare(threads * 2);
+	bool reading = true;
+	std::atomic<bool> failed = false;
+
+	auto convertMember = [&](mio2it::Converter& converter, Arena& arena, const tar::Member& member) {
+		fs::path source = options.tar.string() + ":" + member.name;
+
+		MIO2IT_STAT_FILE(source.string());
+		MIO2IT_STAT_SCOPE("file");
 
-		// Write rhythm track
-		for (int p = 0; p < MIO::Record::RHYTHM_SIMULTANEOUS_NOTES; p++) {
-			if (phrase.rhythmTrack.panning != lastTrackPan[4]) {
-				pattern.data[4 + p][0].effect = letterInAlphabet('X');
-				pattern.data[4 + p][0].param = MIOToITPanTable[phrase.rhythmTrack.panning];
+		if (member.size > MAX_TAR_MEMBER_SIZE) {
+			reportError(source, "Too large to be a record");
+			failed = true;
+			return;
+		}
+
+		arena.reset();
+		auto converted = loadAndConvert(converter, member.data, stdout, arena.resource());
+		if (!converted) {
+			reportError(source, converted.error().message().c_str());
+			failed = true;
+			return;
+		}
+
+		fs::path outBase = options.outDir / member.name;
+
+		try {
+			std::error_code err;
+			fs::create_directories(outBase.parent_path(), err);
+
+			for (OutputFormat format : options.formats)
+				saveOutput(*converted, { format, fs::path(outBase).replace_extension(formatExtension(format)) }, workerOptions);
+		} catch (std::runtime_error& err) {
+			reportError(source, err.what());
+			failed = true;
+		}
+	};
+
+	auto work = [&] {
+		mio2it::Converter converter;
+		Arena arena;
+
+		for (;;) {
+			tar::Member member;
+
+			{
+				std::unique_lock lock(mutex);
+				changed.wait(lock, [&] { return !ready.empty() || !reading; });
+				if (ready.empty())
+					return;
+
+				member = std::move(ready.front());
+				ready.pop_front();
 			}
 
-			for (int n = 0; n < MIO::Record::TRACK_LENGTH; n++) {
-				u8 note = phrase.rhythmTrack.notes[p][n];
-				if (note != MIO::Record::NO_NOTE) {
-					pattern.data[4 + p][n].note = note + (7 + (12 * 3));
-					pattern.data[4 + p][n].volume = phrase.rhythmTrack.volume * 16;
-				}
+			convertMember(converter, arena, member);
+
+			{
+				std::lock_guard lock(mutex);
+				spare.push_back(std::move(member));
 			}
+			changed.notify_all();
 		}
+	};
+
+	std::vector<std::thread> pool;
+	for (unsigned i = 0; i < threads; i++)
+		pool.emplace_back(work);
 
-		lastTrackPan[4] = phrase.rhythmTrack.panning;
+	// Workers have to be stopped before anything goes wrong here can be reported
+	bool readOK = true;
 
-		it.patterns.push_back(pattern);
+	try {
+		io::FileIO file = options.tar == "-" ? io::FileIO(stdin, true, false) : io::FileIO(options.tar, "rb", true, false);
+		tar::Reader reader(file);
+		std::unordered_set<std::string> seen;
+
+		for (;;) {
+			tar::Member member;
+
+			{
+				std::unique_lock lock(mutex);
+				changed.wait(lock, [&] { return !spare.empty(); });
+				member = std::move(spare.back());
+				spare.pop_back();
+			}
+
+			if (!reader.next(member, MAX_TAR_MEMBER_SIZE))
+				break;
+
+			// Tars can have the same path more than once, and both would be written at the same time
+			fs::path source = options.tar.string() + ":" + member.name;
+			std::optional<fs::path> path = tarMemberPath(member.name);
+			const char* skip = !path ? "Path would be outside of the output directory" :
+			                   !seen.insert(path->generic_string()).second ? "In the archive more than once" : nullptr;
+
+			if (skip) {
+				reportError(source, skip);
+				failed = true;
+
+				std::lock_guard lock(mutex);
+				spare.push_back(std::move(member));
+				continue;
+			}
+
+			member.name = path->generic_string();
+
+			{
+				std::lock_guard lock(mutex);
+				ready.push_back(std::move(member));
+			}
+			changed.notify_all();
+		}
+	} catch (std::runtime_error& err) {
+		fprintf(stderr, "An error occurred reading %s: %s\n", options.tar.string().c_str(), err.what());
+		readOK = false;
 	}
 
-	it.save(itPath);
+	{
+		std::lock_guard lock(mutex);
+		reading = false;
+	}
+	changed.notify_all();
+
+	for (std::thread& t : pool)
+		t.join();
+
+	return readOK && !failed;
 }
 
-int main(int argc, char** argv) {
-	if (argc != 3) {
-		fprintf(stderr, "Usage: %s <in.mio> <out.it>\n", argv[0]);
+// Records that fail to load are reported and left out, the rest still get indexed
+static bool processIndex(const Options& options) {
+	std::vector<fingerprint::Entry> entries;
+	entries.reserve(options.inputs.size());
+	bool ok = true;
+
+	for (const fs::path& mioPath : options.inputs) {
+		MIO mio;
+		if (auto loaded = mio.tryLoad(mioPath); !loaded) {
+			reportError(mioPath, loaded.error().message().c_str());
+			ok = false;
+			continue;
+		}
+
+		entries.push_back({ mioPath.string(), fingerprint::compute(mio.recordData) });
+	}
+
+	try {
+		io::FileIO out(options.index, "wb");
+		fingerprint::writeIndex(out, entries);
+		out.close();
+	} catch (std::runtime_error& err) {
+		fprintf(stderr, "An error occurred writing %s: %s\n", options.index.string().c_str(), err.what());
+		return false;
+	}
+
+	fprintf(stderr, "Indexed %zu records\n", entries.size());
+	return ok;
+}
+
+// Matches go to stdout as "input<tab>match<tab>similarity" lines, nothing for inputs unlike anything
+static bool processQuery(const Options& options) {
+	std::optional<fingerprint::Index> index;
+
+	try {
+		index = fingerprint::Index::open(options.query);
+	} catch (std::runtime_error& err) {
+		fprintf(stderr, "An error occurred reading %s: %s\n", options.query.string().c_str(), err.what());
+		return false;
+	}
+
+	bool ok = true;
+
+	for (const fs::path& mioPath : options.inputs) {
+		MIO mio;
+		if (auto loaded = mio.tryLoad(mioPath); !loaded) {
+			reportError(mioPath, loaded.error().message().c_str());
+			ok = false;
+			continue;
+		}
+
+		for (const fingerprint::Match& match : index->query(fingerprint::compute(mio.recordData), options.similarity)) {
+			std::string_view name = index->name(match.entry);
+			printf("%s\t%.*s\t%.3f\n", mioPath.string().c_str(), int(name.size()), name.data(), match.similarity);
+		}
+	}
+
+	return ok;
+}
+
+// Every record has to load for the album to be made, but they're all checked so every bad one gets reported
+static bool processAlbum(mio2it::Converter& converter, const Options& options) {
+	std::vector<MIO> mios(options.inputs.size());
+	bool loaded = true;
+
+	for (size_t i = 0; i < options.inputs.size(); i++) {
+		if (auto result = mios[i].tryLoad(options.inputs[i]); !result) {
+			reportError(options.inputs[i], result.error().message().c_str());
+			loaded = false;
+			continue;
+		}
+
+		fputs(mio2it::describe(mios[i]).c_str(), stdout);
+	}
+
+	if (!loaded)
+		return false;
+
+	try {
+		IT it = converter.convertAlbum(mios, options.album.stem().string());
+		saveOutputs(it, options.album, outputsFor(options.album, options.formats), options);
+	} catch (std::runtime_error& err) {
+		fprintf(stderr, "An error occurred making %s: %s\n", options.album.string().c_str(), err.what());
+		return false;
+	}
+
+	return true;
+}
+
+static void printUsage(const char* argv0) {
+	fprintf(stderr, "Usage: %s [options] <in.mio> <out>\n", argv0);
+	fprintf(stderr, "       %s [options] -o <out dir> <in.mio>...\n", argv0);
+	fprintf(stderr, "       %s [options] --stream <s16|f32> <in.mio>\n", argv0);
+	fprintf(stderr, "       %s [options] --serve <socket>\n", argv0);
+	fprintf(stderr, "       %s --watch [-o <out dir>] <in.mio>...\n", argv0);
+	fprintf(stderr, "       %s [options] --album <out> <in.mio>...\n", argv0);
+	fprintf(stderr, "       %s [options] --zip <out.zip> <in.mio>...\n", argv0);
+	fprintf(stderr, "       %s [options] --dump -o <out dir> <dump>...\n", argv0);
+	fprintf(stderr, "       %s [options] --tar <archive|-> -o <out dir>\n", argv0);
+	fprintf(stderr, "       %s --index <out index> <in.mio>...\n", argv0);
+	fprintf(stderr, "       %s [--similarity <0-1>] --query <index> <in.mio>...\n", argv0);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "  --out <it|xm|mod|mid|wav> Output format, otherwise guessed from the output extension.\n");
+	fprintf(stderr, "                            Can be given more than once, or as a list like it,xm,mid\n");
+	fprintf(stderr, "  --interp <linear|cubic>   Interpolation used when rendering (default: linear)\n");
+	fprintf(stderr, "  --rate <hz>               Sample rate used when rendering (default: 44100)\n");
+	fprintf(stderr, "  -j, --threads <n>         Threads used to render a song, or serve requests (default: all cores)\n");
+	fprintf(stderr, "  --stream <s16|f32>        Play the song as raw stereo PCM to stdout as it renders\n");
+	fprintf(stderr, "  --serve <socket>          Convert files sent over a Unix domain socket, see server.hpp\n");
+	fprintf(stderr, "  --watch                   Keep converting inputs to IT whenever they change\n");
+	fprintf(stderr, "  --album <out>             Put every input into one module, one song after another\n");
+	fprintf(stderr, "  --zip <out.zip>           Put every converted file into one uncompressed ZIP archive\n");
+	fprintf(stderr, "  --dump                    Inputs are save dumps or record packs, every record in them gets converted\n");
+	fprintf(stderr, "  --tar <archive|->         Convert every member of a tar archive, read from stdin for -\n");
+	fprintf(stderr, "  --index <out index>       Fingerprint every input into an index for finding near copies\n");
+	fprintf(stderr, "  --query <index>           List records in the index that are near copies of each input\n");
+	fprintf(stderr, "  --similarity <0-1>        How alike records have to be to be listed by --query (default: 0.5)\n");
+	fprintf(stderr, "  --manifest <file>         Keep track of finished inputs in batch mode, and skip them when run again\n");
+	fprintf(stderr, "  --shard <i/N>             Only convert the i-th of N parts of the inputs in batch mode, from 0\n");
+	fprintf(stderr, "  --io <auto|uring|threads> How batch mode reads and writes files (default: io_uring if available)\n");
+	fprintf(stderr, "  --stats                   Print how long each stage took and how much IO it did\n");
+	fprintf(stderr, "  --trace <file>            Write a Chrome trace of every stage, for chrome://tracing or Perfetto\n");
+}
+
+static bool parseArgs(int argc, char** argv, Options& options) {
+	for (int i = 1; i < argc; i++) {
+		std::string_view arg = argv[i];
+
+		if (arg.size() < 2 || arg[0] != '-') {
+			options.inputs.push_back(argv[i]);
+			continue;
+		}
+
+		if (arg == "--watch") {
+			options.watch = true;
+			continue;
+		}
+
+		if (arg == "--stats") {
+			options.stats = true;
+			continue;
+		}
+
+		if (arg == "--dump") {
+			options.dump = true;
+			continue;
+		}
+
+		if (i + 1 >= argc) {
+			fprintf(stderr, "Missing value for %s\n", argv[i]);
+			return false;
+		}
+
+		std::string_view value = argv[++i];
+
+		if (arg == "-o") {
+			options.outDir = value;
+		} else if (arg == "--out") {
+			while (!value.empty()) {
+				std::string_view name = value.substr(0, value.find(','));
+				value.remove_prefix(std::min(value.size(), name.size() + 1));
+
+				std::optional<OutputFormat> format = parseFormat(name);
+				if (!format) {
+					fprintf(stderr, "Unknown output format: %.*s\n", int(name.size()), name.data());
+					return false;
+				}
+
+				if (std::find(options.formats.begin(), options.formats.end(), *format) == options.formats.end())
+					options.formats.push_back(*format);
+			}
+		} else if (arg == "--interp") {
+			if (value == "linear") {
+				options.render.interpolation = Renderer::Interpolation::Linear;
+			} else if (value == "cubic") {
+				options.render.interpolation = Renderer::Interpolation::Cubic;
+			} else {
+				fprintf(stderr, "Unknown interpolation: %s\n", argv[i]);
+				return false;
+			}
+		} else if (arg == "--rate") {
+			options.render.sampleRate = strtoul(argv[i], nullptr, 10);
+			if (options.render.sampleRate < 8000 || options.render.sampleRate > 192000) {
+				fprintf(stderr, "Sample rate must be between 8000 and 192000\n");
+				return false;
+			}
+		} else if (arg == "--stream") {
+			if (value == "s16") {
+				options.stream = PCMFormat::S16;
+			} else if (value == "f32") {
+				options.stream = PCMFormat::F32;
+			} else {
+				fprintf(stderr, "Unknown PCM format: %s\n", argv[i]);
+				return false;
+			}
+		} else if (arg == "--album") {
+			options.album = value;
+		} else if (arg == "--zip") {
+			options.zip = value;
+		} else if (arg == "--io") {
+			if (value == "auto") {
+				options.io = aio::Backend::Auto;
+			} else if (value == "uring") {
+				options.io = aio::Backend::IOUring;
+			} else if (value == "threads") {
+				options.io = aio::Backend::Threads;
+			} else {
+				fprintf(stderr, "Unknown IO backend: %s\n", argv[i]);
+				return false;
+			}
+		} else if (arg == "--tar") {
+			options.tar = value;
+		} else if (arg == "--index") {
+			options.index = value;
+		} else if (arg == "--query") {
+			options.query = value;
+		} else if (arg == "--similarity") {
+			options.similarity = strtof(argv[i], nullptr);
+			if (!(options.similarity > 0.0f && options.similarity <= 1.0f)) {
+				fprintf(stderr, "Similarity must be above 0 and at most 1\n");
+				return false;
+			}
+		} else if (arg == "--manifest") {
+			options.manifest = value;
+		} else if (arg == "--shard") {
+			size_t slash = value.find('/');
+			auto index = std::from_chars(value.data(), value.data() + std::min(slash, value.size()), options.shardIndex);
+			auto count = std::from_chars(value.data() + std::min(slash + 1, value.size()), value.data() + value.size(), options.shardCount);
+			if (slash == value.npos || index.ec != std::errc() || count.ec != std::errc() || index.ptr != value.data() + slash ||
+			    count.ptr != value.data() + value.size() || options.shardIndex >= options.shardCount) {
+				fprintf(stderr, "Shard must be like 0/4, with the first number less than the second\n");
+				return false;
+			}
+		} else if (arg == "--trace") {
+			options.trace = value;
+		} else if (arg == "--serve") {
+			options.serve = value;
+		} else if (arg == "-j" || arg == "--threads") {
+			options.render.threads = strtoul(argv[i], nullptr, 10);
+		} else {
+			fprintf(stderr, "Unknown option: %s\n", argv[i - 1]);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Plain -o with inputs, the only mode --manifest and --shard mean anything in
+static bool batchMode(const Options& options) {
+	return !options.outDir.empty() && options.serve.empty() && !options.watch && options.album.empty() && options.zip.empty() &&
+	       options.tar.empty() && !options.dump && options.index.empty() && options.query.empty() && !options.stream;
+}
+
+static int run(Options& options, const char* argv0) {
+	mio2it::Converter converter; // Shared across a batch so instrument banks only get built once
+	Arena arena;
+
+	if ((!options.manifest.empty() || options.shardCount > 1) && !batchMode(options)) {
+		printUsage(argv0);
+		return 1;
+	}
+
+	if (!options.serve.empty()) {
+		if (!options.inputs.empty()) {
+			printUsage(argv0);
+			return 1;
+		}
+
+		unsigned workers = options.render.threads ? options.render.threads : std::max(1u, std::thread::hardware_concurrency());
+		return server::serve(options.serve, workers) ? 0 : 1;
+	}
+
+	if (options.watch) {
+		if (options.inputs.empty() || (!options.formats.empty() && options.formats != std::vector{ OutputFormat::IT })) {
+			printUsage(argv0);
+			return 1;
+		}
+
+		std::vector<watch::File> files;
+
+		if (options.outDir.empty()) {
+			if (options.inputs.size() != 2) {
+				printUsage(argv0);
+				return 1;
+			}
+			files.push_back({ options.inputs[0], options.inputs[1] });
+		} else {
+			for (const fs::path& mioPath : options.inputs)
+				files.push_back({ mioPath, options.outDir / mioPath.filename().replace_extension(".it") });
+		}
+
+		return watch::watch(files) ? 0 : 1;
+	}
+
+	if (!options.album.empty()) {
+		if (options.inputs.empty() || !options.outDir.empty()) {
+			printUsage(argv0);
+			return 1;
+		}
+
+		return processAlbum(converter, options) ? 0 : 1;
+	}
+
+	if (!options.zip.empty()) {
+		if (options.inputs.empty() || !options.outDir.empty()) {
+			printUsage(argv0);
+			return 1;
+		}
+
+		if (options.formats.empty())
+			options.formats.push_back(OutputFormat::IT);
+
+		return processZip(converter, arena, options) ? 0 : 1;
+	}
+
+	if (!options.tar.empty()) {
+		if (!options.inputs.empty() || options.outDir.empty()) {
+			printUsage(argv0);
+			return 1;
+		}
+
+		if (options.formats.empty())
+			options.formats.push_back(OutputFormat::IT);
+
+#ifdef _WIN32
+		if (options.tar == "-")
+			_setmode(_fileno(stdin), _O_BINARY);
+#endif
+
+		return processTar(options) ? 0 : 1;
+	}
+
+	if (!options.index.empty() || !options.query.empty()) {
+		if (options.inputs.empty() || !options.outDir.empty() || (!options.index.empty() && !options.query.empty())) {
+			printUsage(argv0);
+			return 1;
+		}
+
+		return (options.query.empty() ? processIndex(options) : processQuery(options)) ? 0 : 1;
+	}
+
+	if (options.dump) {
+		if (options.inputs.empty() || options.outDir.empty() || options.stream) {
+			printUsage(argv0);
+			return 1;
+		}
+
+		if (options.formats.empty())
+			options.formats.push_back(OutputFormat::IT);
+
+		return processDumps(options) ? 0 : 1;
+	}
+
+	if (options.stream) {
+		if (options.inputs.size() != 1) {
+			printUsage(argv0);
+			return 1;
+		}
+
+#ifdef _WIN32
+		_setmode(_fileno(stdout), _O_BINARY);
+#endif
+
+		try {
+			auto converted = loadAndConvert(converter, options.inputs[0], stderr);
+			if (!converted) {
+				reportError(options.inputs[0], converted.error().message().c_str());
+				return 1;
+			}
+
+			if (!streamPCM(*converted, stdout, *options.stream, options.render)) {
+				fprintf(stderr, "Failed to write audio to stdout\n");
+				return 1;
+			}
+		} catch (std::runtime_error& err) {
+			fprintf(stderr, "An error occurred: %s\n", err.what());
+			return 1;
+		}
+
+		return 0;
+	}
+
+	if (options.outDir.empty()) {
+		if (options.inputs.size() != 2) {
+			printUsage(argv0);
+			return 1;
+		}
+
+		std::vector<Output> outputs = outputsFor(options.inputs[1], options.formats);
+
+		try {
+			return processFile(converter, arena, options.inputs[0], outputs, options) ? 0 : 1;
+		} catch (std::runtime_error& err) {
+			fprintf(stderr, "An error occurred: %s\n", err.what());
+			return 1;
+		}
+	}
+
+	if (options.inputs.empty()) {
+		printUsage(argv0);
 		return 1;
 	}
 
+	if (options.formats.empty())
+		options.formats.push_back(OutputFormat::IT);
+
+	// Batch mode, keep going on errors so one bad file doesn't stop the rest
 	try {
-		convertMIO(argv[1], argv[2]);
+		return processBatch(converter, arena, options) ? 0 : 1;
 	} catch (std::runtime_error& err) {
 		fprintf(stderr, "An error occurred: %s\n", err.what());
 		return 1;
 	}
+}
+
+int main(int argc, char** argv) {
+	Options options;
+
+	if (!parseArgs(argc, argv, options)) {
+		printUsage(argv[0]);
+		return 1;
+	}
+
+	if (!options.stats && options.trace.empty())
+		return run(options, argv[0]);
+
+#ifdef MIO2IT_STATS
+	stats::enable();
+	int ret = run(options, argv[0]);
+
+	if (options.stats)
+		stats::printSummary(stderr);
+
+	if (!options.trace.empty() && !stats::writeTrace(options.trace)) {
+		fprintf(stderr, "Failed to write trace to %s\n", options.trace.string().c_str());
+		ret = 1;
+	}
 
-	return 0;
+	return ret;
+#else
+	fprintf(stderr, "--stats and --trace need mio2it to be built with MIO2IT_STATS\n");
+	return 1;
+#endif
 }
@@ -0,0 +1,130 @@
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdio>
+#include <stdexcept>
+#include "manifest.hpp"
+#include "stats.hpp"
+
+namespace manifest {
+
+Stamp stamp(const fs::path& path) {
+	std::error_code err;
+
+	u64 size = fs::file_size(path, err);
+	if (err)
+		return {};
+
+	fs::file_time_type mtime = fs::last_write_time(path, err);
+	if (err)
+		return {};
+
+	auto sinceEpoch = std::chrono::file_clock::to_sys(mtime).time_since_epoch();
+	return { size, s64(std::chrono::duration_cast<std::chrono::nanoseconds>(sinceEpoch).count()) };
+}
+
+u64 hash(std::span<const u8> data) {
+	u64 hash = 0xCBF29CE484222325;
+	for (u8 byte : data)
+		hash = (hash ^ byte) * 0x100000001B3;
+	return hash;
+}
+
+// Paths with these in can't be written down, so just get converted every time
+static bool recordable(std::string_view path) {
+	return path.find_first_of("\t\n") == path.npos;
+}
+
+template <typename T>
+static bool parseField(std::string_view field, T& out, int base = 10) {
+	auto [end, err] = std::from_chars(field.data(), field.data() + field.size(), out, base);
+	return err == std::errc() && end == field.data() + field.size();
+}
+
+Manifest::Manifest(const fs::path& path) {
+	MIO2IT_STAT_SCOPE("manifest");
+
+	bool cutOff = false;
+
+	std::error_code err;
+	if (fs::exists(path, err)) {
+		io::FileIO in(path, "rb");
+		std::vector<char> text(fs::file_size(path));
+		in.readVec(text);
+		in.close();
+
+		std::string_view rest(text.data(), text.size());
+		size_t newline;
+
+		// Anything after the last newline was cut off partway through
+		while ((newline = rest.find('\n')) != rest.npos) {
+			std::string_view line = rest.substr(0, newline);
+			rest.remove_prefix(newline + 1);
+
+			std::vector<std::string_view> fields;
+			while (!line.empty()) {
+				size_t tab = line.find('\t');
+				fields.push_back(line.substr(0, tab));
+				line.remove_prefix(tab == line.npos ? line.size() : tab + 1);
+			}
+
+			Done done;
+			if (fields.size() < 4 || !parseField(fields[1], done.stamp.size) || !parseField(fields[2], done.stamp.mtime))
+				continue;
+
+			std::string input(fields[3]);
+			if (fields[0] == "ok") {
+				done.outputs.assign(fields.begin() + 4, fields.end());
+				done_[std::move(input)] = std::move(done);
+			} else {
+				done_.erase(input);
+			}
+		}
+
+		cutOff = !rest.empty();
+	}
+
+	file_.open(path, "ab");
+
+	// Otherwise the next line would get tacked on to the end of the one that was cut off
+	if (cutOff) {
+		file_.writeU8('\n');
+		file_.flush();
+	}
+}
+
+bool Manifest::done(const fs::path& input, Stamp stamp, std::span<const fs::path> outputs) const {
+	auto found = done_.find(input.string());
+	if (found == done_.end() || found->second.stamp != stamp || stamp == Stamp())
+		return false;
+
+	// Asked for something different this time, or something's gone missing since
+	const std::vector<std::string>& recorded = found->second.outputs;
+	std::error_code err;
+	return std::equal(recorded.begin(), recorded.end(), outputs.begin(), outputs.end(), [&](const std::string& a, const fs::path& b) {
+		return a == b.string() && fs::exists(b, err);
+	});
+}
+
+void Manifest::record(bool ok, const fs::path& input, Stamp stamp, std::span<const fs::path> outputs) {
+	std::string name = input.string();
+	if (!recordable(name) || !std::all_of(outputs.begin(), outputs.end(), [](const fs::path& p) { return recordable(p.string()); }))
+		return;
+
+	char numbers[64];
+	snprintf(numbers, sizeof(numbers), "\t%llu\t%lld\t", (unsigned long long)stamp.size, (long long)stamp.mtime);
+
+	line_ = ok ? "ok" : "failed";
+	line_ += numbers;
+	line_ += name;
+	for (const fs::path& output : outputs) {
+		line_ += '\t';
+		line_ += output.string();
+	}
+	line_ += '\n';
+
+	file_.writeStr(line_);
+	file_.flush();
+}
+
+} // namespace manifest
@@ -0,0 +1,65 @@
+#pragma once
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "filesystem.hpp"
+#include "io.hpp"
+#include "types.hpp"
+
+/**
+ * A record of which inputs a batch run has finished, so a run that got cut
+ * short can pick up where it left off instead of starting over. Lines are
+ * only ever appended, one per input once all of its outputs are written:
+ *
+ *   status  size  mtime  input  output...
+ *
+ * tab separated, where status is ok or failed, and size and mtime
+ * (nanoseconds since 1970) are what the input looked like going in. Later
+ * lines win over earlier ones for the same input. A line cut off by a crash
+ * has no newline, and is ignored.
+ *
+ * Each line goes out in one write, so shards running on the same machine can
+ * share a manifest.
+ */
+namespace manifest {
+	// What an input's file looked like, cheap enough to check without reading it
+	struct Stamp {
+		u64 size = 0;
+		s64 mtime = 0;
+
+		bool operator==(const Stamp&) const = default;
+	};
+
+	// Zeroed if the file can't be looked at, which never matches anything recorded
+	Stamp stamp(const fs::path& path);
+
+	// FNV-1a
+	u64 hash(std::span<const u8> data);
+
+	class Manifest {
+	public:
+		// Reads in whatever's there already, and throws if it can't be opened to add more
+		explicit Manifest(const fs::path& path);
+
+		/**
+		 * Whether `input` was converted fine into exactly `outputs`, which are
+		 * all still there, and hasn't changed since going by `stamp`
+		 */
+		bool done(const fs::path& input, Stamp stamp, std::span<const fs::path> outputs) const;
+
+		// Written straight out, so a crash right after doesn't lose it
+		void record(bool ok, const fs::path& input, Stamp stamp, std::span<const fs::path> outputs);
+
+	private:
+		struct Done {
+			Stamp stamp;
+			std::vector<std::string> outputs;
+		};
+
+		io::FileIO file_;
+		std::unordered_map<std::string, Done> done_;
+		std::string line_;
+	};
+} // namespace manifest
@@ -0,0 +1,263 @@
+#include <algorithm>
+#include <cstring>
+#include <optional>
+#include <string>
+#include "formats.hpp"
+#include "io.hpp"
+#include "stats.hpp"
+
+namespace formats {
+
+constexpr static u8 letterInAlphabet(char c) {
+	return c - ('A' - 1);
+}
+
+constexpr static u8 MIDI_HEADER_MAGIC[4] = { 'M', 'T', 'h', 'd' };
+constexpr static u8 MIDI_TRACK_MAGIC[4] = { 'M', 'T', 'r', 'k' };
+constexpr static u16 MIDI_FORMAT_MULTI_TRACK = 1;
+
+constexpr static u32 TICKS_PER_ROW = 24;
+constexpr static int MIDI_CHANNELS = 16;
+constexpr static int MIDI_DRUM_CHANNEL = 9;
+
+enum MIDIEvents : u8 {
+	MIDIE_NOTE_OFF       = 0x80,
+	MIDIE_NOTE_ON        = 0x90,
+	MIDIE_CONTROL_CHANGE = 0xB0,
+	MIDIE_PROGRAM_CHANGE = 0xC0,
+	MIDIE_META           = 0xFF
+};
+
+enum MIDIMetaEvents : u8 {
+	MIDIME_TRACK_NAME   = 0x03,
+	MIDIME_END_OF_TRACK = 0x2F,
+	MIDIME_SET_TEMPO    = 0x51
+};
+
+enum MIDIControllers : u8 {
+	MIDIC_VOLUME = 7,
+	MIDIC_PAN    = 10
+};
+
+// Events for a track get built up in memory, as the chunk's length comes first
+class MIDITrack {
+public:
+	void event(u32 tick, u8 status, u8 a) {
+		delta(tick);
+		data_.push_back(status);
+		data_.push_back(a);
+	}
+
+	void event(u32 tick, u8 status, u8 a, u8 b) {
+		event(tick, status, a);
+		data_.push_back(b);
+	}
+
+	void meta(u32 tick, u8 type, const void* data, size_t size) {
+		delta(tick);
+		data_.push_back(MIDIE_META);
+		data_.push_back(type);
+		writeVLQ(size);
+		data_.insert(data_.end(), static_cast<const u8*>(data), static_cast<const u8*>(data) + size);
+	}
+
+	void write(io::DataIO& file) const {
+		file.writeArrT(MIDI_TRACK_MAGIC);
+		file.writeU32BE(data_.size());
+		file.writeVec(data_);
+	}
+
+private:
+	void delta(u32 tick) {
+		writeVLQ(tick - lastTick_);
+		lastTick_ = tick;
+	}
+
+	void writeVLQ(u32 value) {
+		u8 bytes[5];
+		int count = 0;
+
+		do {
+			bytes[count++] = value & 0x7F;
+			value >>= 7;
+		} while (value);
+
+		while (count--)
+			data_.push_back(bytes[count] | (count ? 0x80 : 0));
+	}
+
+	std::vector<u8> data_;
+	u32 lastTick_ = 0;
+};
+
+// A row is always the same number of ticks, so speed changes become tempo changes
+static u32 microsecondsPerBeat(u8 rowsPerBeat, u8 speed, u8 tempo) {
+	return u64(rowsPerBeat) * speed * 2500000 / tempo;
+}
+
+static void setTempo(MIDITrack& track, u32 tick, u32 usPerBeat) {
+	u8 data[3] = { u8(usPerBeat >> 16), u8(usPerBeat >> 8), u8(usPerBeat) };
+	track.meta(tick, MIDIME_SET_TEMPO, data, sizeof(data));
+}
+
+static void setName(MIDITrack& track, const std::string& name) {
+	track.meta(0, MIDIME_TRACK_NAME, name.data(), name.size());
+}
+
+static void endTrack(MIDITrack& track, u32 tick) {
+	track.meta(tick, MIDIME_END_OF_TRACK, nullptr, 0);
+}
+
+// Avoid the drum channel, as samples are all pitched as far as we know
+static u8 midiChannelFor(int channel) {
+	int ch = channel % (MIDI_CHANNELS - 1);
+	return ch >= MIDI_DRUM_CHANNEL ? ch + 1 : ch;
+}
+
+/**
+ * Each sample gets its own program number, counting up from 0. There's no way
+ * to know what General MIDI instruments they'd be, so it's up to whoever uses
+ * the file to map them to something sensible.
+ */
+void saveMIDI(const IT& module, io::DataIO& file) {
+	MIO2IT_STAT_SCOPE("save-mid");
+
+	std::span<const IT::Sample> samples = module.effectiveSamples();
+	std::vector<u8> orders = playedOrders(module);
+	u8 channels = usedChannels(module);
+	u8 rowsPerBeat = module.highlightRowsPerBeat ? module.highlightRowsPerBeat : 4;
+
+	struct ChannelState {
+		MIDITrack track;
+		u8 midiChannel;
+		u8 sample = 0;
+		u8 program = 0xFF;
+		u8 volume = 64; // Notes without a volume keep whatever the last one left
+		std::optional<u8> playing; // Key currently held down
+	};
+
+	MIDITrack conductor;
+	std::vector<ChannelState> state(channels);
+
+	setName(conductor, module.name);
+
+	u8 speed = module.initialSpeed ? module.initialSpeed : 6;
+	u8 tempo = std::max<u8>(module.initialTempo, 0x20);
+	u32 usPerBeat = microsecondsPerBeat(rowsPerBeat, speed, tempo);
+	setTempo(conductor, 0, usPerBeat);
+
+	for (u8 c = 0; c < channels; c++) {
+		ChannelState& ch = state[c];
+		ch.midiChannel = midiChannelFor(c);
+
+		setName(ch.track, "Channel " + std::to_string(c + 1));
+
+		u8 status = MIDIE_CONTROL_CHANGE | ch.midiChannel;
+		ch.track.event(0, status, MIDIC_VOLUME, std::min(127, module.channels[c].volume * 2));
+		if (module.channels[c].pan <= IT::ITPV_RIGHT)
+			ch.track.event(0, status, MIDIC_PAN, std::min(127, module.channels[c].pan * 2));
+	}
+
+	/* ================ *
+	 *      Events      *
+	 * ================ */
+
+	u32 tick = 0;
+
+	for (u8 order : orders) {
+		const IT::Pattern& pat = module.patterns[order];
+
+		for (u32 r = 0; r < pat.rows; r++, tick += TICKS_PER_ROW) {
+			for (const IT::Pattern::Cell& cell : pat.row(r)) {
+				const IT::Note& note = cell.note;
+				ChannelState& ch = state[cell.channel];
+
+				switch (note.effect) {
+					case letterInAlphabet('A'): {
+						if (note.param)
+							speed = note.param;
+						break;
+					}
+
+					case letterInAlphabet('T'): {
+						if (note.param >= 0x20)
+							tempo = note.param;
+						break;
+					}
+
+					case letterInAlphabet('X'): {
+						ch.track.event(tick, MIDIE_CONTROL_CHANGE | ch.midiChannel, MIDIC_PAN, note.param >> 1);
+						break;
+					}
+				}
+
+				if (note.volume >= IT::ITVPR_PAN_START && note.volume <= IT::ITVPR_PAN_END)
+					ch.track.event(tick, MIDIE_CONTROL_CHANGE | ch.midiChannel, MIDIC_PAN, std::min(127, (note.volume - IT::ITVPR_PAN_START) * 2));
+
+				if (note.instrument) {
+					ch.sample = note.instrument;
+					if (ch.sample <= samples.size())
+						ch.volume = samples[ch.sample - 1].defaultVol;
+				}
+
+				if (note.volume <= IT::ITVPR_VOL_END)
+					ch.volume = note.volume;
+
+				if (!note.note)
+					continue;
+
+				if (ch.playing) {
+					ch.track.event(tick, MIDIE_NOTE_OFF | ch.midiChannel, *ch.playing, 0);
+					ch.playing.reset();
+				}
+
+				u8 key = note.note.value();
+				if (key >= IT::ITNV_NOTE_CUT || key > 127 || !ch.sample || ch.sample > samples.size())
+					continue;
+
+				u8 velocity = std::min(127, ch.volume * 2);
+				if (!velocity)
+					continue;
+
+				u8 program = (ch.sample - 1) & 0x7F;
+				if (program != ch.program) {
+					ch.track.event(tick, MIDIE_PROGRAM_CHANGE | ch.midiChannel, program);
+					ch.program = program;
+				}
+
+				ch.track.event(tick, MIDIE_NOTE_ON | ch.midiChannel, key, velocity);
+				ch.playing = key;
+			}
+
+			u32 newUsPerBeat = microsecondsPerBeat(rowsPerBeat, speed, tempo);
+			if (newUsPerBeat != usPerBeat) {
+				setTempo(conductor, tick, newUsPerBeat);
+				usPerBeat = newUsPerBeat;
+			}
+		}
+	}
+
+	for (ChannelState& ch : state) {
+		if (ch.playing)
+			ch.track.event(tick, MIDIE_NOTE_OFF | ch.midiChannel, *ch.playing, 0);
+		endTrack(ch.track, tick);
+	}
+
+	endTrack(conductor, tick);
+
+	/* ================== *
+	 *      File data     *
+	 * ================== */
+
+	file.writeArrT(MIDI_HEADER_MAGIC);
+	file.writeU32BE(6);
+	file.writeU16BE(MIDI_FORMAT_MULTI_TRACK);
+	file.writeU16BE(1 + channels);
+	file.writeU16BE(TICKS_PER_ROW * rowsPerBeat);
+
+	conductor.write(file);
+	for (const ChannelState& ch : state)
+		ch.track.write(file);
+}
+
+} // namespace formats
@@ -1,20 +1,77 @@
 #include <cstring>
 #include "io.hpp"
 #include "mio.hpp"
+#include "stats.hpp"
+
+namespace {
+	class ErrorCategory final : public std::error_category {
+		const char* name() const noexcept override {
+			return "MIO";
+		}
+
+		std::string message(int e) const override {
+			switch (static_cast<MIO::Error>(e)) {
+				case MIO::Error::InvalidHeader: return "MIO has invalid header";
+				case MIO::Error::NotRecord:     return "MIO type is not record";
+				default:                        return "Unknown MIO error";
+			}
+		}
+	};
+}
+
+static ErrorCategory MIOErrorCategory;
+
+std::error_code MIO::make_error_code(Error e) {
+	return { static_cast<int>(e), MIOErrorCategory };
+}
 
 void MIO::load(const fs::path& path) {
 	io::FileIO file(path, "rb");
+	load(file);
+}
+
+void MIO::load(std::span<const u8> data) {
+	io::SpanIO file(data);
+	load(file);
+}
+
+// IO errors are thrown by `file` itself, as long as it's left to throw, which is the default
+void MIO::load(io::DataIO& file) {
+	if (auto loaded = tryLoad(file); !loaded)
+		throw std::system_error(loaded.error());
+}
+
+std::expected<void, std::error_code> MIO::tryLoad(const fs::path& path) {
+	io::FileIO file(path, "rb", false);
+	if (!file.isOpen())
+		return std::unexpected(file.error());
+	return tryLoad(file);
+}
+
+std::expected<void, std::error_code> MIO::tryLoad(std::span<const u8> data) {
+	io::SpanIO file(data, false);
+	return tryLoad(file);
+}
+
+/**
+ * Errors are only checked for at the end of each block of reads, as they stick
+ * around once set. Anything read after one is garbage, but nothing looks at it.
+ */
+std::expected<void, std::error_code> MIO::tryLoad(io::DataIO& file) {
+	MIO2IT_STAT_SCOPE("load");
 
 	u8 header[sizeof(HEADER)];
-	u8 titleType;
 
 	/* ==================== *
 	 *      MIO header      *
 	 * ==================== */
 
 	file.readArrT(header);
+	if (auto status = file.status(); !status)
+		return status;
+
 	if (memcmp(header, HEADER, sizeof(HEADER))) {
-		throw std::runtime_error("MIO has invalid header");
+		return std::unexpected(make_error_code(Error::InvalidHeader));
 	}
 
 	// TODO: Check checksums
@@ -25,9 +82,12 @@ void MIO::load(const fs::path& path) {
 	file.readStrT(this->creator);
 	file.readStrT(this->description);
 
-	file.readU8(&titleType);
-	if (titleType != 1) {
-		throw std::runtime_error("MIO type is not record");
+	io::Result<u8> titleType = file.readU8();
+	if (!titleType)
+		return std::unexpected(titleType.error());
+
+	if (*titleType != 1) {
+		return std::unexpected(make_error_code(Error::NotRecord));
 	}
 
 	file.forward(42); // appearance + unknown
@@ -73,6 +133,8 @@ void MIO::load(const fs::path& path) {
 
 		file.forward(5); // unknown
 	}
+
+	return file.status();
 }
 
 // TODO: See how unusually large serial numbers behave in-game
@@ -1,8 +1,15 @@
 #pragma once
+#include <expected>
+#include <span>
 #include <string>
+#include <system_error>
 #include "filesystem.hpp"
 #include "types.hpp"
 
+namespace io {
+	class DataIO;
+}
+
 struct MIO {
 	constexpr static u8 HEADER[16] = { 0x11, 0x00, 0x11, 0x00, 0x00, 0x00, 0x00, 0x00, 'D', 'S', 'M', 'I', 'O', '_', 'S', 0x00 };
 
@@ -47,7 +54,26 @@ struct MIO {
 		Phrase phrases[MAX_PHRASES];
 	};
 
+	enum class Error {
+		InvalidHeader = 1,
+		NotRecord
+	};
+
+	static std::error_code make_error_code(Error e);
+
+	// These throw on invalid input
 	void load(const fs::path& path);
+	void load(std::span<const u8> data);
+	void load(io::DataIO& file);
+
+	/**
+	 * Same as above, but errors are returned rather than thrown, so turning
+	 * away a bad file costs no more than loading a good one. `file` should
+	 * have exceptions turned off, otherwise IO errors still get thrown.
+	 */
+	std::expected<void, std::error_code> tryLoad(const fs::path& path);
+	std::expected<void, std::error_code> tryLoad(std::span<const u8> data);
+	std::expected<void, std::error_code> tryLoad(io::DataIO& file);
 
 	std::string formatSerial() const;
 
@@ -0,0 +1,36 @@
+#ifndef MIO2IT_H
+#define MIO2IT_H
+#include <stddef.h>
+#include <stdint.h>
+
+/* C interface to libmio2it. Everything here is reentrant and never prints anything. */
+
+#if defined(_WIN32) && defined(MIO2IT_SHARED)
+	#ifdef MIO2IT_BUILDING
+		#define MIO2IT_API __declspec(dllexport)
+	#else
+		#define MIO2IT_API __declspec(dllimport)
+	#endif
+#else
+	#define MIO2IT_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Converts a whole MIO file to a whole IT file.
+ * On success returns 0, and `*out` must be freed with mio2it_free.
+ * On failure returns non-zero, and if `err` is given a message is written
+ * into it, truncated to `errSize` bytes.
+ */
+MIO2IT_API int mio2it_convert(const uint8_t* mio, size_t mioSize, uint8_t** out, size_t* outSize, char* err, size_t errSize);
+
+MIO2IT_API void mio2it_free(uint8_t* data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MIO2IT_H */
@@ -0,0 +1,386 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include "formats.hpp"
+#include "io.hpp"
+#include "stats.hpp"
+
+namespace formats {
+
+constexpr static u8 letterInAlphabet(char c) {
+	return c - ('A' - 1);
+}
+
+constexpr static int MOD_MAX_SAMPLES = 31;
+constexpr static int MOD_MAX_ORDERS = 128;
+constexpr static int MOD_MAX_PATTERNS = 64;
+constexpr static int MOD_MAX_CHANNELS = 32;
+constexpr static int MOD_ROWS = 64;
+
+constexpr static u8 MOD_DEFAULT_SPEED = 6;
+constexpr static u8 MOD_DEFAULT_TEMPO = 125;
+
+// Rate a sample plays at with period 428 (C-2 in ProTracker terms) on a PAL Amiga
+constexpr static double MOD_BASE_RATE = 7093789.2 / (2 * 428);
+
+enum MODEffects : u8 {
+	MODE_SET_PANNING   = 0x8,
+	MODE_SET_VOLUME    = 0xC,
+	MODE_PATTERN_BREAK = 0xD,
+	MODE_SET_SPEED     = 0xF // Tempo from 0x20 up
+};
+
+/**
+ * Finetune 0 periods, C-0 to B-4. ProTracker itself only does C-1 to B-3, but
+ * multichannel MODs come from trackers that do the rest.
+ */
+constexpr static u16 MODPeriods[] = {
+	1712, 1616, 1525, 1440, 1357, 1281, 1209, 1141, 1077, 1017,  961,  907,
+	 856,  808,  762,  720,  678,  640,  604,  570,  538,  508,  480,  453,
+	 428,  404,  381,  360,  339,  320,  302,  285,  269,  254,  240,  226,
+	 214,  202,  190,  180,  170,  160,  151,  143,  135,  127,  120,  113,
+	 107,  101,   95,   90,   85,   80,   76,   71,   67,   64,   60,   57
+};
+
+constexpr static int MOD_PERIOD_C2 = 24; // Index of 428
+
+/**
+ * MOD samples have no rate, only a finetune in 8ths of a semitone, so each
+ * sample gets a transpose applied to its notes instead.
+ */
+struct MODSampleTuning {
+	int transpose = 0;
+	s8 finetune = 0;
+};
+
+static MODSampleTuning tuneSample(u32 c5Speed) {
+	MODSampleTuning tuning;
+
+	double semitones = std::log2(std::max<u32>(c5Speed, 1) / MOD_BASE_RATE) * 12;
+	int eighths = std::lround(semitones * 8);
+
+	// Round to the nearest semitone, leaving the finetune within -4..+3
+	tuning.transpose = (eighths + 4) >> 3;
+	tuning.finetune = eighths - tuning.transpose * 8;
+
+	return tuning;
+}
+
+struct MODNote {
+	u8 sample = 0;
+	u16 period = 0;
+	u8 effect = 0;
+	u8 param = 0;
+};
+
+// Cells whose effect column is free, used to fit in effects not in the IT module
+static bool hasFreeEffect(const IT::Note& note) {
+	return !note.effect && !note.param && note.volume == IT::ITVPR_NULL;
+}
+
+// Finds a channel on `row` to put an extra effect in, or -1 if they're all taken
+static int findFreeChannel(const IT::Pattern& pat, int row, int channels, int skip = -1) {
+	std::span<const IT::Pattern::Cell> cells = pat.row(row);
+	auto cell = cells.begin();
+
+	for (int c = 0; c < channels; c++) {
+		bool free = true;
+		if (cell != cells.end() && cell->channel == c)
+			free = hasFreeEffect((cell++)->note);
+
+		if (c != skip && free)
+			return c;
+	}
+	return -1;
+}
+
+static MODNote convertNote(const IT::Note& in, const std::vector<MODSampleTuning>& tunings, u8& lastSample) {
+	MODNote out;
+
+	if (in.instrument) {
+		out.sample = in.instrument;
+		lastSample = in.instrument;
+	}
+
+	if (in.note) {
+		u8 note = in.note.value();
+		if (note >= IT::ITNV_NOTE_CUT) {
+			// Nothing like a note off, volume 0 is close enough
+			out.effect = MODE_SET_VOLUME;
+			out.param = 0;
+			return out;
+		}
+
+		int transpose = lastSample && lastSample <= tunings.size() ? tunings[lastSample - 1].transpose : 0;
+		int index = note - 60 + transpose + MOD_PERIOD_C2;
+		if (index >= 0 && index < int(std::size(MODPeriods)))
+			out.period = MODPeriods[index];
+	}
+
+	switch (in.effect) {
+		case letterInAlphabet('A'): {
+			if (in.param) {
+				out.effect = MODE_SET_SPEED;
+				out.param = std::min<u8>(in.param, 0x1F);
+				return out;
+			}
+			break;
+		}
+
+		case letterInAlphabet('T'): {
+			if (in.param >= 0x20) {
+				out.effect = MODE_SET_SPEED;
+				out.param = in.param;
+				return out;
+			}
+			break;
+		}
+
+		case letterInAlphabet('X'): {
+			out.effect = MODE_SET_PANNING;
+			out.param = in.param;
+			return out;
+		}
+	}
+
+	// No volume column, so it takes the effect column if that's free
+	if (in.volume <= IT::ITVPR_VOL_END) {
+		out.effect = MODE_SET_VOLUME;
+		out.param = in.volume;
+	} else if (in.volume >= IT::ITVPR_PAN_START && in.volume <= IT::ITVPR_PAN_END) {
+		out.effect = MODE_SET_PANNING;
+		out.param = std::min(255, (in.volume - IT::ITVPR_PAN_START) * 4);
+	}
+
+	return out;
+}
+
+/**
+ * Notes only set their volume when it changes, so one that lost the effect
+ * column to something else would leave the rest of them too loud. Instead it
+ * goes on the channel's next note with room for it, unless a new sample
+ * resets the volume first.
+ */
+static void carryVolume(const IT::Note& in, MODNote& out, s16& pending) {
+	if (in.instrument)
+		pending = -1;
+
+	if (in.volume <= IT::ITVPR_VOL_END) {
+		if (out.effect == MODE_SET_VOLUME && out.param == in.volume) {
+			pending = -1;
+			return;
+		}
+		pending = in.volume;
+	}
+
+	if (pending >= 0 && !out.effect && !out.param) {
+		out.effect = MODE_SET_VOLUME;
+		out.param = pending;
+		pending = -1;
+	}
+}
+
+static void writeNote(io::DataIO& file, const MODNote& note) {
+	file.writeU8((note.sample & 0xF0) | (note.period >> 8));
+	file.writeU8(note.period & 0xFF);
+	file.writeU8(((note.sample & 0x0F) << 4) | note.effect);
+	file.writeU8(note.param);
+}
+
+void saveMOD(const IT& module, io::DataIO& file) {
+	MIO2IT_STAT_SCOPE("save-mod");
+
+	std::span<const IT::Sample> samples = module.effectiveSamples();
+	std::vector<u8> orders = playedOrders(module);
+	int channels = std::max<u8>(2, (usedChannels(module) + 1) & ~1);
+
+	if (samples.size() > MOD_MAX_SAMPLES) {
+		throw std::runtime_error("MOD has more than 31 samples");
+	}
+
+	// Loaders go by the highest pattern in the order list, so nothing past it can be written
+	size_t numPatterns = 1;
+	for (u8 order : orders)
+		numPatterns = std::max<size_t>(numPatterns, order + 1);
+
+	if (numPatterns > MOD_MAX_PATTERNS) {
+		throw std::runtime_error("MOD has more than 64 patterns");
+	}
+
+	if (orders.size() > MOD_MAX_ORDERS) {
+		throw std::runtime_error("MOD has more than 128 orders");
+	}
+
+	// Everything from here on goes by these, as MOD has no channel table
+	std::vector<IT::Pattern> storage;
+	std::span<const IT::Pattern> patterns = applyChannelTable(module, storage);
+
+	for (const IT::Pattern& pat : patterns) {
+		if (pat.rows > MOD_ROWS) {
+			throw std::runtime_error("MOD pattern has more than 64 rows");
+		}
+	}
+
+	for (const IT::Sample& smpl : samples) {
+		if (smpl.flags & (IT::ITSF_SAMPLE_16BIT | IT::ITSF_STEREO | IT::ITSF_COMPRESSED_SAMPLES)) {
+			throw std::runtime_error("MOD can only store 8-bit mono samples");
+		}
+	}
+
+	/**
+	 * Speed and tempo can't be set in the header, and patterns are always 64
+	 * rows, so effects have to be slotted in to do that. If there's no room
+	 * for them, add another pair of channels.
+	 */
+	bool setSpeed = module.initialSpeed != MOD_DEFAULT_SPEED;
+	bool setTempo = module.initialTempo != MOD_DEFAULT_TEMPO;
+
+	auto fits = [&](int count) {
+		for (const IT::Pattern& pat : patterns) {
+			if (pat.rows && pat.rows < MOD_ROWS && findFreeChannel(pat, pat.rows - 1, count) < 0)
+				return false;
+		}
+
+		if (!orders.empty() && (setSpeed || setTempo)) {
+			const IT::Pattern& first = patterns[orders[0]];
+			int speedChannel = setSpeed ? findFreeChannel(first, 0, count) : -1;
+			if ((setSpeed && speedChannel < 0) || (setTempo && findFreeChannel(first, 0, count, speedChannel) < 0))
+				return false;
+		}
+
+		return true;
+	};
+
+	while (!fits(channels) && channels + 2 <= std::min(MOD_MAX_CHANNELS, int(IT::MAX_CHANNELS)))
+		channels += 2;
+
+	std::vector<MODSampleTuning> tunings;
+	for (const IT::Sample& smpl : samples)
+		tunings.push_back(tuneSample(smpl.c5Speed));
+
+	/* ======================= *
+	 *      Module header      *
+	 * ======================= */
+
+	char name[20]{};
+	memcpy(name, module.name, strnlen(module.name, sizeof(name)));
+	file.writeArrT(name);
+
+	for (int i = 0; i < MOD_MAX_SAMPLES; i++) {
+		char sampleName[22]{};
+
+		if (size_t(i) >= samples.size()) {
+			file.writeArrT(sampleName);
+			file.writeU16BE(0);
+			file.writeU8(0);
+			file.writeU8(0);
+			file.writeU16BE(0);
+			file.writeU16BE(1); // No loop
+			continue;
+		}
+
+		const IT::Sample& smpl = samples[i];
+		memcpy(sampleName, smpl.name, strnlen(smpl.name, sizeof(sampleName)));
+
+		// Everything is counted in words
+		u32 length = std::min<u32>((smpl.data.size() + 1) / 2, 0xFFFF);
+		u32 loopBegin = std::min(smpl.loopBegin / 2, length);
+		u32 loopEnd = std::clamp<u32>((smpl.loopEnd + 1) / 2, loopBegin, length);
+		bool loop = (smpl.flags & IT::ITSF_LOOP) && loopEnd > loopBegin;
+
+		file.writeArrT(sampleName);
+		file.writeU16BE(length);
+		file.writeU8(tunings[i].finetune & 0x0F);
+		file.writeU8(std::min<u8>(smpl.defaultVol, 64));
+		file.writeU16BE(loop ? loopBegin : 0);
+		file.writeU16BE(loop ? loopEnd - loopBegin : 1);
+	}
+
+	file.writeU8(orders.size());
+	file.writeU8(127); // Restart position, 127 is what ProTracker writes
+	file.writeVec(orders);
+	file.writeN(u8(0), MOD_MAX_ORDERS - orders.size());
+
+	char tag[4];
+	if (channels == 4) {
+		memcpy(tag, "M.K.", 4);
+	} else if (channels < 10) {
+		memcpy(tag, "0CHN", 4);
+		tag[0] += channels;
+	} else {
+		memcpy(tag, "00CH", 4);
+		tag[0] += channels / 10;
+		tag[1] += channels % 10;
+	}
+	file.writeArrT(tag);
+
+	/* ================== *
+	 *      Patterns      *
+	 * ================== */
+
+	// Periods depend on the sample, which carries over from earlier notes without one
+	std::vector<u8> lastSample(channels);
+
+	for (size_t p = 0; p < numPatterns; p++) {
+		static const IT::Pattern EMPTY_PATTERN{};
+		const IT::Pattern& pat = p < patterns.size() ? patterns[p] : EMPTY_PATTERN;
+		bool isFirst = !orders.empty() && orders[0] == p;
+
+		int speedChannel = isFirst && setSpeed ? findFreeChannel(pat, 0, channels) : -1;
+		int tempoChannel = isFirst && setTempo ? findFreeChannel(pat, 0, channels, speedChannel) : -1;
+		int breakChannel = pat.rows && pat.rows < MOD_ROWS ? findFreeChannel(pat, pat.rows - 1, channels) : -1;
+
+		auto cell = pat.cells.begin();
+
+		std::vector<s16> pendingVolume(channels, -1);
+
+		for (int r = 0; r < MOD_ROWS; r++) {
+			for (int c = 0; c < channels; c++) {
+				if (r >= pat.rows) {
+					writeNote(file, {});
+					continue;
+				}
+
+				MODNote note;
+				const IT::Note* in = nullptr;
+				if (cell != pat.cells.end() && cell->row == r && cell->channel == c) {
+					in = &(cell++)->note;
+					note = convertNote(*in, tunings, lastSample[c]);
+				}
+
+				if (r == 0 && c == speedChannel) {
+					note.effect = MODE_SET_SPEED;
+					note.param = std::min<u8>(module.initialSpeed, 0x1F);
+				} else if (r == 0 && c == tempoChannel) {
+					note.effect = MODE_SET_SPEED;
+					note.param = module.initialTempo;
+				} else if (r == pat.rows - 1 && c == breakChannel) {
+					note.effect = MODE_PATTERN_BREAK;
+					note.param = 0;
+				}
+
+				if (in)
+					carryVolume(*in, note, pendingVolume[c]);
+
+				writeNote(file, note);
+			}
+		}
+	}
+
+	/* ===================== *
+	 *      Sample data      *
+	 * ===================== */
+
+	for (const IT::Sample& smpl : samples) {
+		bool isSigned = smpl.convertFlags & IT::ITSCF_SIGNED;
+		u32 length = std::min<u32>((smpl.data.size() + 1) / 2, 0xFFFF) * 2;
+
+		std::vector<u8> data(length);
+		for (size_t i = 0; i < std::min<size_t>(length, smpl.data.size()); i++)
+			data[i] = isSigned ? smpl.data[i] : smpl.data[i] ^ 0x80;
+
+		file.writeVec(data);
+	}
+}
+
+} // namespace formats
@@ -0,0 +1,122 @@
+#include <algorithm>
+#include <functional>
+#include "io.hpp"
+#include "mio.hpp"
+#include "pack.hpp"
+#include "stats.hpp"
+
+#ifndef _WIN32
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace pack {
+
+/* ===================== *
+ *      Mapped file      *
+ * ===================== */
+
+std::expected<MappedFile, std::error_code> MappedFile::open(const fs::path& path) {
+	MIO2IT_STAT_SCOPE("open");
+
+	MappedFile file;
+
+#ifndef _WIN32
+	int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return std::unexpected(std::error_code(errno, std::generic_category()));
+
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		std::error_code err(errno, std::generic_category());
+		close(fd);
+		return std::unexpected(err);
+	}
+
+	// Can't map nothing, but there's nothing to find in it either
+	if (st.st_size > 0) {
+		void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			std::error_code err(errno, std::generic_category());
+			close(fd);
+			return std::unexpected(err);
+		}
+
+		// Records get picked up by whichever worker's free, so not in any order
+		madvise(data, st.st_size, MADV_WILLNEED);
+
+		file.data_ = static_cast<const u8*>(data);
+		file.size_ = st.st_size;
+		file.mapped_ = true;
+	}
+
+	close(fd);
+#else
+	io::FileIO in(path, "rb", false);
+	if (!in.isOpen())
+		return std::unexpected(in.error());
+
+	std::error_code err;
+	file.buf_.resize(fs::file_size(path, err));
+	if (err)
+		return std::unexpected(err);
+
+	in.readVec(file.buf_);
+	if (auto status = in.status(); !status)
+		return std::unexpected(status.error());
+
+	file.data_ = file.buf_.data();
+	file.size_ = file.buf_.size();
+#endif
+
+	return file;
+}
+
+MappedFile::MappedFile(MappedFile&& other) noexcept {
+	*this = std::move(other);
+}
+
+MappedFile& MappedFile::operator=(MappedFile&& other) noexcept {
+	std::swap(data_, other.data_);
+	std::swap(size_, other.size_);
+	std::swap(mapped_, other.mapped_);
+	std::swap(buf_, other.buf_);
+	return *this;
+}
+
+MappedFile::~MappedFile() {
+#ifndef _WIN32
+	if (mapped_)
+		munmap(const_cast<u8*>(data_), size_);
+#endif
+}
+
+/* ============== *
+ *      Scan      *
+ * ============== */
+
+std::vector<size_t> scan(std::span<const u8> data) {
+	MIO2IT_STAT_SCOPE("scan");
+
+	std::vector<size_t> offsets;
+	std::boyer_moore_horspool_searcher searcher(std::begin(MIO::HEADER), std::end(MIO::HEADER));
+
+	auto pos = data.begin();
+	while ((pos = std::search(pos, data.end(), searcher)) != data.end()) {
+		size_t offset = pos - data.begin();
+
+		if (data.size() - offset >= RECORD_SIZE && data[offset + TITLE_TYPE_OFFSET] == TITLE_TYPE_RECORD) {
+			offsets.push_back(offset);
+			pos += RECORD_SIZE;
+		} else {
+			pos += sizeof(MIO::HEADER);
+		}
+	}
+
+	return offsets;
+}
+
+} // namespace pack
@@ -0,0 +1,47 @@
+#pragma once
+#include <expected>
+#include <span>
+#include <system_error>
+#include <vector>
+#include "filesystem.hpp"
+#include "types.hpp"
+
+/**
+ * Finds records inside save dumps and record packs, so they can be converted
+ * straight out of the container without extracting them to files first. The
+ * container is mapped rather than read, and records are handed to the parser
+ * as views into it.
+ */
+namespace pack {
+	constexpr size_t RECORD_SIZE = 0x2000;
+	constexpr size_t TITLE_TYPE_OFFSET = 0xA4;
+	constexpr u8 TITLE_TYPE_RECORD = 1;
+
+	// A whole file mapped read-only, or just read into memory where mapping isn't available
+	class MappedFile {
+	public:
+		static std::expected<MappedFile, std::error_code> open(const fs::path& path);
+
+		MappedFile(MappedFile&& other) noexcept;
+		MappedFile& operator=(MappedFile&& other) noexcept;
+		~MappedFile();
+
+		std::span<const u8> data() const { return { data_, size_ }; }
+
+	private:
+		MappedFile() = default;
+
+		const u8* data_ = nullptr;
+		size_t size_ = 0;
+		bool mapped_ = false;
+		std::vector<u8> buf_;
+	};
+
+	/**
+	 * Offsets of every record in `data`. A slot counts as a record if it starts
+	 * with MIO::HEADER, has the record title type, and fits in what's left.
+	 * Games and manga are skipped over, and nothing else is checked, that's
+	 * left to the parser.
+	 */
+	std::vector<size_t> scan(std::span<const u8> data);
+} // namespace pack
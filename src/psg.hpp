@@ -0,0 +1,61 @@
+#pragma once
+#include <array>
+#include "types.hpp"
+
+/**
+ * Nintendo DS PSG tones. These have no PCM stored anywhere, for PSG
+ * instruments an SBNK's waveID is a duty cycle type rather than a wave, so
+ * they're generated here instead. Everything is computed at compile time.
+ */
+namespace psg {
+	constexpr int DUTY_CYCLES = 7;       // 12.5% to 87.5%, in steps of 12.5%
+	constexpr int DUTY_STEPS = 8;        // Hardware splits a cycle into 8 steps
+	constexpr int CYCLE_LENGTH = 32;     // Samples per cycle, enough to not sound too dull when resampled
+	constexpr int NOISE_LENGTH = 4096;   // Looped, see makeNoise
+
+	constexpr s8 HIGH = 127;
+	constexpr s8 LOW = -127;
+
+	// Duty cycle type n is high for n + 1 of the 8 steps
+	constexpr std::array<s8, CYCLE_LENGTH> makeSquare(int duty) {
+		std::array<s8, CYCLE_LENGTH> wave{};
+		for (int i = 0; i < CYCLE_LENGTH; i++) {
+			int step = i * DUTY_STEPS / CYCLE_LENGTH;
+			wave[i] = (step < DUTY_STEPS - (duty + 1)) ? LOW : HIGH;
+		}
+		return wave;
+	}
+
+	/**
+	 * Same LFSR as the hardware: shift right, and on carry out flip the taps
+	 * and output low. Its full period is 0x7FFF steps, which would be 32KB in
+	 * every module with a rhythm track, so only the start of it is kept and
+	 * looped. Drum hits are over long before the loop comes round enough times
+	 * to be heard as a pitch.
+	 */
+	constexpr std::array<s8, NOISE_LENGTH> makeNoise() {
+		std::array<s8, NOISE_LENGTH> wave{};
+		u16 lfsr = 0x7FFF;
+		for (int i = 0; i < NOISE_LENGTH; i++) {
+			bool carry = lfsr & 1;
+			lfsr >>= 1;
+			if (carry) {
+				lfsr ^= 0x6000;
+				wave[i] = LOW;
+			} else {
+				wave[i] = HIGH;
+			}
+		}
+		return wave;
+	}
+
+	constexpr auto makeSquares() {
+		std::array<std::array<s8, CYCLE_LENGTH>, DUTY_CYCLES> waves{};
+		for (int d = 0; d < DUTY_CYCLES; d++)
+			waves[d] = makeSquare(d);
+		return waves;
+	}
+
+	inline constexpr auto squares = makeSquares();
+	inline constexpr auto noise = makeNoise();
+} // namespace psg
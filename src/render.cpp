@@ -0,0 +1,619 @@
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cmath>
+#include <thread>
+#include "io.hpp"
+#include "render.hpp"
+#include "stats.hpp"
+#include "utils.hpp"
+
+#ifdef MIO2IT_SSE2
+	#include <emmintrin.h>
+#endif
+
+constexpr static u8 letterInAlphabet(char c) {
+	return c - ('A' - 1);
+}
+
+constexpr static float FRAC_SCALE = 1.0f / 4294967296.0f;
+
+/* ======================== *
+ *      Mixing kernels      *
+ * ======================== */
+
+static void resampleLinear(const float* data, u64 pos, u64 step, float* out, size_t frames) {
+	size_t i = 0;
+
+#ifdef MIO2IT_SSE2
+	// Fetching is inherently scalar, but the interpolation itself is done 4 frames at once
+	for (; i + 4 <= frames; i += 4) {
+		alignas(16) float a[4], b[4], f[4];
+		for (int j = 0; j < 4; j++) {
+			u32 idx = pos >> 32;
+			a[j] = data[idx];
+			b[j] = data[idx + 1];
+			f[j] = u32(pos) * FRAC_SCALE;
+			pos += step;
+		}
+
+		__m128 va = _mm_load_ps(a);
+		__m128 vb = _mm_load_ps(b);
+		__m128 vf = _mm_load_ps(f);
+		_mm_storeu_ps(out + i, _mm_add_ps(va, _mm_mul_ps(_mm_sub_ps(vb, va), vf)));
+	}
+#endif
+
+	for (; i < frames; i++) {
+		u32 idx = pos >> 32;
+		float frac = u32(pos) * FRAC_SCALE;
+		out[i] = data[idx] + (data[idx + 1] - data[idx]) * frac;
+		pos += step;
+	}
+}
+
+// Catmull-Rom spline through the two points either side
+static void resampleCubic(const float* data, u64 pos, u64 step, float* out, size_t frames) {
+	size_t i = 0;
+
+#ifdef MIO2IT_SSE2
+	for (; i + 4 <= frames; i += 4) {
+		alignas(16) float p0[4], p1[4], p2[4], p3[4], f[4];
+		for (int j = 0; j < 4; j++) {
+			const float* p = data + (pos >> 32);
+			p0[j] = p[-1];
+			p1[j] = p[0];
+			p2[j] = p[1];
+			p3[j] = p[2];
+			f[j] = u32(pos) * FRAC_SCALE;
+			pos += step;
+		}
+
+		__m128 a = _mm_load_ps(p0);
+		__m128 b = _mm_load_ps(p1);
+		__m128 c = _mm_load_ps(p2);
+		__m128 d = _mm_load_ps(p3);
+		__m128 t = _mm_load_ps(f);
+
+		// b + 0.5t(c - a + t(2a - 5b + 4c - d + t(3(b - c) + d - a)))
+		__m128 k3 = _mm_sub_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(3.0f), _mm_sub_ps(b, c)), d), a);
+		__m128 k2 = _mm_sub_ps(
+			_mm_add_ps(_mm_add_ps(a, a), _mm_mul_ps(_mm_set1_ps(4.0f), c)),
+			_mm_add_ps(_mm_mul_ps(_mm_set1_ps(5.0f), b), d)
+		);
+		__m128 k1 = _mm_sub_ps(c, a);
+		__m128 r = _mm_add_ps(k1, _mm_mul_ps(t, _mm_add_ps(k2, _mm_mul_ps(t, k3))));
+		_mm_storeu_ps(out + i, _mm_add_ps(b, _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(0.5f), t), r)));
+	}
+#endif
+
+	for (; i < frames; i++) {
+		const float* p = data + (pos >> 32);
+		float t = u32(pos) * FRAC_SCALE;
+		float a = p[-1], b = p[0], c = p[1], d = p[2];
+
+		// Same order of operations as above, so segments rendered separately still match up exactly
+		float k3 = (3.0f * (b - c) + d) - a;
+		float k2 = (a + a + 4.0f * c) - (5.0f * b + d);
+		float k1 = c - a;
+		out[i] = b + (0.5f * t) * (k1 + t * (k2 + t * k3));
+		pos += step;
+	}
+}
+
+static void mixMono(const float* in, float* left, float* right, float gainL, float gainR, size_t frames) {
+	size_t i = 0;
+
+#ifdef MIO2IT_SSE2
+	__m128 gl = _mm_set1_ps(gainL);
+	__m128 gr = _mm_set1_ps(gainR);
+	for (; i + 4 <= frames; i += 4) {
+		__m128 s = _mm_loadu_ps(in + i);
+		_mm_storeu_ps(left + i, _mm_add_ps(_mm_loadu_ps(left + i), _mm_mul_ps(s, gl)));
+		_mm_storeu_ps(right + i, _mm_add_ps(_mm_loadu_ps(right + i), _mm_mul_ps(s, gr)));
+	}
+#endif
+
+	for (; i < frames; i++) {
+		left[i] += in[i] * gainL;
+		right[i] += in[i] * gainR;
+	}
+}
+
+static void interleave(const float* left, const float* right, float* out, size_t frames) {
+	size_t i = 0;
+
+#ifdef MIO2IT_SSE2
+	for (; i + 4 <= frames; i += 4) {
+		__m128 l = _mm_loadu_ps(left + i);
+		__m128 r = _mm_loadu_ps(right + i);
+		_mm_storeu_ps(out + i * 2, _mm_unpacklo_ps(l, r));
+		_mm_storeu_ps(out + i * 2 + 4, _mm_unpackhi_ps(l, r));
+	}
+#endif
+
+	for (; i < frames; i++) {
+		out[i * 2] = left[i];
+		out[i * 2 + 1] = right[i];
+	}
+}
+
+// Rounds to nearest even like _mm_cvtps_epi32 does
+static s16 toS16(float s) {
+	return s16(std::nearbyint(std::clamp(s, -1.0f, 1.0f) * 32767.0f));
+}
+
+static void interleave(const float* left, const float* right, s16* out, size_t frames) {
+	size_t i = 0;
+
+#ifdef MIO2IT_SSE2
+	__m128 scale = _mm_set1_ps(32767.0f);
+	__m128 lo = _mm_set1_ps(-1.0f);
+	__m128 hi = _mm_set1_ps(1.0f);
+	for (; i + 4 <= frames; i += 4) {
+		__m128 l = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(left + i), lo), hi);
+		__m128 r = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(right + i), lo), hi);
+		__m128i li = _mm_cvtps_epi32(_mm_mul_ps(l, scale));
+		__m128i ri = _mm_cvtps_epi32(_mm_mul_ps(r, scale));
+		__m128i packed = _mm_packs_epi32(_mm_unpacklo_epi32(li, ri), _mm_unpackhi_epi32(li, ri));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i * 2), packed);
+	}
+#endif
+
+	for (; i < frames; i++) {
+		out[i * 2] = toS16(left[i]);
+		out[i * 2 + 1] = toS16(right[i]);
+	}
+}
+
+/* ================== *
+ *      Renderer      *
+ * ================== */
+
+std::shared_ptr<const Renderer::SampleList> Renderer::loadSamples(const IT& module) {
+	auto samples = std::make_shared<SampleList>();
+
+	for (const IT::Sample& smpl : module.effectiveSamples()) {
+		SampleData& sd = samples->emplace_back();
+		bool is16Bit = smpl.flags & IT::ITSF_SAMPLE_16BIT;
+		bool isSigned = smpl.convertFlags & IT::ITSCF_SIGNED;
+
+		sd.length = std::min<size_t>(smpl.length, smpl.data.size() / (is16Bit ? 2 : 1));
+		sd.loop = (smpl.flags & IT::ITSF_LOOP) && smpl.loopBegin < smpl.loopEnd && smpl.loopEnd <= sd.length;
+		sd.loopBegin = smpl.loopBegin;
+		sd.loopEnd = smpl.loopEnd;
+		sd.c5Speed = smpl.c5Speed ? smpl.c5Speed : 8363;
+		sd.defaultVol = smpl.defaultVol / 64.0f;
+		sd.globalVol = smpl.globalVol / 64.0f;
+
+		sd.data.resize(SampleData::GUARD_BEFORE + sd.length + SampleData::GUARD_AFTER);
+		float* d = sd.data.data() + SampleData::GUARD_BEFORE;
+
+		for (u32 i = 0; i < sd.length; i++) {
+			if (is16Bit) {
+				u16 v = smpl.data[i * 2] | (smpl.data[i * 2 + 1] << 8);
+				d[i] = (isSigned ? s16(v) : int(v) - 0x8000) / 32768.0f;
+			} else {
+				u8 v = smpl.data[i];
+				d[i] = (isSigned ? s8(v) : int(v) - 0x80) / 128.0f;
+			}
+		}
+
+		// Continue on into the loop start, so interpolating across the loop point doesn't need special casing
+		if (sd.loop) {
+			for (u32 i = 0; i < SampleData::GUARD_AFTER; i++)
+				d[sd.loopEnd + i] = d[sd.loopBegin + (i % (sd.loopEnd - sd.loopBegin))];
+			if (sd.loopBegin == 0)
+				d[-1] = d[sd.loopEnd - 1];
+		}
+	}
+
+	return samples;
+}
+
+Renderer::Renderer(const IT& module, const Options& options) :
+	Renderer(module, options, loadSamples(module)) {}
+
+Renderer::Renderer(const IT& module, const Options& options, std::shared_ptr<const SampleList> samples) :
+	options_(options),
+	module_(module),
+	samples_(std::move(samples)),
+	speed_(module.initialSpeed ? module.initialSpeed : 6),
+	tempo_(std::max<u8>(module.initialTempo, 32)),
+	masterGain_((module.globalVolume / 128.0f) * (module.mixVolume / 128.0f)),
+	resampled_(BLOCK_FRAMES),
+	mixL_(BLOCK_FRAMES),
+	mixR_(BLOCK_FRAMES)
+{
+	channels_.resize(IT::MAX_CHANNELS);
+	for (size_t c = 0; c < channels_.size(); c++) {
+		const IT::Channel& modCh = module.channels[c];
+		channels_[c].muted = modCh.pan & IT::ITPV_DISABLED;
+		channels_[c].pan = (modCh.pan <= IT::ITPV_RIGHT) ? modCh.pan : u8(IT::ITPV_MIDDLE);
+		channels_[c].chanVolume = modCh.volume / 64.0f;
+	}
+
+	if (!seekOrder(0)) {
+		ended_ = true;
+	}
+}
+
+// Finds the next playable order at or after `order`
+bool Renderer::seekOrder(size_t order) {
+	for (; order < module_.orders.size(); order++) {
+		u8 pat = module_.orders[order];
+
+		if (pat == IT::ITMOM_END_OF_SONG)
+			return false;
+
+		if (pat != IT::ITMOM_SKIP_TO_NEXT && pat < module_.patterns.size()) {
+			order_ = order;
+			row_ = 0;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool Renderer::nextRow() {
+	const IT::Pattern& pat = module_.patterns[module_.orders[order_]];
+
+	if (++row_ < pat.rows)
+		return true;
+
+	return seekOrder(order_ + 1);
+}
+
+void Renderer::processRow() {
+	const IT::Pattern& pat = module_.patterns[module_.orders[order_]];
+
+	for (const IT::Pattern::Cell& cell : pat.row(row_)) {
+		if (cell.channel >= channels_.size())
+			continue;
+
+		const IT::Note& note = cell.note;
+		Channel& ch = channels_[cell.channel];
+
+		if (note.instrument && note.instrument <= samples_->size()) {
+			ch.lastSample = &(*samples_)[note.instrument - 1];
+			ch.volume = ch.lastSample->defaultVol;
+		}
+
+		if (note.note.has_value()) {
+			u8 value = note.note.value();
+
+			if (value >= IT::ITNV_NOTE_CUT) {
+				// No envelopes here, so note off may as well be a cut
+				ch.voice.active = false;
+			} else if (ch.lastSample && ch.lastSample->length) {
+				double freq = ch.lastSample->c5Speed * std::exp2((value - 60) / 12.0);
+				ch.voice.sample = ch.lastSample;
+				ch.voice.pos = 0;
+				ch.voice.step = std::max<u64>(1, u64(freq / options_.sampleRate * 4294967296.0));
+				ch.voice.active = true;
+			}
+		}
+
+		if (note.volume <= IT::ITVPR_VOL_END) {
+			ch.volume = note.volume / 64.0f;
+		} else if (note.volume >= IT::ITVPR_PAN_START && note.volume <= IT::ITVPR_PAN_END) {
+			ch.pan = note.volume - IT::ITVPR_PAN_START;
+		}
+
+		switch (note.effect) {
+			case letterInAlphabet('A'): {
+				if (note.param)
+					speed_ = note.param;
+				break;
+			}
+
+			case letterInAlphabet('T'): {
+				if (note.param >= 0x20)
+					tempo_ = note.param;
+				break;
+			}
+
+			case letterInAlphabet('X'): {
+				ch.pan = (note.param + 2) >> 2;
+				break;
+			}
+		}
+	}
+}
+
+void Renderer::advanceTick() {
+	if (tick_ == 0)
+		processRow();
+
+	// A tick lasts 2.5 / tempo seconds, carry the remainder so rounding never drifts
+	u32 num = options_.sampleRate * 5 + tickRemainder_;
+	u32 den = tempo_ * 2;
+	tickFramesLeft_ = num / den;
+	tickRemainder_ = num % den;
+
+	if (++tick_ >= speed_) {
+		tick_ = 0;
+		if (!nextRow())
+			endPending_ = true;
+	}
+}
+
+// Same as mixing the voices for this many frames, just without the mixing
+void Renderer::skipVoices(u64 frames) {
+	for (Channel& ch : channels_) {
+		Voice& v = ch.voice;
+		if (!v.active)
+			continue;
+
+		const SampleData& s = *v.sample;
+		u64 end = u64(s.loop ? s.loopEnd : s.length) << 32;
+
+		v.pos += frames * v.step;
+
+		if (v.pos >= end) {
+			if (!s.loop) {
+				v.active = false;
+				continue;
+			}
+
+			u64 loopBegin = u64(s.loopBegin) << 32;
+			u64 loopLength = u64(s.loopEnd - s.loopBegin) << 32;
+			v.pos = loopBegin + (v.pos - loopBegin) % loopLength;
+		}
+	}
+}
+
+// Plays through the next tick without mixing, returning how long it was
+size_t Renderer::skipTick() {
+	advanceTick();
+	size_t frames = tickFramesLeft_;
+	skipVoices(frames);
+	tickFramesLeft_ = 0;
+	return frames;
+}
+
+bool Renderer::seek(size_t order) {
+	while (!(order_ == order && atOrderStart())) {
+		if (ended_ || endPending_ || order_ > order)
+			return false;
+		skipTick();
+	}
+
+	return true;
+}
+
+std::vector<Renderer::Segment> Renderer::segments(const IT& module, const Options& options) {
+	// Samples aren't needed to work out timing
+	Renderer timeline(module, options, std::make_shared<const SampleList>());
+	std::vector<Segment> segments;
+	u64 frame = 0;
+
+	while (!timeline.ended_ && !timeline.endPending_) {
+		if (timeline.atOrderStart()) {
+			if (!segments.empty())
+				segments.back().frames = frame - segments.back().startFrame;
+			segments.push_back({ timeline.order_, frame, 0 });
+		}
+
+		frame += timeline.skipTick();
+	}
+
+	if (!segments.empty())
+		segments.back().frames = frame - segments.back().startFrame;
+
+	return segments;
+}
+
+void Renderer::mixVoice(Channel& ch, size_t frames) {
+	Voice& v = ch.voice;
+	const SampleData& s = *v.sample;
+
+	u64 end = u64(s.loop ? s.loopEnd : s.length) << 32;
+	size_t done = 0;
+
+	while (done < frames) {
+		// Render up until the end of the sample or loop, so the kernels don't need to check
+		u64 untilEnd = (end - v.pos + v.step - 1) / v.step;
+		size_t n = std::min<u64>(frames - done, untilEnd);
+
+		if (options_.interpolation == Interpolation::Cubic) {
+			resampleCubic(s.begin(), v.pos, v.step, resampled_.data() + done, n);
+		} else {
+			resampleLinear(s.begin(), v.pos, v.step, resampled_.data() + done, n);
+		}
+
+		v.pos += n * v.step;
+		done += n;
+
+		if (v.pos >= end) {
+			if (!s.loop) {
+				v.active = false;
+				break;
+			}
+
+			u64 loopLength = u64(s.loopEnd - s.loopBegin) << 32;
+			while (v.pos >= end)
+				v.pos -= loopLength;
+		}
+	}
+
+	float gain = ch.volume * ch.chanVolume * s.globalVol * masterGain_;
+	float gainL = gain * (64 - ch.pan) / 64.0f;
+	float gainR = gain * ch.pan / 64.0f;
+
+	mixMono(resampled_.data(), mixL_.data(), mixR_.data(), gainL, gainR, done);
+}
+
+void Renderer::mixBlock(size_t frames) {
+	std::fill_n(mixL_.begin(), frames, 0.0f);
+	std::fill_n(mixR_.begin(), frames, 0.0f);
+
+	for (Channel& ch : channels_) {
+		if (ch.voice.active && !ch.muted)
+			mixVoice(ch, frames);
+	}
+}
+
+template <typename T>
+size_t Renderer::renderFrames(T* out, size_t frames) {
+	size_t done = 0;
+
+	while (done < frames) {
+		if (!tickFramesLeft_) {
+			if (ended_ || endPending_) {
+				ended_ = true;
+				break;
+			}
+			advanceTick();
+		}
+
+		size_t n = std::min({ frames - done, tickFramesLeft_, BLOCK_FRAMES });
+		mixBlock(n);
+		interleave(mixL_.data(), mixR_.data(), out + done * 2, n);
+
+		tickFramesLeft_ -= n;
+		done += n;
+	}
+
+	return done;
+}
+
+size_t Renderer::render(float* out, size_t frames) {
+	return renderFrames(out, frames);
+}
+
+size_t Renderer::render(s16* out, size_t frames) {
+	return renderFrames(out, frames);
+}
+
+/* ============================ *
+ *      Parallel rendering      *
+ * ============================ */
+
+static unsigned resolveThreads(unsigned threads) {
+	return threads ? threads : std::max(1u, std::thread::hardware_concurrency());
+}
+
+std::vector<s16> renderParallel(const IT& module, const Renderer::Options& options) {
+	std::vector<Renderer::Segment> segments = Renderer::segments(module, options);
+	u64 totalFrames = segments.empty() ? 0 : segments.back().startFrame + segments.back().frames;
+
+	std::vector<s16> out(totalFrames * 2);
+
+	// Every segment shares the same converted samples
+	auto samples = Renderer::loadSamples(module);
+	std::atomic<size_t> nextSegment = 0;
+
+	auto worker = [&]() {
+		size_t i;
+		while ((i = nextSegment++) < segments.size()) {
+			const Renderer::Segment& seg = segments[i];
+			Renderer renderer(module, options, samples);
+			renderer.seek(seg.order);
+			renderer.render(out.data() + seg.startFrame * 2, seg.frames);
+		}
+	};
+
+	size_t threads = std::min<size_t>(resolveThreads(options.threads), segments.size());
+	std::vector<std::thread> pool;
+
+	for (size_t t = 1; t < threads; t++)
+		pool.emplace_back(worker);
+	worker();
+	for (std::thread& t : pool)
+		t.join();
+
+	return out;
+}
+
+/* =================== *
+ *      WAV output     *
+ * =================== */
+
+constexpr static u16 WAV_CHANNELS = 2;
+constexpr static u16 WAV_BYTES_PER_FRAME = WAV_CHANNELS * sizeof(s16);
+
+static void writeWAVHeader(io::DataIO& file, u32 sampleRate, u32 dataSize) {
+	file.writeStr("RIFF");
+	file.writeU32LE(dataSize + 36);
+	file.writeStr("WAVE");
+
+	file.writeStr("fmt ");
+	file.writeU32LE(16);
+	file.writeU16LE(1); // PCM
+	file.writeU16LE(WAV_CHANNELS);
+	file.writeU32LE(sampleRate);
+	file.writeU32LE(sampleRate * WAV_BYTES_PER_FRAME);
+	file.writeU16LE(WAV_BYTES_PER_FRAME);
+	file.writeU16LE(16);
+
+	file.writeStr("data");
+	file.writeU32LE(dataSize);
+}
+
+void renderWAV(const IT& module, const fs::path& path, const Renderer::Options& options) {
+	io::FileIO file(path, "wb");
+	renderWAV(module, file, options);
+}
+
+void renderWAV(const IT& module, io::DataIO& file, const Renderer::Options& options) {
+	MIO2IT_STAT_SCOPE("render-wav");
+
+	u32 start = file.tell();
+
+	if (resolveThreads(options.threads) > 1) {
+		std::vector<s16> data = renderParallel(module, options);
+		writeWAVHeader(file, options.sampleRate, data.size() * sizeof(s16));
+		file.writeArrLE(std::span(data));
+		return;
+	}
+
+	// Single threaded, so stream it out instead of holding the whole song in memory
+	Renderer renderer(module, options);
+	std::vector<s16> buf(Renderer::BLOCK_FRAMES * WAV_CHANNELS);
+	u32 dataSize = 0;
+
+	writeWAVHeader(file, options.sampleRate, 0); // Sizes not yet known
+
+	while (size_t frames = renderer.render(buf.data(), Renderer::BLOCK_FRAMES)) {
+		file.writeArrLE(std::span(buf.data(), frames * WAV_CHANNELS));
+		dataSize += frames * WAV_BYTES_PER_FRAME;
+	}
+
+	file.jump(start);
+	writeWAVHeader(file, options.sampleRate, dataSize);
+}
+
+/* ====================== *
+ *      PCM streaming     *
+ * ====================== */
+
+template <typename T>
+static bool streamBlocks(Renderer& renderer, FILE* out) {
+	// Everything is allocated up front, nothing in the loop below allocates
+	std::vector<T> buf(Renderer::BLOCK_FRAMES * 2);
+
+	while (size_t frames = renderer.render(buf.data(), Renderer::BLOCK_FRAMES)) {
+		size_t count = frames * 2;
+
+		swapLE(std::span(buf.data(), count));
+
+		if (fwrite(buf.data(), sizeof(T), count, out) != count || fflush(out) == EOF)
+			return false;
+	}
+
+	return true;
+}
+
+bool streamPCM(const IT& module, FILE* out, PCMFormat format, const Renderer::Options& options) {
+	Renderer renderer(module, options);
+
+	switch (format) {
+		case PCMFormat::S16: return streamBlocks<s16>(renderer, out);
+		case PCMFormat::F32: return streamBlocks<float>(renderer, out);
+	}
+
+	return false;
+}
+
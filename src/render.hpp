@@ -0,0 +1,164 @@
+#pragma once
+#include <cstdio>
+#include <memory>
+#include <vector>
+#include "filesystem.hpp"
+#include "it.hpp"
+#include "types.hpp"
+
+/**
+ * Plays back the subset of Impulse Tracker that converted modules use: notes,
+ * samples, the volume column and set pan/speed/tempo effects. Not meant to be
+ * a full IT player, just enough to preview a record without a tracker.
+ */
+class Renderer {
+public:
+	enum class Interpolation {
+		Linear,
+		Cubic
+	};
+
+	struct Options {
+		u32 sampleRate = 44100;
+		Interpolation interpolation = Interpolation::Linear;
+		unsigned threads = 0; // For renderParallel, 0 uses every core
+	};
+
+	// A stretch of the song that can be rendered independently, one per order
+	struct Segment {
+		size_t order;
+		u64 startFrame;
+		u64 frames;
+	};
+
+	// Frames mixed at a time, output is produced in pieces no bigger than this
+	constexpr static size_t BLOCK_FRAMES = 512;
+
+	Renderer(const IT& module, const Options& options);
+	Renderer(const IT& module) : Renderer(module, Options{}) {}
+
+	/**
+	 * Renders up to `frames` frames of interleaved stereo, returning how many
+	 * were actually rendered. Returns 0 once the song has ended.
+	 */
+	size_t render(float* out, size_t frames);
+	size_t render(s16* out, size_t frames);
+
+	/**
+	 * Moves to the start of `order` without mixing anything. Voices are still
+	 * advanced exactly, so whatever is still ringing from earlier orders gets
+	 * rendered the same as if the song had been played from the start.
+	 * Only valid on a renderer that hasn't rendered anything yet.
+	 */
+	bool seek(size_t order);
+
+	// Splits the song up at each order, with exact frame positions
+	static std::vector<Segment> segments(const IT& module, const Options& options);
+
+	bool ended() const { return ended_; }
+
+	const Options& options() const { return options_; }
+
+private:
+	// Sample converted to float, with guard points around it so interpolation never has to wrap
+	struct SampleData {
+		constexpr static u32 GUARD_BEFORE = 1;
+		constexpr static u32 GUARD_AFTER = 3;
+
+		std::vector<float> data;
+		u32 length = 0;
+		u32 loopBegin = 0;
+		u32 loopEnd = 0;
+		bool loop = false;
+		u32 c5Speed = 8363;
+		float defaultVol = 1.0f;
+		float globalVol = 1.0f;
+
+		const float* begin() const { return data.data() + GUARD_BEFORE; }
+	};
+
+	// Positions are 32.32 fixed point, so skipping ahead is exact
+	struct Voice {
+		const SampleData* sample = nullptr;
+		u64 pos = 0;
+		u64 step = 0;
+		bool active = false;
+	};
+
+	struct Channel {
+		Voice voice;
+		const SampleData* lastSample = nullptr;
+		float volume = 1.0f;     // Note volume, 0..1
+		float chanVolume = 1.0f; // Channel volume, 0..1
+		u8 pan = 32;             // 0..64
+		bool muted = false;
+	};
+
+	using SampleList = std::vector<SampleData>;
+
+	Renderer(const IT& module, const Options& options, std::shared_ptr<const SampleList> samples);
+
+	static std::shared_ptr<const SampleList> loadSamples(const IT& module);
+
+	bool atOrderStart() const { return tick_ == 0 && row_ == 0 && !tickFramesLeft_; }
+	size_t skipTick();
+	void skipVoices(u64 frames);
+
+	bool seekOrder(size_t order);
+	void advanceTick();
+	void processRow();
+	bool nextRow();
+
+	template <typename T>
+	size_t renderFrames(T* out, size_t frames);
+
+	void mixBlock(size_t frames);
+	void mixVoice(Channel& ch, size_t frames);
+
+	Options options_;
+	const IT& module_;
+
+	std::shared_ptr<const SampleList> samples_;
+	std::vector<Channel> channels_;
+
+	size_t order_ = 0;
+	u16 row_ = 0;
+	u8 tick_ = 0;
+	u8 speed_;
+	u8 tempo_;
+	u32 tickRemainder_ = 0;   // Keeps tick lengths exact over the whole song
+	size_t tickFramesLeft_ = 0;
+	bool endPending_ = false; // Last tick has started, song ends once it's rendered
+	bool ended_ = false;
+	float masterGain_;
+
+	friend std::vector<s16> renderParallel(const IT& module, const Options& options);
+
+	// Planar scratch buffers, so mixing works on whole vectors at a time
+	std::vector<float> resampled_;
+	std::vector<float> mixL_;
+	std::vector<float> mixR_;
+};
+
+/**
+ * Renders the whole song as interleaved s16, splitting it up into segments
+ * across threads. The result is identical to rendering it in one go.
+ */
+std::vector<s16> renderParallel(const IT& module, const Renderer::Options& options = {});
+
+void renderWAV(const IT& module, const fs::path& path, const Renderer::Options& options = {});
+
+// Single threaded renders seek back to fill in the header, so `file` has to be seekable then
+void renderWAV(const IT& module, io::DataIO& file, const Renderer::Options& options = {});
+
+enum class PCMFormat {
+	S16,
+	F32
+};
+
+/**
+ * Writes interleaved little endian PCM to `out` a block at a time as the song
+ * plays, flushing after each one so playback can start straight away.
+ * Returns false if writing failed, e.g. the reader went away.
+ */
+bool streamPCM(const IT& module, FILE* out, PCMFormat format, const Renderer::Options& options = {});
@@ -0,0 +1,249 @@
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <vector>
+#include "convert.hpp"
+#include "endian.hpp"
+#include "server.hpp"
+
+#ifndef _WIN32
+#include <cerrno>
+#include <csignal>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+namespace server {
+
+#ifndef _WIN32
+
+static bool readAll(int fd, void* buf, size_t size) {
+	u8* p = static_cast<u8*>(buf);
+	while (size) {
+		ssize_t n = recv(fd, p, size, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		p += n;
+		size -= n;
+	}
+	return true;
+}
+
+static bool writeAll(int fd, const void* buf, size_t size) {
+	const u8* p = static_cast<const u8*>(buf);
+	while (size) {
+		ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		p += n;
+		size -= n;
+	}
+	return true;
+}
+
+static bool sendResponse(int fd, Status status, std::span<const u8> payload) {
+	u8 header[5];
+	u32 size = LE(u32(payload.size()));
+
+	header[0] = static_cast<u8>(status);
+	memcpy(header + 1, &size, sizeof(size));
+
+	return writeAll(fd, header, sizeof(header)) && writeAll(fd, payload.data(), payload.size());
+}
+
+static bool sendError(int fd, const char* message) {
+	return sendResponse(fd, Status::Error, { reinterpret_cast<const u8*>(message), strlen(message) });
+}
+
+/**
+ * Everything a worker needs is kept between requests: the converter with its
+ * prelinked instrument banks, and buffers that only ever grow.
+ */
+struct Worker {
+	mio2it::Converter converter;
+	std::vector<u8> request;
+	std::vector<u8> response;
+
+	void handleClient(int fd);
+};
+
+void Worker::handleClient(int fd) {
+	for (;;) {
+		u8 header[5];
+		u32 size;
+
+		if (!readAll(fd, header, sizeof(header)))
+			return;
+
+		memcpy(&size, header + 1, sizeof(size));
+		size = LE(size);
+
+		if (size > MAX_REQUEST_SIZE) {
+			sendError(fd, "Request too large");
+			return;
+		}
+
+		request.resize(size);
+		if (!readAll(fd, request.data(), size))
+			return;
+
+		// Bad input comes back as an error rather than being thrown, as there could be a lot of it
+		std::expected<void, std::error_code> result;
+
+		try {
+			switch (static_cast<Request>(header[0])) {
+				case Request::Convert: {
+					result = converter.tryConvert(request, response);
+					break;
+				}
+
+				case Request::Scan: {
+					MIO mio;
+					result = mio.tryLoad(request);
+					if (result) {
+						std::string info = mio2it::describe(mio);
+						response.assign(info.begin(), info.end());
+					}
+					break;
+				}
+
+				default: {
+					if (!sendError(fd, "Unknown request type"))
+						return;
+					continue;
+				}
+			}
+		} catch (std::exception& err) {
+			if (!sendError(fd, err.what()))
+				return;
+			continue;
+		}
+
+		if (!result) {
+			if (!sendError(fd, result.error().message().c_str()))
+				return;
+			continue;
+		}
+
+		if (!sendResponse(fd, Status::OK, response))
+			return;
+	}
+}
+
+/**
+ * A socket left behind by a previous run gets replaced, but not one another
+ * server is still answering on, and never anything that isn't a socket.
+ */
+static bool clearStaleSocket(const sockaddr_un& addr) {
+	struct stat st;
+	if (lstat(addr.sun_path, &st)) {
+		if (errno == ENOENT)
+			return true;
+		perror("Failed to check socket path");
+		return false;
+	}
+
+	if (!S_ISSOCK(st.st_mode)) {
+		fprintf(stderr, "%s already exists and isn't a socket\n", addr.sun_path);
+		return false;
+	}
+
+	int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (probe < 0) {
+		perror("Failed to create socket");
+		return false;
+	}
+
+	bool answered = !connect(probe, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr));
+	close(probe);
+
+	if (answered) {
+		fprintf(stderr, "Another server is already listening on %s\n", addr.sun_path);
+		return false;
+	}
+
+	if (unlink(addr.sun_path) && errno != ENOENT) {
+		perror("Failed to remove old socket");
+		return false;
+	}
+
+	return true;
+}
+
+bool serve(const fs::path& socketPath, unsigned workers) {
+	sockaddr_un addr{};
+	addr.sun_family = AF_UNIX;
+
+	if (socketPath.native().size() >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path is too long\n");
+		return false;
+	}
+
+	strcpy(addr.sun_path, socketPath.c_str());
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("Failed to create socket");
+		return false;
+	}
+
+	if (!clearStaleSocket(addr)) {
+		close(fd);
+		return false;
+	}
+
+	if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) || listen(fd, SOMAXCONN)) {
+		perror("Failed to listen on socket");
+		close(fd);
+		return false;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	// Each worker accepts connections itself, so there's no hand-off between threads
+	auto work = [fd]() {
+		Worker worker;
+
+		for (;;) {
+			int client = accept4(fd, nullptr, nullptr, SOCK_CLOEXEC);
+			if (client < 0) {
+				if (errno == EINTR || errno == ECONNABORTED)
+					continue;
+				perror("Failed to accept connection");
+				return;
+			}
+
+			worker.handleClient(client);
+			close(client);
+		}
+	};
+
+	fprintf(stderr, "Listening on %s with %u workers\n", addr.sun_path, workers);
+
+	std::vector<std::thread> pool;
+	for (unsigned i = 1; i < workers; i++)
+		pool.emplace_back(work);
+	work();
+	for (std::thread& t : pool)
+		t.join();
+
+	close(fd);
+	return true;
+}
+
+#else
+
+bool serve(const fs::path&, unsigned) {
+	fprintf(stderr, "--serve is not supported on Windows\n");
+	return false;
+}
+
+#endif
+
+} // namespace server
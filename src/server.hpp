@@ -0,0 +1,29 @@
+#pragma once
+#include "filesystem.hpp"
+#include "types.hpp"
+
+/**
+ * Conversion daemon listening on a Unix domain socket, so a pipeline can keep
+ * one process with warm caches around instead of spawning one per file.
+ *
+ * Clients can send any number of requests over a connection, one at a time:
+ *   u8 type ('C' to convert to IT, 'S' to scan for info), u32 LE length, payload (MIO file)
+ * and get back for each:
+ *   u8 status (0 = OK, 1 = error), u32 LE length, payload (IT file, info text or error message)
+ */
+namespace server {
+	constexpr u32 MAX_REQUEST_SIZE = 1 << 20;
+
+	enum class Request : u8 {
+		Convert = 'C',
+		Scan    = 'S'
+	};
+
+	enum class Status : u8 {
+		OK    = 0,
+		Error = 1
+	};
+
+	// Runs until killed, with a fixed pool of `workers` threads. Returns false if it couldn't start
+	bool serve(const fs::path& socketPath, unsigned workers);
+} // namespace server
@@ -0,0 +1,187 @@
+#include <algorithm>
+#include "song.hpp"
+#include "stats.hpp"
+#include "utils.hpp"
+
+#ifdef MIO2IT_AVX2_DISPATCH
+	#include <immintrin.h>
+#elif defined(MIO2IT_SSE2)
+	#include <emmintrin.h>
+#endif
+
+constexpr static u8 MIOToPanTable[] = { 0, 16, 32, 48, 64 };
+
+// MIO note 0 is G-3
+constexpr static u8 MIO_NOTE_OFFSET = 7 + (12 * 3);
+
+// Values outside of 0..4 shouldn't happen, but don't trust the file
+static u8 convertPan(u8 pan) {
+	return MIOToPanTable[std::min<u8>(pan, 4)];
+}
+
+static u8 convertVolume(u8 vol) {
+	return std::min<u8>(vol, 4) * 16;
+}
+
+/* ====================== *
+ *      Note kernels      *
+ * ====================== */
+
+/**
+ * Maps a lane of 32 notes, returning which rows have one. Adding the offset
+ * wraps NO_NOTE round to something else, so it's ORed back in afterwards.
+ */
+[[maybe_unused]] static u32 mapLaneScalar(const u8* in, u8* out) {
+	u32 occupied = 0;
+
+	for (int n = 0; n < Song::ROWS; n++) {
+		bool empty = in[n] == MIO::Record::NO_NOTE;
+		out[n] = empty ? Song::NO_NOTE : u8(in[n] + MIO_NOTE_OFFSET);
+		occupied |= u32(!empty) << n;
+	}
+
+	return occupied;
+}
+
+#ifdef MIO2IT_SSE2
+static u32 mapLaneSSE2(const u8* in, u8* out) {
+	const __m128i empty = _mm_set1_epi8(char(MIO::Record::NO_NOTE));
+	const __m128i offset = _mm_set1_epi8(MIO_NOTE_OFFSET);
+	u32 emptyMask = 0;
+
+	for (int i = 0; i < 2; i++) {
+		__m128i notes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i * 16));
+		__m128i isEmpty = _mm_cmpeq_epi8(notes, empty);
+		__m128i mapped = _mm_or_si128(_mm_add_epi8(notes, offset), isEmpty);
+
+		_mm_store_si128(reinterpret_cast<__m128i*>(out + i * 16), mapped);
+		emptyMask |= u32(_mm_movemask_epi8(isEmpty)) << (i * 16);
+	}
+
+	return ~emptyMask;
+}
+#endif
+
+#ifdef MIO2IT_AVX2_DISPATCH
+MIO2IT_TARGET_AVX2 static u32 mapLaneAVX2(const u8* in, u8* out) {
+	__m256i notes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in));
+	__m256i isEmpty = _mm256_cmpeq_epi8(notes, _mm256_set1_epi8(char(MIO::Record::NO_NOTE)));
+	__m256i mapped = _mm256_or_si256(_mm256_add_epi8(notes, _mm256_set1_epi8(MIO_NOTE_OFFSET)), isEmpty);
+
+	_mm256_store_si256(reinterpret_cast<__m256i*>(out), mapped);
+	return ~u32(_mm256_movemask_epi8(isEmpty));
+}
+#endif
+
+using MapLaneFunc = u32 (*)(const u8* in, u8* out);
+
+static MapLaneFunc pickMapLane() {
+#ifdef MIO2IT_AVX2_DISPATCH
+	if (hasAVX2())
+		return mapLaneAVX2;
+#endif
+#ifdef MIO2IT_SSE2
+	return mapLaneSSE2;
+#else
+	return mapLaneScalar;
+#endif
+}
+
+static const MapLaneFunc mapLane = pickMapLane();
+
+// Every lane of a phrase, four tracks and then the rhythm track's four
+static void mapPhraseNotes(const MIO::Record::Phrase& in, Song::Phrase& out) {
+	for (int t = 0; t < MIO::Record::TRACK_COUNT; t++) {
+		Song::Channel& ch = out.channels[t];
+		ch.occupied = mapLane(in.tracks[t].notes, ch.notes);
+	}
+
+	for (int c = 0; c < MIO::Record::RHYTHM_SIMULTANEOUS_NOTES; c++) {
+		Song::Channel& ch = out.channels[Song::RHYTHM_CHANNEL + c];
+		ch.occupied = mapLane(in.rhythmTrack.notes[c], ch.notes);
+	}
+}
+
+/* ============== *
+ *      Song      *
+ * ============== */
+
+static u8 findInstrument(std::vector<Song::Instrument>& instruments, Song::Instrument instr) {
+	auto found = std::find(instruments.begin(), instruments.end(), instr);
+	if (found != instruments.end())
+		return found - instruments.begin();
+
+	instruments.push_back(instr);
+	return instruments.size() - 1;
+}
+
+u32 Song::Phrase::activeRows() const {
+	u32 rows = 0;
+
+	for (const Channel& ch : channels) {
+		rows |= ch.occupied;
+		if (ch.pan != NO_PAN)
+			rows |= 1;
+	}
+
+	return rows;
+}
+
+void Song::load(const MIO::Record& record) {
+	MIO2IT_STAT_SCOPE("song");
+
+	bpm = record.bpm();
+	swing = record.swing;
+
+	order.resize(std::min<int>(record.endPhrase, PHRASES));
+	for (size_t i = 0; i < order.size(); i++)
+		order[i] = i;
+
+	instruments.clear();
+
+	// Pan is only written out when it changes, starting from the centre
+	u8 lastPan[CHANNELS];
+	std::fill_n(lastPan, CHANNELS, convertPan(2));
+	std::fill_n(defaults.volume, CHANNELS, NO_VOLUME);
+	u32 volumeSeen = 0; // Bit per channel
+
+	for (int p = 0; p < PHRASES; p++) {
+		const MIO::Record::Phrase& in = record.phrases[p];
+		Phrase& out = phrases[p];
+
+		mapPhraseNotes(in, out);
+
+		for (int c = 0; c < CHANNELS; c++) {
+			// The rhythm track is split up into a channel for each note that can play at once
+			bool rhythm = c >= RHYTHM_CHANNEL;
+			const MIO::Record::Track& track = in.tracks[std::min(c, RHYTHM_CHANNEL - 1)];
+
+			u8 set = rhythm ? in.rhythmTrack.instrumentSet : track.instrumentSet;
+			u8 volume = rhythm ? in.rhythmTrack.volume : track.volume;
+			u8 pan = convertPan(rhythm ? in.rhythmTrack.panning : track.panning);
+
+			Channel& ch = out.channels[c];
+			ch.instrument = findInstrument(instruments, { set, rhythm });
+			ch.volume = convertVolume(volume);
+			ch.pan = pan != lastPan[c] ? pan : NO_PAN;
+			lastPan[c] = pan;
+
+			if (p == 0) {
+				defaults.pan[c] = pan;
+			} else if (ch.pan != NO_PAN) {
+				defaults.pan[c] = NO_PAN;
+			}
+
+			// Only phrases where the channel plays anything have a say in its volume
+			if (ch.occupied) {
+				if (volumeSeen & (1u << c)) {
+					if (defaults.volume[c] != ch.volume)
+						defaults.volume[c] = NO_VOLUME;
+				} else {
+					defaults.volume[c] = ch.volume;
+					volumeSeen |= 1u << c;
+				}
+			}
+		}
+	}
+}
@@ -0,0 +1,69 @@
+#pragma once
+#include <vector>
+#include "mio.hpp"
+#include "types.hpp"
+
+/**
+ * A record boiled down to just what plays. Each phrase's channels are stored
+ * column by column, with a bitmask of which rows have notes, so output
+ * formats only ever touch what's actually there instead of going over every
+ * empty row. Everything but the notes is the same for a whole phrase.
+ */
+struct Song {
+	constexpr static int PHRASES = MIO::Record::MAX_PHRASES;
+	constexpr static int ROWS = MIO::Record::TRACK_LENGTH;
+	constexpr static int RHYTHM_CHANNEL = MIO::Record::TRACK_COUNT; // First of the rhythm track's channels
+	constexpr static int CHANNELS = MIO::Record::TRACK_COUNT + MIO::Record::RHYTHM_SIMULTANEOUS_NOTES;
+
+	constexpr static u8 NO_NOTE = 0xFF;
+	constexpr static u8 NO_PAN = 0xFF;
+	constexpr static u8 NO_VOLUME = 0xFF;
+
+	static_assert(ROWS == 32, "Occupancy masks need a bit per row");
+
+	// Instrument set as picked in the composer
+	struct Instrument {
+		u8 set;
+		bool rhythm;
+
+		bool operator==(const Instrument&) const = default;
+	};
+
+	struct Channel {
+		alignas(32) u8 notes[ROWS]; // Semitones, 60 being C-5 like in IT. NO_NOTE where there isn't one
+		u32 occupied = 0;           // Bit n is set if there's a note on row n
+		u8 instrument = 0;          // Index into `instruments`
+		u8 volume = 0;              // 0..64
+		u8 pan = NO_PAN;            // 0..64, only set when it changes from the phrase before. Takes effect on row 0
+	};
+
+	struct Phrase {
+		Channel channels[CHANNELS];
+
+		// Rows that have anything on them in any channel
+		u32 activeRows() const;
+	};
+
+	// What each channel keeps for the whole song, so it can be set once up front instead of in every phrase
+	struct Defaults {
+		u8 volume[CHANNELS]; // Across every phrase the channel has notes in. NO_VOLUME if it changes or there aren't any
+		u8 pan[CHANNELS];    // NO_PAN if any phrase after the first moves it
+
+		bool operator==(const Defaults&) const = default;
+	};
+
+	void load(const MIO::Record& record);
+
+	u16 bpm = 120;
+	bool swing = false;
+
+	// Phrases in the order they're played
+	std::vector<u8> order;
+
+	// In the order they're first used. Every track's set is listed, even if it plays nothing
+	std::vector<Instrument> instruments;
+
+	Phrase phrases[PHRASES];
+
+	Defaults defaults;
+};
@@ -0,0 +1,218 @@
+#include "stats.hpp"
+
+namespace stats {
+
+IOCounters& IOCounters::operator+=(const IOCounters& other) {
+	reads += other.reads;
+	readBytes += other.readBytes;
+	writes += other.writes;
+	writeBytes += other.writeBytes;
+	seeks += other.seeks;
+	flushes += other.flushes;
+	return *this;
+}
+
+IOCounters IOCounters::operator-(const IOCounters& other) const {
+	IOCounters out;
+	out.reads = reads - other.reads;
+	out.readBytes = readBytes - other.readBytes;
+	out.writes = writes - other.writes;
+	out.writeBytes = writeBytes - other.writeBytes;
+	out.seeks = seeks - other.seeks;
+	out.flushes = flushes - other.flushes;
+	return out;
+}
+
+} // namespace stats
+
+#ifdef MIO2IT_STATS
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace stats {
+
+struct Event {
+	const char* name;
+	u32 file;   // Index into `files`, 0 is none
+	u32 thread;
+	u64 start;  // Nanoseconds since stats were enabled
+	u64 duration;
+	IOCounters io;
+};
+
+static std::atomic<bool> isEnabled{false};
+static std::atomic<u32> nextThread{1};
+static std::chrono::steady_clock::time_point epoch;
+
+// Only locked when a stage ends, which is rare enough next to the work it times
+static std::mutex mutex;
+static std::vector<Event> events;
+static std::vector<std::string> files{ "" };
+
+static thread_local IOCounters threadIO;
+static thread_local u32 threadID = 0;
+static thread_local u32 currentFile = 0;
+
+static u64 now() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+}
+
+void enable() {
+	epoch = std::chrono::steady_clock::now();
+	isEnabled.store(true, std::memory_order_release);
+}
+
+bool enabled() {
+	return isEnabled.load(std::memory_order_relaxed);
+}
+
+IOCounters& ioCounters() {
+	return threadIO;
+}
+
+Scope::Scope(const char* name) : name_(nullptr) {
+	if (!enabled())
+		return;
+
+	name_ = name;
+	io_ = threadIO;
+	start_ = now();
+}
+
+Scope::~Scope() {
+	if (!name_)
+		return;
+
+	u64 end = now();
+
+	if (!threadID)
+		threadID = nextThread.fetch_add(1, std::memory_order_relaxed);
+
+	std::lock_guard lock(mutex);
+	events.push_back({ name_, currentFile, threadID, start_, end - start_, threadIO - io_ });
+}
+
+FileScope::FileScope(std::string_view file) : previous_(currentFile) {
+	if (!enabled())
+		return;
+
+	std::lock_guard lock(mutex);
+	files.emplace_back(file);
+	currentFile = files.size() - 1;
+}
+
+FileScope::~FileScope() {
+	currentFile = previous_;
+}
+
+/* ================= *
+ *      Output       *
+ * ================= */
+
+void printSummary(FILE* out) {
+	struct Stage {
+		u64 count = 0;
+		u64 total = 0;
+		u64 max = 0;
+		IOCounters io;
+	};
+
+	std::lock_guard lock(mutex);
+
+	// Stages are listed in the order they first happened
+	std::vector<const char*> order;
+	std::map<std::string_view, Stage> stages;
+
+	for (const Event& event : events) {
+		auto [it, inserted] = stages.try_emplace(event.name);
+		if (inserted)
+			order.push_back(event.name);
+
+		Stage& stage = it->second;
+		stage.count++;
+		stage.total += event.duration;
+		stage.max = std::max(stage.max, event.duration);
+		stage.io += event.io;
+	}
+
+	fprintf(out, "%-12s %7s %11s %10s %10s %9s %10s %9s %10s %8s %8s\n",
+	        "stage", "count", "total ms", "mean us", "max us", "reads", "read KiB", "writes", "write KiB", "seeks", "flushes");
+
+	for (const char* name : order) {
+		const Stage& stage = stages[name];
+		fprintf(out, "%-12s %7llu %11.2f %10.1f %10.1f %9llu %10.1f %9llu %10.1f %8llu %8llu\n",
+		        name,
+		        static_cast<unsigned long long>(stage.count),
+		        stage.total / 1e6,
+		        stage.total / 1e3 / stage.count,
+		        stage.max / 1e3,
+		        static_cast<unsigned long long>(stage.io.reads),
+		        stage.io.readBytes / 1024.0,
+		        static_cast<unsigned long long>(stage.io.writes),
+		        stage.io.writeBytes / 1024.0,
+		        static_cast<unsigned long long>(stage.io.seeks),
+		        static_cast<unsigned long long>(stage.io.flushes));
+	}
+}
+
+static void writeJSONString(FILE* out, std::string_view str) {
+	fputc('"', out);
+
+	for (char c : str) {
+		switch (c) {
+			case '"':  { fputs("\\\"", out); break; }
+			case '\\': { fputs("\\\\", out); break; }
+			default: {
+				if (static_cast<u8>(c) < 0x20) {
+					fprintf(out, "\\u%04x", c);
+				} else {
+					fputc(c, out);
+				}
+			}
+		}
+	}
+
+	fputc('"', out);
+}
+
+bool writeTrace(const fs::path& path) {
+	FILE* out = fopen(path.string().c_str(), "wb");
+	if (!out)
+		return false;
+
+	std::lock_guard lock(mutex);
+
+	// Complete events, timestamps are in microseconds
+	fputs("{\"traceEvents\":[\n", out);
+
+	for (size_t i = 0; i < events.size(); i++) {
+		const Event& event = events[i];
+
+		fputs("{\"name\":", out);
+		writeJSONString(out, event.name);
+		fprintf(out, ",\"cat\":\"mio2it\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"file\":",
+		        event.thread, event.start / 1e3, event.duration / 1e3);
+		writeJSONString(out, files[event.file]);
+		fprintf(out, ",\"reads\":%llu,\"readBytes\":%llu,\"writes\":%llu,\"writeBytes\":%llu,\"seeks\":%llu,\"flushes\":%llu}}%s\n",
+		        static_cast<unsigned long long>(event.io.reads),
+		        static_cast<unsigned long long>(event.io.readBytes),
+		        static_cast<unsigned long long>(event.io.writes),
+		        static_cast<unsigned long long>(event.io.writeBytes),
+		        static_cast<unsigned long long>(event.io.seeks),
+		        static_cast<unsigned long long>(event.io.flushes),
+		        i + 1 < events.size() ? "," : "");
+	}
+
+	fputs("],\"displayTimeUnit\":\"ms\"}\n", out);
+	return fclose(out) == 0;
+}
+
+} // namespace stats
+
+#endif
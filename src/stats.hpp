@@ -0,0 +1,84 @@
+#pragma once
+#include <cstdio>
+#include <string_view>
+#include "filesystem.hpp"
+#include "types.hpp"
+
+/**
+ * Timings for each stage of converting a file, along with how much file IO
+ * each one did, for finding out where time goes in a slow batch. Only
+ * io::FileIO and aio queues are counted, in-memory IO isn't interesting here.
+ * Everything here compiles to nothing without MIO2IT_STATS, and when it is
+ * compiled in, stages are only timed once enabled.
+ */
+namespace stats {
+	struct IOCounters {
+		u64 reads = 0;
+		u64 readBytes = 0;
+		u64 writes = 0;
+		u64 writeBytes = 0;
+		u64 seeks = 0;
+		u64 flushes = 0;
+
+		IOCounters& operator+=(const IOCounters& other);
+		IOCounters operator-(const IOCounters& other) const;
+	};
+
+#ifdef MIO2IT_STATS
+	constexpr bool COMPILED_IN = true;
+
+	void enable();
+	bool enabled();
+
+	// Totals for IO done on this thread so far
+	IOCounters& ioCounters();
+
+	// Times from construction to destruction. `name` has to outlive everything, so use a literal
+	class Scope {
+	public:
+		Scope(const char* name);
+		~Scope();
+
+		Scope(const Scope&) = delete;
+		Scope& operator=(const Scope&) = delete;
+
+	private:
+		const char* name_;
+		u64 start_;
+		IOCounters io_;
+	};
+
+	// Stages timed on this thread while this is around get attributed to `file`
+	class FileScope {
+	public:
+		FileScope(std::string_view file);
+		~FileScope();
+
+		FileScope(const FileScope&) = delete;
+		FileScope& operator=(const FileScope&) = delete;
+
+	private:
+		u32 previous_;
+	};
+
+	// Table of each stage's count, times and IO
+	void printSummary(FILE* out);
+
+	// Chrome trace event JSON, for chrome://tracing or Perfetto. Returns false if writing failed
+	bool writeTrace(const fs::path& path);
+
+	#define MIO2IT_STATS_CONCAT_(a, b) a##b
+	#define MIO2IT_STATS_CONCAT(a, b) MIO2IT_STATS_CONCAT_(a, b)
+
+	#define MIO2IT_STAT_SCOPE(name) stats::Scope MIO2IT_STATS_CONCAT(statScope, __LINE__)(name)
+	#define MIO2IT_STAT_FILE(file) stats::FileScope MIO2IT_STATS_CONCAT(statFile, __LINE__)(file)
+	#define MIO2IT_STAT_COUNT(counter, n) (stats::ioCounters().counter += (n))
+#else
+	constexpr bool COMPILED_IN = false;
+
+	// sizeof counts as using what's passed in without evaluating it, so nothing gets warned about or built for nothing
+	#define MIO2IT_STAT_SCOPE(name) ((void)0)
+	#define MIO2IT_STAT_FILE(file) ((void)sizeof(file))
+	#define MIO2IT_STAT_COUNT(counter, n) ((void)0)
+#endif
+} // namespace stats
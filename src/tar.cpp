@@ -0,0 +1,220 @@
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <optional>
+#include <stdexcept>
+#include <string_view>
+#include "io.hpp"
+#include "stats.hpp"
+#include "tar.hpp"
+
+namespace tar {
+
+constexpr static size_t BLOCK_SIZE = 512;
+
+// Header field offsets and sizes
+constexpr static size_t NAME_OFFSET     = 0;
+constexpr static size_t NAME_SIZE       = 100;
+constexpr static size_t SIZE_OFFSET     = 124;
+constexpr static size_t SIZE_SIZE       = 12;
+constexpr static size_t CHECKSUM_OFFSET = 148;
+constexpr static size_t CHECKSUM_SIZE   = 8;
+constexpr static size_t TYPE_OFFSET     = 156;
+constexpr static size_t MAGIC_OFFSET    = 257;
+constexpr static size_t PREFIX_OFFSET   = 345;
+constexpr static size_t PREFIX_SIZE     = 155;
+
+// pax headers and GNU long names get read in whole, nothing sensible needs more than this
+constexpr static u64 MAX_META_SIZE = 1 << 20;
+
+static std::string_view fieldString(const u8* field, size_t size) {
+	const char* str = reinterpret_cast<const char*>(field);
+	return { str, strnlen(str, size) };
+}
+
+// Octal, or for GNU, big endian base-256 when the top bit's set for values that don't fit
+static u64 parseNumber(const u8* field, size_t size) {
+	u64 value = 0;
+
+	if (field[0] & 0x80) {
+		value = field[0] & 0x7F;
+		for (size_t i = 1; i < size; i++)
+			value = (value << 8) | field[i];
+		return value;
+	}
+
+	size_t i = 0;
+	while (i < size && field[i] == ' ')
+		i++;
+	for (; i < size && field[i] >= '0' && field[i] <= '7'; i++)
+		value = value * 8 + (field[i] - '0');
+
+	return value;
+}
+
+// Summed with the checksum field as spaces. Some old tars summed signed bytes, so that's allowed too
+static bool checksumMatches(const u8* block) {
+	u64 expected = parseNumber(block + CHECKSUM_OFFSET, CHECKSUM_SIZE);
+	u64 sum = 0;
+	s64 signedSum = 0;
+
+	for (size_t i = 0; i < BLOCK_SIZE; i++) {
+		bool inChecksum = i >= CHECKSUM_OFFSET && i < CHECKSUM_OFFSET + CHECKSUM_SIZE;
+		u8 b = inChecksum ? ' ' : block[i];
+		sum += b;
+		signedSum += static_cast<s8>(b);
+	}
+
+	return sum == expected || signedSum == static_cast<s64>(expected);
+}
+
+static u64 paddedSize(u64 size) {
+	return (size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+}
+
+Reader::Reader(io::DataIO& in) : in_(in) {}
+
+void Reader::readPadded(u8* out, u64 size) {
+	if (in_.read(out, 1, size) != size) {
+		throw std::runtime_error("Unexpected end of tar archive");
+	}
+
+	skip(paddedSize(size) - size);
+}
+
+// Read through rather than seeked past, as the archive could be coming from a pipe
+void Reader::skip(u64 size) {
+	scratch_.resize(64 * 1024);
+
+	while (size) {
+		size_t chunk = std::min<u64>(size, scratch_.size());
+		if (in_.read(scratch_.data(), 1, chunk) != chunk) {
+			throw std::runtime_error("Unexpected end of tar archive");
+		}
+		size -= chunk;
+	}
+}
+
+bool Reader::next(Member& member, u64 maxSize) {
+	MIO2IT_STAT_SCOPE("tar-read");
+
+	// pax headers and GNU long names only apply to the entry right after them
+	std::optional<std::string> longName;
+	u64 longSize = 0;
+	bool hasLongSize = false;
+
+	u8 block[BLOCK_SIZE];
+
+	while (!ended_) {
+		size_t read = in_.read(block, 1, sizeof(block));
+
+		// Plenty of tools leave off the end marker, which is fine as long as it stops between members
+		if (read == 0 && in_.eof() && !longName && !hasLongSize) {
+			ended_ = true;
+			break;
+		}
+
+		if (read != sizeof(block)) {
+			throw std::runtime_error("Unexpected end of tar archive");
+		}
+
+		// The end is marked with two empty blocks, no need to go looking for the second
+		if (std::all_of(std::begin(block), std::end(block), [](u8 b) { return b == 0; })) {
+			ended_ = true;
+			break;
+		}
+
+		if (!checksumMatches(block)) {
+			throw std::runtime_error("Invalid tar header");
+		}
+
+		u64 size = parseNumber(block + SIZE_OFFSET, SIZE_SIZE);
+		char type = block[TYPE_OFFSET];
+
+		if (type == 'x' || type == 'L') {
+			if (size > MAX_META_SIZE) {
+				throw std::runtime_error("Tar extended header is too large");
+			}
+
+			std::vector<u8> meta(size);
+			readPadded(meta.data(), size);
+
+			if (type == 'L') {
+				longName = std::string(fieldString(meta.data(), meta.size()));
+				continue;
+			}
+
+			// Records of "<length> <key>=<value>\n"
+			std::string_view rest(reinterpret_cast<const char*>(meta.data()), meta.size());
+			while (!rest.empty()) {
+				size_t length = 0;
+				auto [lengthEnd, err] = std::from_chars(rest.data(), rest.data() + rest.size(), length);
+				if (err != std::errc() || lengthEnd == rest.data() + rest.size() || *lengthEnd != ' ' || length > rest.size() || length < size_t(lengthEnd - rest.data()) + 2) {
+					throw std::runtime_error("Invalid pax header");
+				}
+
+				std::string_view record = rest.substr(lengthEnd - rest.data() + 1, length - (lengthEnd - rest.data()) - 2);
+				rest.remove_prefix(length);
+
+				size_t equals = record.find('=');
+				std::string_view key = record.substr(0, equals);
+				std::string_view value = equals == record.npos ? std::string_view() : record.substr(equals + 1);
+
+				if (key == "path") {
+					longName = std::string(value);
+				} else if (key == "size") {
+					auto [sizeEnd, sizeErr] = std::from_chars(value.data(), value.data() + value.size(), longSize);
+					if (sizeErr != std::errc() || sizeEnd != value.data() + value.size()) {
+						throw std::runtime_error("Invalid pax header");
+					}
+					hasLongSize = true;
+				}
+			}
+
+			continue;
+		}
+
+		bool regular = type == '0' || type == '\0' || type == '7';
+
+		if (!regular) {
+			skip(paddedSize(size));
+			longName.reset();
+			hasLongSize = false;
+			continue;
+		}
+
+		if (longName) {
+			member.name = std::move(*longName);
+		} else {
+			std::string_view name = fieldString(block + NAME_OFFSET, NAME_SIZE);
+			std::string_view prefix = fieldString(block + PREFIX_OFFSET, PREFIX_SIZE);
+			bool ustar = !memcmp(block + MAGIC_OFFSET, "ustar", 5);
+
+			member.name.clear();
+			if (ustar && !prefix.empty()) {
+				member.name += prefix;
+				member.name += '/';
+			}
+			member.name += name;
+		}
+
+		if (hasLongSize)
+			size = longSize;
+
+		member.size = size;
+
+		if (size > maxSize) {
+			member.data.clear();
+			skip(paddedSize(size));
+		} else {
+			member.data.resize(size);
+			readPadded(member.data.data(), size);
+		}
+
+		return true;
+	}
+
+	return false;
+}
+
+} // namespace tar
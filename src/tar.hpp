@@ -0,0 +1,50 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "types.hpp"
+
+namespace io {
+	class DataIO;
+}
+
+/**
+ * Reads members out of tar archives front to back, so a whole corpus can be
+ * converted in one sequential read without unpacking it first, even from a
+ * pipe. Understands ustar, along with pax and GNU long names and sizes.
+ * Only regular files are handed back, everything else is skipped over.
+ */
+namespace tar {
+	struct Member {
+		std::string name;
+		u64 size = 0;
+		std::vector<u8> data; // Left empty if the member was too big to read in
+	};
+
+	class Reader {
+	public:
+		/**
+		 * `in` is only ever read from, never seeked. Throws on bad headers, and
+		 * on IO errors as long as `in` does, which is the default. Give `in` EOF
+		 * errors off to allow for archives missing their end marker.
+		 */
+		explicit Reader(io::DataIO& in);
+
+		Reader(const Reader&) = delete;
+		Reader& operator=(const Reader&) = delete;
+
+		/**
+		 * Reads the next regular file into `member`, reusing its buffers.
+		 * Anything bigger than `maxSize` is skipped over without being read in.
+		 * Returns false once the archive ends.
+		 */
+		bool next(Member& member, u64 maxSize);
+
+	private:
+		io::DataIO& in_;
+		std::vector<u8> scratch_;
+		bool ended_ = false;
+
+		void skip(u64 size);
+		void readPadded(u8* out, u64 size);
+	};
+} // namespace tar
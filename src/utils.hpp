@@ -5,3 +5,45 @@
 #else
 	#define MIO2IT_NOINLINE __attribute__((noinline))
 #endif
+
+// SSE2 is part of x86-64, so this only ends up unset on 32-bit x86 builds without it and other architectures
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define MIO2IT_SSE2
+#endif
+
+// AVX2 code paths are compiled in regardless of build flags, and picked at runtime if the CPU has it
+#if defined(__x86_64__) || defined(_M_X64)
+	#define MIO2IT_AVX2_DISPATCH
+
+	#ifdef _MSC_VER
+		#define MIO2IT_TARGET_AVX2
+	#else
+		#define MIO2IT_TARGET_AVX2 __attribute__((target("avx2")))
+	#endif
+#endif
+
+#ifdef MIO2IT_AVX2_DISPATCH
+	#ifdef _MSC_VER
+		#include <intrin.h>
+	#endif
+
+inline bool hasAVX2() {
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7)
+		return false;
+
+	// Has to be enabled by the OS as well, for the registers to be saved
+	__cpuid(info, 1);
+	bool osxsave = info[2] & (1 << 27);
+	if (!osxsave || (_xgetbv(0) & 6) != 6)
+		return false;
+
+	__cpuidex(info, 7, 0);
+	return info[1] & (1 << 5);
+#else
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
@@ -0,0 +1,150 @@
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include "convert.hpp"
+#include "io.hpp"
+#include "watch.hpp"
+
+#ifdef __linux__
+#include <cerrno>
+#include <climits>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+namespace watch {
+
+#ifdef __linux__
+
+struct WatchedFile {
+	File paths;
+	mio2it::IncrementalConverter converter;
+	std::vector<mio2it::IncrementalConverter::Range> changed;
+};
+
+static void writeChanges(WatchedFile& file) {
+	const std::vector<u8>& output = file.converter.output();
+
+	if (file.changed.empty())
+		return;
+
+	// Whole thing changed, or there's nothing to patch
+	if (file.changed[0].offset == 0 || !fs::exists(file.paths.output)) {
+		io::FileIO out(file.paths.output, "wb");
+		out.writeVec(output);
+		return;
+	}
+
+	{
+		io::FileIO out(file.paths.output, "r+b");
+		for (const mio2it::IncrementalConverter::Range& range : file.changed) {
+			out.jump(range.offset);
+			out.write(&output[range.offset], 1, range.size);
+		}
+	}
+
+	if (fs::file_size(file.paths.output) > output.size())
+		fs::resize_file(file.paths.output, output.size());
+}
+
+static void update(WatchedFile& file) {
+	auto start = std::chrono::steady_clock::now();
+
+	// Most likely caught the file half written, it'll get picked up again once it's done
+	MIO mio;
+	if (auto loaded = mio.tryLoad(file.paths.input); !loaded) {
+		fprintf(stderr, "An error occurred converting %s: %s\n", file.paths.input.string().c_str(), loaded.error().message().c_str());
+		return;
+	}
+
+	try {
+		file.converter.update(mio, file.changed);
+		writeChanges(file);
+	} catch (std::exception& err) {
+		fprintf(stderr, "An error occurred converting %s: %s\n", file.paths.input.string().c_str(), err.what());
+		return;
+	}
+
+	auto time = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start);
+
+	if (file.changed.empty()) {
+		printf("%s: nothing changed\n", file.paths.input.string().c_str());
+	} else {
+		size_t bytes = 0;
+		for (const mio2it::IncrementalConverter::Range& range : file.changed)
+			bytes += range.size;
+		printf("%s: rewrote %zu bytes in %.2fms\n", file.paths.output.string().c_str(), bytes, time.count());
+	}
+
+	fflush(stdout);
+}
+
+bool watch(const std::vector<File>& files) {
+	int fd = inotify_init1(IN_CLOEXEC);
+	if (fd < 0) {
+		perror("Failed to start inotify");
+		return false;
+	}
+
+	std::vector<WatchedFile> watched(files.size());
+
+	// Directories get watched rather than the files, as exporting often replaces the file instead of writing to it
+	std::map<int, std::vector<size_t>> byDir;
+
+	for (size_t i = 0; i < files.size(); i++) {
+		watched[i].paths = files[i];
+
+		fs::path dir = files[i].input.parent_path();
+		if (dir.empty())
+			dir = ".";
+
+		int wd = inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+		if (wd < 0) {
+			fprintf(stderr, "Failed to watch %s: %s\n", dir.string().c_str(), strerror(errno));
+			close(fd);
+			return false;
+		}
+
+		byDir[wd].push_back(i);
+		update(watched[i]);
+	}
+
+	alignas(inotify_event) char buf[16 * (sizeof(inotify_event) + NAME_MAX + 1)];
+
+	for (;;) {
+		ssize_t len = read(fd, buf, sizeof(buf));
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("Failed to read inotify events");
+			close(fd);
+			return false;
+		}
+
+		for (ssize_t i = 0; i < len;) {
+			const inotify_event* event = reinterpret_cast<const inotify_event*>(buf + i);
+			i += sizeof(inotify_event) + event->len;
+
+			auto found = byDir.find(event->wd);
+			if (found == byDir.end() || !event->len)
+				continue;
+
+			for (size_t index : found->second) {
+				if (watched[index].paths.input.filename() == event->name)
+					update(watched[index]);
+			}
+		}
+	}
+}
+
+#else
+
+bool watch(const std::vector<File>&) {
+	fprintf(stderr, "--watch is only supported on Linux\n");
+	return false;
+}
+
+#endif
+
+} // namespace watch
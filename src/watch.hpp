@@ -0,0 +1,18 @@
+#pragma once
+#include <vector>
+#include "filesystem.hpp"
+
+/**
+ * Keeps outputs up to date as their records get edited and re-exported. Only
+ * the patterns for phrases that changed are converted again, and only the
+ * parts of the output that changed get rewritten.
+ */
+namespace watch {
+	struct File {
+		fs::path input;
+		fs::path output;
+	};
+
+	// Converts everything once, then runs until killed. Returns false if watching couldn't start
+	bool watch(const std::vector<File>& files);
+} // namespace watch
@@ -0,0 +1,319 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include "formats.hpp"
+#include "io.hpp"
+#include "stats.hpp"
+
+namespace formats {
+
+constexpr static u8 letterInAlphabet(char c) {
+	return c - ('A' - 1);
+}
+
+constexpr static char XM_MAGIC[17] = { 'E','x','t','e','n','d','e','d',' ','M','o','d','u','l','e',':',' ' };
+constexpr static char XM_TRACKER[20] = { 'm','i','o','2','i','t' };
+constexpr static u16 XM_VERSION = 0x0104;
+
+constexpr static u32 XM_HEADER_SIZE = 276;            // Counted from the header size field itself
+constexpr static u32 XM_PATTERN_HEADER_SIZE = 9;
+constexpr static u32 XM_INSTRUMENT_HEADER_SIZE = 263;
+constexpr static u32 XM_SAMPLE_HEADER_SIZE = 40;
+
+constexpr static int XM_MAX_CHANNELS = 32;
+constexpr static int XM_MAX_INSTRUMENTS = 128;
+constexpr static int XM_MAX_ROWS = 256;
+
+constexpr static u8 XM_NOTE_OFF = 97;
+constexpr static u8 XM_FLAG_LINEAR_FREQUENCIES = 1;
+
+enum XMEffects : u8 {
+	XME_SET_PANNING = 0x8,
+	XME_SET_SPEED   = 0xF // Tempo from 0x20 up
+};
+
+enum XMSampleTypes : u8 {
+	XMST_FORWARD_LOOP   = 1,
+	XMST_PING_PONG_LOOP = 2,
+	XMST_16BIT          = 1 << 4
+};
+
+struct XMNote {
+	u8 note = 0;
+	u8 instrument = 0;
+	u8 volume = 0;
+	u8 effect = 0;
+	u8 param = 0;
+};
+
+// XM's C-4 plays a sample at its base rate, where IT's is C-5
+static XMNote convertNote(const IT::Note& in) {
+	XMNote out;
+
+	if (in.note) {
+		u8 note = in.note.value();
+		if (note >= IT::ITNV_NOTE_CUT) {
+			out.note = XM_NOTE_OFF; // Without an envelope, this cuts it
+		} else if (note >= 11 && note - 11 < XM_NOTE_OFF) {
+			out.note = note - 11;
+		}
+	}
+
+	out.instrument = in.instrument;
+
+	if (in.volume <= IT::ITVPR_VOL_END) {
+		out.volume = 0x10 + in.volume;
+	} else if (in.volume >= IT::ITVPR_PAN_START && in.volume <= IT::ITVPR_PAN_END) {
+		out.volume = 0xC0 + std::min(15, (in.volume - IT::ITVPR_PAN_START) / 4);
+	}
+
+	switch (in.effect) {
+		case letterInAlphabet('A'): {
+			if (in.param) {
+				out.effect = XME_SET_SPEED;
+				out.param = std::min<u8>(in.param, 0x1F);
+			}
+			break;
+		}
+
+		case letterInAlphabet('T'): {
+			if (in.param >= 0x20) {
+				out.effect = XME_SET_SPEED;
+				out.param = in.param;
+			}
+			break;
+		}
+
+		case letterInAlphabet('X'): {
+			out.effect = XME_SET_PANNING;
+			out.param = in.param;
+			break;
+		}
+	}
+
+	return out;
+}
+
+static void writePattern(io::DataIO& file, const IT::Pattern& pat, u8 channels) {
+	u32 start = file.tell();
+	u32 end;
+
+	if (pat.rows > XM_MAX_ROWS) {
+		throw std::runtime_error("XM pattern has more than 256 rows");
+	}
+
+	file.writeU32LE(XM_PATTERN_HEADER_SIZE);
+	file.writeU8(0); // Packing type, always 0
+	file.writeU16LE(pat.rows);
+	file.writeU16LE(0); // Packed size, not yet known
+
+	// XM needs every cell written, so empty ones get filled in between the pattern's
+	auto cell = pat.cells.begin();
+
+	for (u32 r = 0; r < pat.rows; r++) {
+		for (u32 c = 0; c < channels; c++) {
+			XMNote note;
+			if (cell != pat.cells.end() && cell->row == r && cell->channel == c)
+				note = convertNote((cell++)->note);
+			u8 mask = 0x80;
+
+			if (note.note)       mask |= 1 << 0;
+			if (note.instrument) mask |= 1 << 1;
+			if (note.volume)     mask |= 1 << 2;
+			if (note.effect)     mask |= 1 << 3;
+			if (note.param)      mask |= 1 << 4;
+
+			// A full note is smaller written as-is
+			if (mask == 0x9F) {
+				file.writeU8(note.note);
+				file.writeU8(note.instrument);
+				file.writeU8(note.volume);
+				file.writeU8(note.effect);
+				file.writeU8(note.param);
+				continue;
+			}
+
+			file.writeU8(mask);
+			if (mask & (1 << 0)) file.writeU8(note.note);
+			if (mask & (1 << 1)) file.writeU8(note.instrument);
+			if (mask & (1 << 2)) file.writeU8(note.volume);
+			if (mask & (1 << 3)) file.writeU8(note.effect);
+			if (mask & (1 << 4)) file.writeU8(note.param);
+		}
+	}
+
+	end = file.tell();
+	file.jump(start + 7);
+	file.writeU16LE(end - (start + XM_PATTERN_HEADER_SIZE));
+	file.jump(end);
+}
+
+/**
+ * XM has no C-5 speed, just a transpose in semitones and a finetune in
+ * 128ths of one, relative to 8363Hz.
+ */
+static void splitC5Speed(u32 c5Speed, s8& relativeNote, s8& finetune) {
+	long total = std::lround(std::log2(std::max<u32>(c5Speed, 1) / 8363.0) * 12 * 128);
+	total = std::clamp(total, -128L * 128, 127L * 128 + 127);
+
+	long note = total >= 0 ? total / 128 : -((-total + 127) / 128);
+	relativeNote = note;
+	finetune = total - note * 128;
+}
+
+// Delta encoded and signed, which IT samples may not be
+static void writeSampleData(io::DataIO& file, const IT::Sample& smpl) {
+	bool is16Bit = smpl.flags & IT::ITSF_SAMPLE_16BIT;
+	bool isSigned = smpl.convertFlags & IT::ITSCF_SIGNED;
+
+	if (is16Bit) {
+		std::vector<u16> delta(smpl.data.size() / 2);
+		u16 last = 0;
+		for (size_t i = 0; i < delta.size(); i++) {
+			u16 value = smpl.data[i * 2] | (smpl.data[i * 2 + 1] << 8);
+			if (!isSigned)
+				value ^= 0x8000;
+			delta[i] = value - last;
+			last = value;
+		}
+		file.writeArrLE(std::span<const u16>(delta));
+	} else {
+		std::vector<u8> delta(smpl.data.size());
+		u8 last = 0;
+		for (size_t i = 0; i < smpl.data.size(); i++) {
+			u8 value = isSigned ? smpl.data[i] : smpl.data[i] ^ 0x80;
+			delta[i] = value - last;
+			last = value;
+		}
+		file.writeVec(delta);
+	}
+}
+
+static void writeInstrument(io::DataIO& file, const IT::Sample& smpl) {
+	bool is16Bit = smpl.flags & IT::ITSF_SAMPLE_16BIT;
+	u32 bytesPerSample = is16Bit ? 2 : 1;
+
+	char name[22]{};
+	memcpy(name, smpl.name, strnlen(smpl.name, sizeof(name)));
+
+	if (smpl.flags & (IT::ITSF_STEREO | IT::ITSF_COMPRESSED_SAMPLES)) {
+		throw std::runtime_error("XM can't store stereo or compressed samples");
+	}
+
+	/* ======================== *
+	 *      Instrument header   *
+	 * ======================== */
+
+	u32 start = file.tell();
+
+	file.writeU32LE(XM_INSTRUMENT_HEADER_SIZE);
+	file.writeArrT(name);
+	file.writeU8(0); // Type, meant to be 0 but is random in practice
+	file.writeU16LE(1);
+
+	file.writeU32LE(XM_SAMPLE_HEADER_SIZE);
+	file.writeN(u8(0), 96); // Every note plays the only sample
+
+	// No envelopes, points, sustain or loops
+	file.writeN(u8(0), 48 + 48 + 2 + 6 + 2);
+
+	file.writeU8(static_cast<u8>(smpl.vibratoType));
+	file.writeU8(smpl.vibratoRate); // Sweep
+	file.writeU8(smpl.vibratoDepth);
+	file.writeU8(smpl.vibratoSpeed);
+
+	file.writeU16LE(0); // Fadeout
+
+	// Rest is reserved
+	file.writeN(u8(0), start + XM_INSTRUMENT_HEADER_SIZE - file.tell());
+
+	/* ===================== *
+	 *      Sample header    *
+	 * ===================== */
+
+	u32 length = smpl.data.size() / bytesPerSample;
+	u32 loopBegin = std::min(smpl.loopBegin, length);
+	u32 loopEnd = std::clamp(smpl.loopEnd, loopBegin, length);
+
+	u8 type = is16Bit ? XMST_16BIT : 0;
+	if (smpl.flags & IT::ITSF_LOOP && loopEnd > loopBegin)
+		type |= (smpl.flags & IT::ITSF_PING_PONG_LOOP) ? XMST_PING_PONG_LOOP : XMST_FORWARD_LOOP;
+
+	s8 relativeNote;
+	s8 finetune;
+	splitC5Speed(smpl.c5Speed, relativeNote, finetune);
+
+	file.writeU32LE(length * bytesPerSample);
+	file.writeU32LE(loopBegin * bytesPerSample);
+	file.writeU32LE((loopEnd - loopBegin) * bytesPerSample);
+	file.writeU8(std::min<u8>(smpl.defaultVol, 64));
+	file.writeS8(finetune);
+	file.writeU8(type);
+	file.writeU8((smpl.defaultPan & 128) ? std::min(255, (smpl.defaultPan & 127) * 4) : 128);
+	file.writeS8(relativeNote);
+	file.writeU8(0); // Reserved, ModPlug uses it for ADPCM
+	file.writeArrT(name);
+
+	writeSampleData(file, smpl);
+}
+
+void saveXM(const IT& module, io::DataIO& file) {
+	MIO2IT_STAT_SCOPE("save-xm");
+
+	std::span<const IT::Sample> samples = module.effectiveSamples();
+	std::vector<u8> orders = playedOrders(module);
+
+	// FT2 only copes with an even number of channels
+	u8 channels = std::max<u8>(2, (usedChannels(module) + 1) & ~1);
+
+	char name[20]{};
+	memcpy(name, module.name, strnlen(module.name, sizeof(name)));
+
+	if (channels > XM_MAX_CHANNELS) {
+		throw std::runtime_error("XM has more than 32 channels");
+	}
+
+	if (samples.size() > XM_MAX_INSTRUMENTS) {
+		throw std::runtime_error("XM has more than 128 instruments");
+	}
+
+	if (module.patterns.size() > 256 || orders.size() > 256) {
+		throw std::runtime_error("XM has more than 256 patterns or orders");
+	}
+
+	/* ======================= *
+	 *      Module header      *
+	 * ======================= */
+
+	file.writeArrT(XM_MAGIC);
+	file.writeArrT(name);
+	file.writeU8(0x1A);
+	file.writeArrT(XM_TRACKER);
+	file.writeU16LE(XM_VERSION);
+
+	file.writeU32LE(XM_HEADER_SIZE);
+	file.writeU16LE(orders.size());
+	file.writeU16LE(0); // Restart position
+	file.writeU16LE(channels);
+	file.writeU16LE(module.patterns.size());
+	file.writeU16LE(samples.size());
+	file.writeU16LE((module.flags & IT::ITMF_LINEAR_SLIDES) ? XM_FLAG_LINEAR_FREQUENCIES : 0);
+	file.writeU16LE(module.initialSpeed);
+	file.writeU16LE(module.initialTempo);
+
+	file.writeVec(orders);
+	file.writeN(u8(0), 256 - orders.size());
+
+	/* ============================== *
+	 *      Patterns and samples      *
+	 * ============================== */
+
+	std::vector<IT::Pattern> storage;
+	for (const IT::Pattern& pat : applyChannelTable(module, storage))
+		writePattern(file, pat, channels);
+
+	for (const IT::Sample& smpl : samples)
+		writeInstrument(file, smpl);
+}
+
+} // namespace formats
@@ -0,0 +1,238 @@
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <ctime>
+#include <stdexcept>
+#include "io.hpp"
+#include "stats.hpp"
+#include "zip.hpp"
+
+namespace zip {
+
+/* ================ *
+ *      CRC-32      *
+ * ================ */
+
+constexpr static u32 CRC_POLYNOMIAL = 0xEDB88320; // Reflected
+
+/**
+ * Slicing-by-8 tables. Table 0 is the usual byte at a time table, and table n
+ * gives the CRC of a byte followed by n zero bytes, so 8 bytes can be looked
+ * up independently of each other and XORed together.
+ */
+constexpr static auto makeCRCTables() {
+	std::array<std::array<u32, 256>, 8> tables{};
+
+	for (u32 i = 0; i < 256; i++) {
+		u32 crc = i;
+		for (int bit = 0; bit < 8; bit++)
+			crc = (crc >> 1) ^ ((crc & 1) ? CRC_POLYNOMIAL : 0);
+		tables[0][i] = crc;
+	}
+
+	for (int t = 1; t < 8; t++) {
+		for (u32 i = 0; i < 256; i++)
+			tables[t][i] = (tables[t - 1][i] >> 8) ^ tables[0][tables[t - 1][i] & 0xFF];
+	}
+
+	return tables;
+}
+
+constexpr static auto CRC_TABLES = makeCRCTables();
+
+static u32 loadU32LE(const u8* p) {
+	u32 value;
+	memcpy(&value, p, sizeof(value));
+	return LE(value);
+}
+
+u32 crc32(std::span<const u8> data, u32 crc) {
+	const u8* p = data.data();
+	size_t size = data.size();
+
+	crc = ~crc;
+
+	for (; size >= 8; p += 8, size -= 8) {
+		u32 lo = loadU32LE(p) ^ crc;
+		u32 hi = loadU32LE(p + 4);
+
+		crc = CRC_TABLES[7][lo & 0xFF] ^ CRC_TABLES[6][(lo >> 8) & 0xFF] ^
+		      CRC_TABLES[5][(lo >> 16) & 0xFF] ^ CRC_TABLES[4][lo >> 24] ^
+		      CRC_TABLES[3][hi & 0xFF] ^ CRC_TABLES[2][(hi >> 8) & 0xFF] ^
+		      CRC_TABLES[1][(hi >> 16) & 0xFF] ^ CRC_TABLES[0][hi >> 24];
+	}
+
+	for (; size; p++, size--)
+		crc = (crc >> 8) ^ CRC_TABLES[0][(crc ^ *p) & 0xFF];
+
+	return ~crc;
+}
+
+/* ================ *
+ *      Writer      *
+ * ================ */
+
+constexpr static u32 LOCAL_HEADER_SIGNATURE   = 0x04034B50;
+constexpr static u32 CENTRAL_HEADER_SIGNATURE = 0x02014B50;
+constexpr static u32 END_SIGNATURE            = 0x06054B50;
+constexpr static u32 ZIP64_END_SIGNATURE      = 0x06064B50;
+constexpr static u32 ZIP64_LOCATOR_SIGNATURE  = 0x07064B50;
+
+constexpr static u16 VERSION_STORED = 10; // 1.0
+constexpr static u16 VERSION_ZIP64  = 45; // 4.5
+constexpr static u16 MADE_BY_UNIX   = 3 << 8;
+
+constexpr static u16 FLAG_UTF8 = 1 << 11;
+constexpr static u16 METHOD_STORED = 0;
+
+constexpr static u16 ZIP64_EXTRA_ID = 0x0001;
+
+constexpr static u32 LOCAL_HEADER_SIZE = 30;
+constexpr static u32 CENTRAL_HEADER_SIZE = 46;
+
+// Values that mean "look in the ZIP64 records instead"
+constexpr static u16 ZIP64_U16 = 0xFFFF;
+constexpr static u32 ZIP64_U32 = 0xFFFFFFFF;
+
+constexpr static u32 UNIX_FILE_MODE = 0100644;
+
+// Entries all get the time the archive was started
+Writer::Writer(io::DataIO& file) : file_(file) {
+	std::time_t now = std::time(nullptr);
+	std::tm local{};
+
+#ifdef _WIN32
+	localtime_s(&local, &now);
+#else
+	localtime_r(&now, &local);
+#endif
+
+	// DOS dates start at 1980, and times only have 2 second precision
+	time_ = (local.tm_hour << 11) | (local.tm_min << 5) | (local.tm_sec / 2);
+	date_ = (std::max(local.tm_year - 80, 0) << 9) | ((local.tm_mon + 1) << 5) | local.tm_mday;
+}
+
+/**
+ * Everything's known up front, so sizes and the CRC go straight in the local
+ * header instead of in a data descriptor after the data. That also means
+ * readers going through the archive front to back can tell where stored data
+ * ends, which they can't with a descriptor.
+ */
+void Writer::add(std::string_view name, std::span<const u8> data) {
+	MIO2IT_STAT_SCOPE("zip-add");
+
+	if (finished_) {
+		throw std::runtime_error("ZIP archive has already been finished");
+	}
+
+	if (data.size() >= ZIP64_U32 || name.size() > ZIP64_U16) {
+		throw std::runtime_error("ZIP entry is too large");
+	}
+
+	Entry& entry = entries_.emplace_back();
+	entry.name = name;
+	entry.crc = crc32(data);
+	entry.size = data.size();
+	entry.offset = offset_;
+
+	file_.writeU32LE(LOCAL_HEADER_SIGNATURE);
+	file_.writeU16LE(VERSION_STORED);
+	file_.writeU16LE(FLAG_UTF8);
+	file_.writeU16LE(METHOD_STORED);
+	file_.writeU16LE(time_);
+	file_.writeU16LE(date_);
+	file_.writeU32LE(entry.crc);
+	file_.writeU32LE(entry.size); // Compressed
+	file_.writeU32LE(entry.size); // Uncompressed
+	file_.writeU16LE(name.size());
+	file_.writeU16LE(0); // Extra field
+	file_.writeStr(name);
+	file_.writeSpan(data);
+
+	offset_ += LOCAL_HEADER_SIZE + name.size() + data.size();
+}
+
+/**
+ * ZIP64 is only used where something doesn't fit, so small archives stay
+ * readable by anything. Entry sizes always fit, only offsets and counts can
+ * outgrow the original fields.
+ */
+void Writer::finish() {
+	MIO2IT_STAT_SCOPE("zip-finish");
+
+	if (finished_)
+		return;
+	finished_ = true;
+
+	u64 directoryOffset = offset_;
+
+	for (const Entry& entry : entries_) {
+		bool zip64 = entry.offset >= ZIP64_U32;
+
+		file_.writeU32LE(CENTRAL_HEADER_SIGNATURE);
+		file_.writeU16LE(MADE_BY_UNIX | (zip64 ? VERSION_ZIP64 : VERSION_STORED));
+		file_.writeU16LE(zip64 ? VERSION_ZIP64 : VERSION_STORED);
+		file_.writeU16LE(FLAG_UTF8);
+		file_.writeU16LE(METHOD_STORED);
+		file_.writeU16LE(time_);
+		file_.writeU16LE(date_);
+		file_.writeU32LE(entry.crc);
+		file_.writeU32LE(entry.size);
+		file_.writeU32LE(entry.size);
+		file_.writeU16LE(entry.name.size());
+		file_.writeU16LE(zip64 ? 12 : 0); // Extra field
+		file_.writeU16LE(0); // Comment
+		file_.writeU16LE(0); // Disk
+		file_.writeU16LE(0); // Internal attributes
+		file_.writeU32LE(UNIX_FILE_MODE << 16);
+		file_.writeU32LE(zip64 ? ZIP64_U32 : entry.offset);
+		file_.writeStr(entry.name);
+
+		if (zip64) {
+			file_.writeU16LE(ZIP64_EXTRA_ID);
+			file_.writeU16LE(8);
+			file_.writeU32LE(entry.offset);
+			file_.writeU32LE(entry.offset >> 32);
+		}
+
+		offset_ += CENTRAL_HEADER_SIZE + entry.name.size() + (zip64 ? 12 : 0);
+	}
+
+	u64 directorySize = offset_ - directoryOffset;
+	u64 count = entries_.size();
+
+	bool zip64 = count >= ZIP64_U16 || directorySize >= ZIP64_U32 || directoryOffset >= ZIP64_U32;
+
+	if (zip64) {
+		u64 endOffset = offset_;
+
+		file_.writeU32LE(ZIP64_END_SIGNATURE);
+		file_.writeU32LE(44); // Size of the rest of the record, as a u64
+		file_.writeU32LE(0);
+		file_.writeU16LE(MADE_BY_UNIX | VERSION_ZIP64);
+		file_.writeU16LE(VERSION_ZIP64);
+		file_.writeU32LE(0); // Disk
+		file_.writeU32LE(0); // Disk with the central directory
+		for (u64 value : { count, count, directorySize, directoryOffset }) {
+			file_.writeU32LE(value);
+			file_.writeU32LE(value >> 32);
+		}
+
+		file_.writeU32LE(ZIP64_LOCATOR_SIGNATURE);
+		file_.writeU32LE(0); // Disk with the ZIP64 end record
+		file_.writeU32LE(endOffset);
+		file_.writeU32LE(endOffset >> 32);
+		file_.writeU32LE(1); // Disks
+	}
+
+	file_.writeU32LE(END_SIGNATURE);
+	file_.writeU16LE(0); // Disk
+	file_.writeU16LE(0); // Disk with the central directory
+	file_.writeU16LE(zip64 ? ZIP64_U16 : count);
+	file_.writeU16LE(zip64 ? ZIP64_U16 : count);
+	file_.writeU32LE(zip64 ? ZIP64_U32 : directorySize);
+	file_.writeU32LE(zip64 ? ZIP64_U32 : directoryOffset);
+	file_.writeU16LE(0); // Comment
+}
+
+} // namespace zip
@@ -0,0 +1,51 @@
+#pragma once
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "types.hpp"
+
+namespace io {
+	class DataIO;
+}
+
+/**
+ * Writes ZIP archives of uncompressed files, for putting a whole batch into
+ * one file rather than one file each. Entries are written front to back and
+ * nothing is ever seeked back to, so the archive can go to a pipe too.
+ */
+namespace zip {
+	// CRC-32 as ZIP uses it, continuing on from `crc` so data can be done in pieces
+	u32 crc32(std::span<const u8> data, u32 crc = 0);
+
+	class Writer {
+	public:
+		// Relies on `file` throwing on errors, which is the default
+		explicit Writer(io::DataIO& file);
+
+		Writer(const Writer&) = delete;
+		Writer& operator=(const Writer&) = delete;
+
+		void add(std::string_view name, std::span<const u8> data);
+
+		// Writes the central directory, after which nothing else can be added
+		void finish();
+
+		size_t size() const { return entries_.size(); }
+
+	private:
+		struct Entry {
+			std::string name;
+			u32 crc;
+			u32 size;
+			u64 offset;
+		};
+
+		io::DataIO& file_;
+		std::vector<Entry> entries_;
+		u64 offset_ = 0;
+		u16 time_;
+		u16 date_;
+		bool finished_ = false;
+	};
+} // namespace zip